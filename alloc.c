@@ -0,0 +1,150 @@
+/*
+ * alloc.c - free-space allocator for the inode and data bitmaps
+ * scans a word at a time with clz, keeps a free count per chunk of words
+ * so full regions get skipped, and resumes from a next-fit hint.
+ * callers serialize the allocator, but ufs reads the bitmap words without
+ * its lock, so the words themselves only change atomically
+ */
+
+#include <stdlib.h>
+
+#include "alloc.h"
+
+// free bits of word w (1 = free), bits past nbits count as used
+static unsigned int free_mask(alloc_t *a, int w) {
+	unsigned int f = ~a->bp[w];
+	if (w == a->nwords - 1 && a->nbits % 32)
+		f &= ~0u << (32 - a->nbits % 32);
+	return f;
+}
+
+static void take(alloc_t *a, int i) {
+	__atomic_fetch_or(&a->bp[i / 32], 1u << (31 - i % 32), __ATOMIC_RELAXED);
+	a->chunk_free[i / 32 / ALLOC_CHUNK_WORDS]--;
+	a->nfree--;
+}
+
+alloc_t* alloc_init(bitmap_t bp, int nbits) {
+	alloc_t *a = malloc(sizeof(alloc_t));
+	a->bp = bp;
+	a->nbits = nbits;
+	a->nwords = (nbits + 31) / 32;
+	a->nchunks = (a->nwords + ALLOC_CHUNK_WORDS - 1) / ALLOC_CHUNK_WORDS;
+	a->chunk_free = calloc(a->nchunks, sizeof(int));
+	a->hint = 0;
+	a->nfree = 0;
+
+	for (int w = 0; w < a->nwords; ++w) {
+		int cnt = __builtin_popcount(free_mask(a, w));
+		a->chunk_free[w / ALLOC_CHUNK_WORDS] += cnt;
+		a->nfree += cnt;
+	}
+	return a;
+}
+
+// allocates one bit, returns its index or -1 if the bitmap is full
+int alloc_get(alloc_t *a) {
+	if (!a->nfree) return -1;
+
+	// one extra round so the words in front of the hint in its chunk get looked at too
+	int c0 = a->hint / ALLOC_CHUNK_WORDS;
+	for (int k = 0; k <= a->nchunks; ++k) {
+		int c = (c0 + k) % a->nchunks;
+		if (!a->chunk_free[c]) continue;
+
+		int ws = k == 0 ? a->hint : c * ALLOC_CHUNK_WORDS;
+		int we = (c + 1) * ALLOC_CHUNK_WORDS;
+		if (we > a->nwords) we = a->nwords;
+
+		for (int w = ws; w < we; ++w) {
+			unsigned int f = free_mask(a, w);
+			if (!f) continue;
+
+			int i = w * 32 + __builtin_clz(f);
+			take(a, i);
+			a->hint = w;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int find_run(alloc_t *a, int ws, int we, int n) {
+	int run = 0, start = -1;
+	for (int w = ws; w < we; ++w) {
+		if (w % ALLOC_CHUNK_WORDS == 0 && !a->chunk_free[w / ALLOC_CHUNK_WORDS]) {
+			run = 0;
+			w += ALLOC_CHUNK_WORDS - 1;
+			continue;
+		}
+
+		unsigned int f = free_mask(a, w);
+		if (f == ~0u) {
+			if (!run) start = w * 32;
+			run += 32;
+			if (run >= n) return start;
+			continue;
+		}
+
+		for (int b = 0; b < 32; ++b) {
+			if (!(f & (1u << (31 - b)))) {
+				run = 0;
+				continue;
+			}
+			if (!run) start = w * 32 + b;
+			if (++run >= n) return start;
+		}
+	}
+	return -1;
+}
+
+// allocates n contiguous bits, returns the first index or -1
+int alloc_get_run(alloc_t *a, int n) {
+	if (n == 1) return alloc_get(a);
+	if (n <= 0 || a->nfree < n) return -1;
+
+	int start = find_run(a, a->hint, a->nwords, n);
+	if (start == -1) start = find_run(a, 0, a->nwords, n);
+	if (start == -1) return -1;
+
+	for (int i = start; i < start + n; ++i) take(a, i);
+	a->hint = (start + n - 1) / 32;
+	return start;
+}
+
+// allocates up to n free bits starting right at i, for growing a run in place.
+// returns how many it got, 0 if i is taken
+int alloc_get_at(alloc_t *a, int i, int n) {
+	if (i < 0) return 0;
+	int got = 0;
+	while (got < n && i + got < a->nbits) {
+		int b = i + got;
+		// whole free words at a time once aligned
+		if (b % 32 == 0 && n - got >= 32 && b + 32 <= a->nbits && a->bp[b / 32] == 0) {
+			__atomic_store_n(&a->bp[b / 32], ~0u, __ATOMIC_RELAXED);
+			a->chunk_free[b / 32 / ALLOC_CHUNK_WORDS] -= 32;
+			a->nfree -= 32;
+			got += 32;
+			continue;
+		}
+		if (a->bp[b / 32] & (1u << (31 - b % 32))) break;
+		take(a, b);
+		got++;
+	}
+	if (got) a->hint = (i + got - 1) / 32;
+	return got;
+}
+
+void alloc_put(alloc_t *a, int i) {
+	if (i < 0 || i >= a->nbits) return;
+	if (!(a->bp[i / 32] & (1u << (31 - i % 32)))) return;
+
+	__atomic_fetch_and(&a->bp[i / 32], ~(1u << (31 - i % 32)), __ATOMIC_RELAXED);
+	a->chunk_free[i / 32 / ALLOC_CHUNK_WORDS]++;
+	a->nfree++;
+}
+
+void alloc_free(alloc_t *a) {
+	free(a->chunk_free);
+	free(a);
+}
@@ -0,0 +1,27 @@
+#ifndef __alloc_h__
+#define __alloc_h__
+
+#include "ufs.h"
+
+// words of bitmap summarized by one free counter
+#define ALLOC_CHUNK_WORDS (32)
+
+// free-space allocator over one of the ufs bitmaps (bit 0 is the MSB of word 0)
+typedef struct __alloc {
+	bitmap_t bp;      // the bitmap being managed, owned by ufs
+	int nbits;        // number of valid bits in bp
+	int nwords;
+	int *chunk_free;  // free bits in each chunk of ALLOC_CHUNK_WORDS words
+	int nchunks;
+	int hint;         // next-fit: word to start the next search at
+	int nfree;
+} alloc_t;
+
+alloc_t* alloc_init(bitmap_t bp, int nbits);
+int alloc_get(alloc_t *a);
+int alloc_get_run(alloc_t *a, int n);
+int alloc_get_at(alloc_t *a, int i, int n);
+void alloc_put(alloc_t *a, int i);
+void alloc_free(alloc_t *a);
+
+#endif // __alloc_h__
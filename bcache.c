@@ -0,0 +1,348 @@
+/*
+ * bcache.c - block buffer cache sitting under ufs.c's Read/Write helpers
+ * fixed pool of UFS_BLOCK_SIZE buffers, hashed by block number,
+ * CLOCK eviction, dirty blocks are written back on flush or eviction.
+ * one lock covers the pool, but block reads for misses and readahead run
+ * without it: the buffer is hashed in as loading and whoever wants it waits.
+ * buffers handed to a commit batch are flushing until bcache_flush_done,
+ * they can be read but not written or reused
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bcache.h"
+
+static int bcache_hash(bcache_t *c, int blk) {
+	return (int)(((unsigned int)blk * 2654435761u) & c->table_mask);
+}
+
+static int bcache_buf_index(bcache_t *c, bcache_buf_t *b) {
+	return c->registered ? (int)(b - c->bufs) : -1;
+}
+
+static int bcache_writeback(bcache_t *c, bcache_buf_t *b) {
+	if (io_rw_fixed(c->io, 1, b->data, UFS_BLOCK_SIZE, (off_t)b->blk * UFS_BLOCK_SIZE, bcache_buf_index(c, b)) == -1)
+		return -1;
+	b->dirty = 0;
+	c->stats.writebacks++;
+	return 0;
+}
+
+static void bcache_unhash(bcache_t *c, bcache_buf_t *b) {
+	bcache_buf_t **p = &c->table[bcache_hash(c, b->blk)];
+	while (*p != b) p = &(*p)->next;
+	*p = b->next;
+	b->next = NULL;
+	if (b->ra) c->stats.ra_wasted++;
+	b->ra = 0;
+}
+
+static void bcache_hash_in(bcache_t *c, bcache_buf_t *b, int blk) {
+	b->blk = blk;
+	b->ref = 1;
+	int h = bcache_hash(c, blk);
+	b->next = c->table[h];
+	c->table[h] = b;
+}
+
+static bcache_buf_t* bcache_lookup(bcache_t *c, int blk) {
+	for (bcache_buf_t *b = c->table[bcache_hash(c, blk)]; b; b = b->next) {
+		if (b->blk == blk) return b;
+	}
+	return NULL;
+}
+
+// a read found blk in the cache
+static void bcache_used(bcache_t *c, bcache_buf_t *b) {
+	b->ref = 1;
+	c->stats.hits++;
+	if (b->ra) c->stats.ra_hits++;
+	b->ra = 0;
+}
+
+// clock sweep for a slot to reuse, free slots are taken right away.
+// NULL if the write back failed, or with *none set if every buffer has I/O in flight
+static bcache_buf_t* bcache_victim(bcache_t *c, int *none) {
+	*none = 0;
+	bcache_buf_t *victim = NULL;
+	for (int i = 0; i <= 2 * c->nbufs; ++i) {
+		bcache_buf_t *b = &c->bufs[c->hand];
+		c->hand = (c->hand + 1) % c->nbufs;
+		if (b->loading || b->flushing) continue;
+		if (b->blk == -1 || !b->ref) {
+			victim = b;
+			break;
+		}
+		b->ref = 0;
+	}
+	if (victim == NULL) {
+		*none = 1;
+		return NULL;
+	}
+
+	if (victim->blk != -1) {
+		if (victim->dirty && bcache_writeback(c, victim) == -1) return NULL;
+		bcache_unhash(c, victim);
+		c->stats.evictions++;
+		victim->blk = -1;
+	}
+	return victim;
+}
+
+bcache_t* bcache_init(io_engine_t *io, int nbufs) {
+	bcache_t *c = malloc(sizeof(bcache_t));
+	memset(c, 0, sizeof(bcache_t));
+	c->io = io;
+	c->nbufs = nbufs;
+	c->bufs = malloc(sizeof(bcache_buf_t) * nbufs);
+	struct iovec *iov = malloc(sizeof(struct iovec) * nbufs);
+	for (int i = 0; i < nbufs; ++i) {
+		c->bufs[i].blk = -1;
+		c->bufs[i].dirty = 0;
+		c->bufs[i].ref = 0;
+		c->bufs[i].ra = 0;
+		c->bufs[i].loading = 0;
+		c->bufs[i].flushing = 0;
+		c->bufs[i].next = NULL;
+		iov[i].iov_base = c->bufs[i].data;
+		iov[i].iov_len = UFS_BLOCK_SIZE;
+	}
+	// engines that can pin the pool skip mapping the pages on every request
+	c->registered = io->register_buffers(io, iov, nbufs) == 0;
+	free(iov);
+
+	int table_sz = 1;
+	while (table_sz < nbufs * 2) table_sz <<= 1;
+	c->table = calloc(table_sz, sizeof(bcache_buf_t*));
+	c->table_mask = table_sz - 1;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->ready, NULL);
+	return c;
+}
+
+// blk's buffer once its contents can be used (and changed, for write), NULL if it isn't cached
+static bcache_buf_t* bcache_wait(bcache_t *c, int blk, int write) {
+	bcache_buf_t *b;
+	while ((b = bcache_lookup(c, blk)) && (b->loading || (write && b->flushing)))
+		pthread_cond_wait(&c->ready, &c->lock);
+	return b;
+}
+
+// returns the buffer holding blk, loading it from disk if fill is set. called
+// and returns with the lock held, which is dropped during the load. *none is
+// set instead if there was no buffer to spare
+static bcache_buf_t* bcache_get(bcache_t *c, int blk, int fill, int write, int *none) {
+	*none = 0;
+	bcache_buf_t *b = bcache_wait(c, blk, write);
+	if (b) {
+		bcache_used(c, b);
+		return b;
+	}
+	c->stats.misses++;
+
+	bcache_buf_t *victim = bcache_victim(c, none);
+	if (victim == NULL) return NULL;
+	bcache_hash_in(c, victim, blk);
+	if (!fill) return victim;
+
+	victim->loading = BCACHE_LOAD_MISS;
+	pthread_mutex_unlock(&c->lock);
+	int rc = io_rw_fixed(c->io, 0, victim->data, UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE,
+			bcache_buf_index(c, victim));
+	pthread_mutex_lock(&c->lock);
+	victim->loading = 0;
+	pthread_cond_broadcast(&c->ready);
+	if (rc == -1) {
+		bcache_unhash(c, victim);
+		victim->blk = -1;
+		return NULL;
+	}
+	return victim;
+}
+
+int bcache_read(bcache_t *c, off_t addr, void *buf, size_t count) {
+	char *p = buf;
+	pthread_mutex_lock(&c->lock);
+	while (count > 0) {
+		int blk = addr / UFS_BLOCK_SIZE;
+		int off = addr % UFS_BLOCK_SIZE;
+		size_t sz = UFS_BLOCK_SIZE - off;
+		if (sz > count) sz = count;
+
+		int none;
+		bcache_buf_t *b = bcache_get(c, blk, 1, 0, &none);
+		if (b) {
+			memcpy(p, b->data + off, sz);
+		} else {
+			// the whole pool is in flight, skip the cache rather than wait on it
+			pthread_mutex_unlock(&c->lock);
+			if (!none || io_read(c->io, p, sz, addr) == -1) return -1;
+			pthread_mutex_lock(&c->lock);
+		}
+
+		p += sz; addr += sz; count -= sz;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+int bcache_write(bcache_t *c, off_t addr, void *buf, size_t count) {
+	char *p = buf;
+	pthread_mutex_lock(&c->lock);
+	while (count > 0) {
+		int blk = addr / UFS_BLOCK_SIZE;
+		int off = addr % UFS_BLOCK_SIZE;
+		size_t sz = UFS_BLOCK_SIZE - off;
+		if (sz > count) sz = count;
+
+		// no need to read the old contents if we overwrite all of it
+		int none;
+		bcache_buf_t *b = bcache_get(c, blk, sz != UFS_BLOCK_SIZE, 1, &none);
+		if (none) {
+			// nobody waits on us to finish their I/O, so a buffer frees up
+			pthread_cond_wait(&c->ready, &c->lock);
+			continue;
+		}
+		if (b == NULL) {
+			pthread_mutex_unlock(&c->lock);
+			return -1;
+		}
+		memcpy(b->data + off, p, sz);
+		b->dirty = 1;
+
+		p += sz; addr += sz; count -= sz;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+static int bcache_cmp_blk(const void *a, const void *b) {
+	return (*(bcache_buf_t* const*)a)->blk - (*(bcache_buf_t* const*)b)->blk;
+}
+
+// queues every dirty block on b in disk order, or writes them right away if b is NULL.
+// caller still has to fsync, and to call bcache_flush_done once b has been submitted
+int bcache_flush(bcache_t *c, io_batch_t *b) {
+	pthread_mutex_lock(&c->lock);
+	bcache_buf_t **dirty = malloc(sizeof(bcache_buf_t*) * c->nbufs);
+	int n = 0;
+	for (int i = 0; i < c->nbufs; ++i) {
+		if (c->bufs[i].blk != -1 && c->bufs[i].dirty) dirty[n++] = &c->bufs[i];
+	}
+	qsort(dirty, n, sizeof(bcache_buf_t*), bcache_cmp_blk);
+
+	io_batch_t local;
+	io_batch_init(&local);
+	io_batch_t *batch = b ? b : &local;
+	for (int i = 0; i < n; ++i) {
+		io_batch_add(batch, 1, dirty[i]->data, UFS_BLOCK_SIZE, (off_t)dirty[i]->blk * UFS_BLOCK_SIZE,
+				bcache_buf_index(c, dirty[i]));
+		dirty[i]->dirty = 0;
+		if (b) dirty[i]->flushing = 1;
+	}
+	c->stats.writebacks += n;
+	free(dirty);
+
+	int rc = b ? 0 : io_batch_submit(c->io, &local, 0);
+	io_batch_free(&local);
+	pthread_mutex_unlock(&c->lock);
+	return rc;
+}
+
+// the batch bcache_flush filled is on disk, its buffers can be reused
+void bcache_flush_done(bcache_t *c) {
+	pthread_mutex_lock(&c->lock);
+	for (int i = 0; i < c->nbufs; ++i) c->bufs[i].flushing = 0;
+	pthread_cond_broadcast(&c->ready);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// drops blk without writing it back, its contents are now owned by someone else
+void bcache_invalidate(bcache_t *c, int blk) {
+	pthread_mutex_lock(&c->lock);
+	bcache_buf_t *b;
+	while ((b = bcache_lookup(c, blk)) && (b->loading || b->flushing))
+		pthread_cond_wait(&c->ready, &c->lock);
+	if (b) {
+		bcache_unhash(c, b);
+		b->blk = -1;
+		b->dirty = 0;
+		b->ref = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+// copies the cached contents of blk for a read that doesn't go through the
+// cache, 0 if it isn't in it
+int bcache_peek(bcache_t *c, int blk, char *buf) {
+	pthread_mutex_lock(&c->lock);
+	bcache_buf_t *b = bcache_wait(c, blk, 0);
+	if (b) {
+		bcache_used(c, b);
+		memcpy(buf, b->data, UFS_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return b != NULL;
+}
+
+// queues reads on b for the blocks of [blk, blk + n) that aren't cached yet.
+// the buffers are in the cache from now on, loading until bcache_prefetch_done
+// is called for b. one thread prefetches at a time
+int bcache_prefetch(bcache_t *c, int blk, int n, io_batch_t *b) {
+	int rc = 0;
+	pthread_mutex_lock(&c->lock);
+	for (int i = blk; i < blk + n; ++i) {
+		if (bcache_lookup(c, i)) continue;
+		int none;
+		bcache_buf_t *victim = bcache_victim(c, &none);
+		if (victim == NULL) {
+			rc = -1;
+			break;
+		}
+		io_batch_add(b, 0, victim->data, UFS_BLOCK_SIZE, (off_t)i * UFS_BLOCK_SIZE, bcache_buf_index(c, victim));
+		bcache_hash_in(c, victim, i);
+		victim->ra = 1;
+		victim->loading = BCACHE_LOAD_RA;
+		c->stats.ra_blocks++;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return rc;
+}
+
+// the prefetch batch was submitted, ok is 0 if it failed and the blocks are garbage
+void bcache_prefetch_done(bcache_t *c, int ok) {
+	pthread_mutex_lock(&c->lock);
+	for (int i = 0; i < c->nbufs; ++i) {
+		bcache_buf_t *b = &c->bufs[i];
+		if (b->loading != BCACHE_LOAD_RA) continue;
+		b->loading = 0;
+		if (!ok) {
+			bcache_unhash(c, b);
+			b->blk = -1;
+		}
+	}
+	pthread_cond_broadcast(&c->ready);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void bcache_print_stats(bcache_t *c) {
+	long total = c->stats.hits + c->stats.misses;
+	printf("bcache: %d blocks, hits %ld misses %ld (hit rate %.1f%%) evictions %ld writebacks %ld\n",
+			c->nbufs, c->stats.hits, c->stats.misses,
+			total ? 100.0 * c->stats.hits / total : 0.0,
+			c->stats.evictions, c->stats.writebacks);
+	printf("bcache: readahead %ld blocks, hits %ld wasted %ld\n",
+			c->stats.ra_blocks, c->stats.ra_hits, c->stats.ra_wasted);
+}
+
+void bcache_free(bcache_t *c) {
+	free(c->bufs);
+	free(c->table);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->ready);
+	free(c);
+}
@@ -0,0 +1,61 @@
+#ifndef __bcache_h__
+#define __bcache_h__
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "ufs.h"
+#include "io.h"
+
+// bcache_buf_t.loading
+#define BCACHE_LOAD_MISS (1) // a read that missed
+#define BCACHE_LOAD_RA (2)   // readahead, until bcache_prefetch_done
+
+// one cached disk block
+typedef struct __bcache_buf {
+	int blk;                    // block number, -1 if the slot is free
+	int dirty;                  // modified since last written back
+	int ref;                    // clock reference bit
+	int ra;                     // brought in by readahead and not used yet
+	int loading;                // BCACHE_LOAD_*, contents not there yet
+	int flushing;               // in a commit batch that hasn't been submitted
+	struct __bcache_buf *next;  // hash chain
+	char data[UFS_BLOCK_SIZE];
+} bcache_buf_t;
+
+typedef struct __bcache_stats {
+	long hits;
+	long misses;
+	long evictions;
+	long writebacks; // dirty blocks written to disk (flush + eviction)
+	long ra_blocks;  // blocks read ahead
+	long ra_hits;    // ... that a later read used
+	long ra_wasted;  // ... that got evicted or overwritten first
+} bcache_stats_t;
+
+typedef struct __bcache {
+	io_engine_t *io;
+	int registered;       // bufs[i].data is registered with io as buffer i
+	int nbufs;
+	bcache_buf_t *bufs;
+	bcache_buf_t **table; // hash table keyed by block number
+	int table_mask;
+	int hand;             // clock hand
+	bcache_stats_t stats;
+	pthread_mutex_t lock; // everything above
+	pthread_cond_t ready; // some buffer stopped loading or flushing
+} bcache_t;
+
+bcache_t* bcache_init(io_engine_t *io, int nbufs);
+int bcache_read(bcache_t *c, off_t addr, void *buf, size_t count);
+int bcache_write(bcache_t *c, off_t addr, void *buf, size_t count);
+int bcache_flush(bcache_t *c, io_batch_t *b);
+void bcache_flush_done(bcache_t *c);
+void bcache_invalidate(bcache_t *c, int blk);
+int bcache_peek(bcache_t *c, int blk, char *buf);
+int bcache_prefetch(bcache_t *c, int blk, int n, io_batch_t *b);
+void bcache_prefetch_done(bcache_t *c, int ok);
+void bcache_print_stats(bcache_t *c);
+void bcache_free(bcache_t *c);
+
+#endif // __bcache_h__
@@ -1,3 +1,3 @@
-gcc test.c mfs.c udp.c -o client
-gcc server.c ufs.c udp.c -o server
+gcc test.c mfs.c frag.c proto.c udp.c -o client
+gcc server.c ufs.c alloc.c bcache.c dindex.c frag.c io.c itable.c journal.c drc.c proto.c udp.c -o server -lpthread
 gcc mkfs.c -o mkfs
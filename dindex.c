@@ -0,0 +1,135 @@
+/*
+ * dindex.c - per-directory hash index used by ufs.c
+ * chained hash table keyed by entry name, doubles when load factor hits 1.
+ * it also knows which slot of which dir block every entry is in, so free
+ * slots and whole dir block images come from memory
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dindex.h"
+
+#define DINDEX_INIT_SZ (16)
+
+// fnv-1a
+static unsigned int dindex_hash(char *name) {
+	unsigned int h = 2166136261u;
+	for (; *name; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+dindex_t* dindex_create() {
+	dindex_t *d = malloc(sizeof(dindex_t));
+	d->table = calloc(DINDEX_INIT_SZ, sizeof(dindex_ent_t*));
+	d->table_mask = DINDEX_INIT_SZ - 1;
+	d->count = 0;
+	for (int i = 0; i < DIRECT_PTRS; ++i) {
+		d->blk_cnt[i] = 0;
+		d->slots[i] = NULL;
+	}
+	return d;
+}
+
+dindex_ent_t* dindex_find(dindex_t *d, char *name) {
+	for (dindex_ent_t *e = d->table[dindex_hash(name) & d->table_mask]; e; e = e->next) {
+		if (!strcmp(e->name, name)) return e;
+	}
+	return NULL;
+}
+
+static void dindex_grow(dindex_t *d) {
+	int sz = (d->table_mask + 1) * 2;
+	dindex_ent_t **table = calloc(sz, sizeof(dindex_ent_t*));
+	for (int i = 0; i <= d->table_mask; ++i) {
+		dindex_ent_t *e = d->table[i];
+		while (e) {
+			dindex_ent_t *next = e->next;
+			int h = dindex_hash(e->name) & (sz - 1);
+			e->next = table[h];
+			table[h] = e;
+			e = next;
+		}
+	}
+	free(d->table);
+	d->table = table;
+	d->table_mask = sz - 1;
+}
+
+void dindex_insert(dindex_t *d, char *name, int inum, int blk, int slot) {
+	if (d->count + 1 > d->table_mask + 1) dindex_grow(d);
+
+	dindex_ent_t *e = malloc(sizeof(dindex_ent_t));
+	strncpy(e->name, name, sizeof(e->name) - 1);
+	e->name[sizeof(e->name) - 1] = '\0';
+	e->inum = inum;
+	e->blk = blk;
+	e->slot = slot;
+
+	int h = dindex_hash(e->name) & d->table_mask;
+	e->next = d->table[h];
+	d->table[h] = e;
+	d->count++;
+	d->blk_cnt[blk]++;
+	if (d->slots[blk] == NULL) d->slots[blk] = calloc(DINDEX_SLOTS, sizeof(dindex_ent_t*));
+	d->slots[blk][slot] = e;
+}
+
+void dindex_remove(dindex_t *d, char *name) {
+	dindex_ent_t **p = &d->table[dindex_hash(name) & d->table_mask];
+	for (; *p; p = &(*p)->next) {
+		if (strcmp((*p)->name, name)) continue;
+		dindex_ent_t *e = *p;
+		*p = e->next;
+		d->count--;
+		d->slots[e->blk][e->slot] = NULL;
+		if (--d->blk_cnt[e->blk] == 0) {
+			free(d->slots[e->blk]);
+			d->slots[e->blk] = NULL;
+		}
+		free(e);
+		return;
+	}
+}
+
+// first unused slot of dir block blk, -1 if it is full
+int dindex_free_slot(dindex_t *d, int blk) {
+	if (d->slots[blk] == NULL) return 0;
+	if (d->blk_cnt[blk] == DINDEX_SLOTS) return -1;
+	for (int i = 0; i < (int)DINDEX_SLOTS; ++i) {
+		if (d->slots[blk][i] == NULL) return i;
+	}
+	return -1;
+}
+
+// what dir block blk holds, so it can be written whole without reading it first
+void dindex_block_image(dindex_t *d, int blk, dir_block_t *img) {
+	memset(img, 0, sizeof(dir_block_t));
+	for (int i = 0; i < (int)DINDEX_SLOTS; ++i) {
+		dindex_ent_t *e = d->slots[blk] ? d->slots[blk][i] : NULL;
+		if (e == NULL) {
+			img->entries[i].inum = -1;
+			continue;
+		}
+		strcpy(img->entries[i].name, e->name);
+		img->entries[i].inum = e->inum;
+	}
+}
+
+void dindex_free(dindex_t *d) {
+	if (d == NULL) return;
+	for (int i = 0; i <= d->table_mask; ++i) {
+		dindex_ent_t *e = d->table[i];
+		while (e) {
+			dindex_ent_t *next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+	for (int i = 0; i < DIRECT_PTRS; ++i) free(d->slots[i]);
+	free(d->table);
+	free(d);
+}
@@ -0,0 +1,36 @@
+#ifndef __dindex_h__
+#define __dindex_h__
+
+#include "ufs.h"
+
+// entries in one dir block
+#define DINDEX_SLOTS (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+
+// where a name lives inside its parent directory
+typedef struct __dindex_ent {
+	char name[28];
+	int inum;
+	int blk;   // index into the parent's direct[]
+	int slot;  // entry index inside that dir block
+	struct __dindex_ent *next;
+} dindex_ent_t;
+
+// in-memory hash index of one directory, name -> dindex_ent_t
+typedef struct __dindex {
+	dindex_ent_t **table;
+	int table_mask;
+	int count;
+	int blk_cnt[DIRECT_PTRS]; // live entries per dir block
+	dindex_ent_t **slots[DIRECT_PTRS]; // per dir block, the entry in each slot (NULL if free).
+	                                   // allocated with the block's first entry
+} dindex_t;
+
+dindex_t* dindex_create();
+dindex_ent_t* dindex_find(dindex_t *d, char *name);
+void dindex_insert(dindex_t *d, char *name, int inum, int blk, int slot);
+void dindex_remove(dindex_t *d, char *name);
+int dindex_free_slot(dindex_t *d, int blk);
+void dindex_block_image(dindex_t *d, int blk, dir_block_t *img);
+void dindex_free(dindex_t *d);
+
+#endif // __dindex_h__
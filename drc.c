@@ -0,0 +1,120 @@
+/*
+ * drc.c - duplicate request cache used by server.c
+ * a mutation is entered when it arrives and gets its reply once that is
+ * sent, so a retransmit is either dropped (still running) or answered with
+ * the same reply instead of running again. only the last max replies are
+ * remembered, a client retries far sooner than they are forgotten
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "drc.h"
+
+static unsigned int drc_hash(unsigned int client, unsigned int xid) {
+	return (client * 2654435761u ^ xid) & (DRC_BUCKETS - 1);
+}
+
+drc_t* drc_create(int max) {
+	drc_t *d = malloc(sizeof(drc_t));
+	memset(d, 0, sizeof(drc_t));
+	d->max = max;
+	pthread_mutex_init(&d->lock, NULL);
+	return d;
+}
+
+static drc_ent_t* drc_find(drc_t *d, unsigned int client, unsigned int xid) {
+	for (drc_ent_t *e = d->table[drc_hash(client, xid)]; e; e = e->next) {
+		if (e->client == client && e->xid == xid) return e;
+	}
+	return NULL;
+}
+
+static void drc_evict_oldest(drc_t *d) {
+	drc_ent_t *e = d->oldest;
+	d->oldest = e->newer;
+	if (d->oldest) d->oldest->older = NULL;
+	else d->newest = NULL;
+	d->ndone--;
+
+	drc_ent_t **p = &d->table[drc_hash(e->client, e->xid)];
+	while (*p != e) p = &(*p)->next;
+	*p = e->next;
+	free(e->reply);
+	free(e);
+	d->stats.evictions++;
+}
+
+/*
+ * looks up a request as it arrives. the first time it is entered as in
+ * progress. if it is done *reply gets a copy of its reply (caller frees)
+ */
+int drc_begin(drc_t *d, unsigned int client, unsigned int xid, char **reply, int *len) {
+	pthread_mutex_lock(&d->lock);
+	drc_ent_t *e = drc_find(d, client, xid);
+	if (e && !e->done) {
+		d->stats.dropped++;
+		pthread_mutex_unlock(&d->lock);
+		return DRC_IN_PROGRESS;
+	}
+	if (e) {
+		*reply = malloc(e->len);
+		memcpy(*reply, e->reply, e->len);
+		*len = e->len;
+		d->stats.hits++;
+		pthread_mutex_unlock(&d->lock);
+		return DRC_DONE;
+	}
+
+	e = malloc(sizeof(drc_ent_t));
+	memset(e, 0, sizeof(drc_ent_t));
+	e->client = client;
+	e->xid = xid;
+	int h = drc_hash(client, xid);
+	e->next = d->table[h];
+	d->table[h] = e;
+	pthread_mutex_unlock(&d->lock);
+	return DRC_NEW;
+}
+
+// the request drc_begin entered has been answered with reply (copied)
+void drc_end(drc_t *d, unsigned int client, unsigned int xid, char *reply, int len) {
+	pthread_mutex_lock(&d->lock);
+	drc_ent_t *e = drc_find(d, client, xid);
+	if (e == NULL || e->done) {
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+	e->done = 1;
+	e->reply = malloc(len);
+	memcpy(e->reply, reply, len);
+	e->len = len;
+
+	e->older = d->newest;
+	if (d->newest) d->newest->newer = e;
+	else d->oldest = e;
+	d->newest = e;
+	d->ndone++;
+	while (d->ndone > d->max) drc_evict_oldest(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+void drc_print_stats(drc_t *d) {
+	printf("reply cache: %d replies kept, %ld retransmits answered from it, %ld dropped while running, %ld evictions\n",
+			d->ndone, d->stats.hits, d->stats.dropped, d->stats.evictions);
+}
+
+void drc_free(drc_t *d) {
+	for (int i = 0; i < DRC_BUCKETS; ++i) {
+		drc_ent_t *e = d->table[i];
+		while (e) {
+			drc_ent_t *next = e->next;
+			free(e->reply);
+			free(e);
+			e = next;
+		}
+	}
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
@@ -0,0 +1,46 @@
+#ifndef __drc_h__
+#define __drc_h__
+
+#include <pthread.h>
+
+// hash buckets, a power of two
+#define DRC_BUCKETS (4096)
+
+// drc_begin says
+#define DRC_NEW (0)         // first time, run it
+#define DRC_IN_PROGRESS (1) // still running, drop the copy
+#define DRC_DONE (2)        // answered already, here is the reply
+
+// one request, keyed by the client that sent it and its xid
+typedef struct __drc_ent {
+	unsigned int client, xid;
+	int done;
+	char *reply;                    // copy of what was sent, once done
+	int len;
+	struct __drc_ent *next;         // hash chain
+	struct __drc_ent *older, *newer; // done ones in the order they finished
+} drc_ent_t;
+
+typedef struct __drc_stats {
+	long hits;      // retransmits answered from the cache
+	long dropped;   // retransmits of requests still running
+	long evictions;
+} drc_stats_t;
+
+// duplicate request cache: replies to mutations, so a retransmit doesn't run one twice
+typedef struct __drc {
+	drc_ent_t *table[DRC_BUCKETS];
+	drc_ent_t *oldest, *newest;
+	int ndone;
+	int max;        // done entries kept, the oldest go first
+	pthread_mutex_t lock;
+	drc_stats_t stats;
+} drc_t;
+
+drc_t* drc_create(int max);
+int drc_begin(drc_t *d, unsigned int client, unsigned int xid, char **reply, int *len);
+void drc_end(drc_t *d, unsigned int client, unsigned int xid, char *reply, int len);
+void drc_print_stats(drc_t *d);
+void drc_free(drc_t *d);
+
+#endif // __drc_h__
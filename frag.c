@@ -0,0 +1,461 @@
+/*
+ * frag.c - messages bigger than one datagram over UDP
+ * a message goes out as fragments of up to FRAG_PAYLOAD bytes. one fragment
+ * messages are fire and forget like before (the caller retries the whole
+ * request), longer ones go a window at a time: the receiver acks what it
+ * has in order and whatever isn't acked in time is sent again from there.
+ * several of those can be on their way at once, each ack sends the next
+ * window of its message. headers are little-endian on the wire, like the
+ * ones in proto.h
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "frag.h"
+#include "udp.h"
+
+// how long a window waits for its ack, and how many times it gets resent
+#define FRAG_ACK_USEC (20000)
+#define FRAG_RETRIES (50)
+
+// asked for on both socket buffers, the kernel caps it at rmem_max/wmem_max
+#define FRAG_SOCKBUF (4 << 20)
+
+static double frag_now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// select on the socket (and wake_fd unless it is -1), timeout_us < 0 waits
+// forever. 2 if wake_fd is readable
+static int wait_readable(int sd, int wake_fd, long timeout_us) {
+	fd_set fdset;
+	FD_ZERO(&fdset);
+	FD_SET(sd, &fdset);
+	if (wake_fd != -1) FD_SET(wake_fd, &fdset);
+	struct timeval tv;
+	tv.tv_sec = timeout_us / 1000000;
+	tv.tv_usec = timeout_us % 1000000;
+	int rc = select((sd > wake_fd ? sd : wake_fd) + 1, &fdset, NULL, NULL, timeout_us < 0 ? NULL : &tv);
+	if (rc > 0 && wake_fd != -1 && FD_ISSET(wake_fd, &fdset)) return 2;
+	return rc;
+}
+
+static int same_peer(struct sockaddr_in *a, struct sockaddr_in *b) {
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+frag_ep_t* frag_open(int sd) {
+	frag_ep_t *ep = malloc(sizeof(frag_ep_t));
+	memset(ep, 0, sizeof(frag_ep_t));
+	ep->sd = sd;
+	ep->wake_fd = -1;
+	ep->next_id = (unsigned int)getpid() * 2654435761u ^ (unsigned int)time(NULL);
+	// receive buffers for a whole batch, carved out of one allocation
+	char *dgrams = malloc((size_t)FRAG_BATCH * (sizeof(frag_hdr_t) + FRAG_PAYLOAD));
+	for (int i = 0; i < FRAG_BATCH; ++i) ep->dgram[i] = dgrams + (size_t)i * (sizeof(frag_hdr_t) + FRAG_PAYLOAD);
+
+	// a whole window has to fit in the receiver's buffer or it gets dropped
+	int sz = FRAG_SOCKBUF;
+	setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+	setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+	return ep;
+}
+
+// to or from wire order, one and the same
+static void swap_hdr(frag_hdr_t *h) {
+	h->id = htole32(h->id);
+	h->len = htole32(h->len);
+	h->off = htole32(h->off);
+	h->flags = htole32(h->flags);
+}
+
+static void send_ack(frag_ep_t *ep, struct sockaddr_in *addr, frag_msg_t *m) {
+	frag_hdr_t h = { m->id, m->len, m->got, FRAG_ACK };
+	swap_hdr(&h);
+	sendto(ep->sd, &h, sizeof(h), 0, (struct sockaddr*)addr, sizeof(*addr));
+	ep->stats.acks_out++;
+	ep->stats.send_calls++;
+}
+
+static void queue_ready(frag_ep_t *ep, struct sockaddr_in *addr, char *buf, unsigned int len) {
+	frag_msg_t *m = malloc(sizeof(frag_msg_t));
+	memset(m, 0, sizeof(frag_msg_t));
+	m->addr = *addr;
+	m->buf = buf;
+	m->len = len;
+	if (ep->ready_tail) ep->ready_tail->next = m;
+	else ep->ready = m;
+	ep->ready_tail = m;
+	ep->stats.msgs_in++;
+}
+
+static frag_msg_t* find_partial(frag_ep_t *ep, struct sockaddr_in *addr, unsigned int id, unsigned int len) {
+	for (frag_msg_t *m = ep->partial; m; m = m->next) {
+		if (m->id == id && m->len == len && same_peer(&m->addr, addr)) return m;
+	}
+	return NULL;
+}
+
+// finished ones stay around so late resends still get their ack, the oldest goes when full
+static frag_msg_t* new_partial(frag_ep_t *ep, struct sockaddr_in *addr, unsigned int id, unsigned int len) {
+	if (ep->npartial == FRAG_MAX_PARTIAL) {
+		frag_msg_t *old = ep->partial;
+		ep->partial = old->next;
+		free(old->buf);
+		free(old);
+		ep->npartial--;
+	}
+
+	frag_msg_t *m = malloc(sizeof(frag_msg_t));
+	memset(m, 0, sizeof(frag_msg_t));
+	m->addr = *addr;
+	m->id = id;
+	m->len = len;
+	m->buf = malloc(len + 1);
+
+	frag_msg_t **p = &ep->partial;
+	while (*p) p = &(*p)->next;
+	*p = m;
+	ep->npartial++;
+	return m;
+}
+
+static int send_frag(frag_ep_t *ep, struct sockaddr_in *addr, frag_hdr_t *h, char *buf, unsigned int n) {
+	frag_hdr_t wire = *h;
+	swap_hdr(&wire);
+	struct iovec iov[2];
+	iov[0].iov_base = &wire;
+	iov[0].iov_len = sizeof(frag_hdr_t);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = n;
+
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = addr;
+	mh.msg_namelen = sizeof(*addr);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	ep->stats.frags_out++;
+	ep->stats.send_calls++;
+	return sendmsg(ep->sd, &mh, 0) < 0 ? -1 : 0;
+}
+
+// sends what the window allows past the acked part of s, and starts the
+// wait for its ack
+static void send_window(frag_ep_t *ep, frag_send_t *s) {
+	while (s->sent < s->h.len && s->sent < s->acked + FRAG_WINDOW * FRAG_PAYLOAD) {
+		unsigned int n = s->h.len - s->sent < FRAG_PAYLOAD ? s->h.len - s->sent : FRAG_PAYLOAD;
+		s->h.off = s->sent;
+		if (send_frag(ep, &s->addr, &s->h, s->buf + s->sent, n) == -1) {
+			s->status = -1;
+			return;
+		}
+		s->sent += n;
+	}
+	s->deadline = frag_now_us() + FRAG_ACK_USEC;
+}
+
+// windows whose ack didn't come in time go again from the first fragment
+// the receiver doesn't have. posted sends that finished are let go
+static void send_timeouts(frag_ep_t *ep) {
+	double now = frag_now_us();
+	frag_send_t **p = &ep->sends;
+	while (*p) {
+		frag_send_t *s = *p;
+		if (!s->status && s->deadline <= now) {
+			if (++s->tries > FRAG_RETRIES) {
+				s->status = -1;
+			} else {
+				ep->stats.resends += (s->sent - s->acked + FRAG_PAYLOAD - 1) / FRAG_PAYLOAD;
+				s->sent = s->acked;
+				send_window(ep, s);
+			}
+		}
+		if (s->status && s->owned) {
+			*p = s->next;
+			free(s->buf);
+			free(s);
+			continue;
+		}
+		p = &s->next;
+	}
+}
+
+// microseconds to the first window deadline, -1 if nothing is being sent
+static long send_left(frag_ep_t *ep) {
+	double first = -1;
+	for (frag_send_t *s = ep->sends; s; s = s->next) {
+		if (!s->status && (first < 0 || s->deadline < first)) first = s->deadline;
+	}
+	if (first < 0) return -1;
+	long left = first - frag_now_us();
+	return left > 0 ? left : 0;
+}
+
+// starts buf (len bytes) on its way to addr, the first window goes now
+static frag_send_t* send_start(frag_ep_t *ep, struct sockaddr_in *addr, char *buf, int len, int owned) {
+	frag_send_t *s = malloc(sizeof(frag_send_t));
+	memset(s, 0, sizeof(frag_send_t));
+	s->addr = *addr;
+	s->h.id = ep->next_id++;
+	s->h.len = len;
+	s->buf = buf;
+	s->owned = owned;
+	s->next = ep->sends;
+	ep->sends = s;
+	ep->stats.msgs_out++;
+	send_window(ep, s);
+	return s;
+}
+
+// files one datagram of rc bytes from addr: an ack for our send, a whole message, or part of one
+static void frag_file(frag_ep_t *ep, struct sockaddr_in *addr, char *dgram, int rc) {
+	if (rc < (int)sizeof(frag_hdr_t)) return;
+
+	frag_hdr_t *h = (frag_hdr_t*)dgram;
+	swap_hdr(h);
+	char *data = dgram + sizeof(frag_hdr_t);
+	unsigned int flen = rc - sizeof(frag_hdr_t);
+
+	if (h->flags & FRAG_ACK) {
+		ep->stats.acks_in++;
+		for (frag_send_t *s = ep->sends; s; s = s->next) {
+			if (s->status || s->h.id != h->id || !same_peer(addr, &s->addr)) continue;
+			if (h->off <= s->acked) break;
+			s->acked = h->off < s->h.len ? h->off : s->h.len;
+			s->tries = 0;
+			if (s->acked == s->h.len) s->status = 1;
+			else send_window(ep, s);
+			break;
+		}
+		return;
+	}
+
+	ep->stats.frags_in++;
+	if (h->len > FRAG_MAX_MSG || h->off > h->len || flen > h->len - h->off) {
+		ep->stats.dropped++;
+		return;
+	}
+
+	if (h->off == 0 && flen == h->len) {
+		char *buf = malloc(h->len + 1);
+		memcpy(buf, data, flen);
+		buf[h->len] = '\0';
+		queue_ready(ep, addr, buf, h->len);
+		return;
+	}
+
+	frag_msg_t *m = find_partial(ep, addr, h->id, h->len);
+	if (m == NULL) {
+		if (h->off != 0) {
+			// the start got lost (or forgotten), have the sender go back to it
+			frag_msg_t tmp = { .id = h->id, .len = h->len, .got = 0 };
+			send_ack(ep, addr, &tmp);
+			ep->stats.dropped++;
+			return;
+		}
+		m = new_partial(ep, addr, h->id, h->len);
+	}
+
+	// a resend of something we already have or a gap: say where we are
+	if (m->done || h->off != m->got) {
+		send_ack(ep, addr, m);
+		return;
+	}
+
+	memcpy(m->buf + m->got, data, flen);
+	m->got += flen;
+	if (m->got == m->len) {
+		m->done = 1;
+		m->buf[m->len] = '\0';
+		queue_ready(ep, addr, m->buf, m->len);
+		m->buf = NULL;
+		send_ack(ep, addr, m);
+	} else if ((m->got / FRAG_PAYLOAD) % (FRAG_WINDOW / 2) == 0) {
+		// twice a window so the sender never runs dry
+		send_ack(ep, addr, m);
+	}
+}
+
+// reads the datagrams already queued on the socket, up to FRAG_BATCH in one call, and files them
+static void frag_input(frag_ep_t *ep) {
+	int lens[FRAG_BATCH];
+	int n = UDP_ReadMany(ep->sd, ep->in_addr, ep->dgram, lens, FRAG_BATCH, sizeof(frag_hdr_t) + FRAG_PAYLOAD);
+	if (n <= 0) return;
+	ep->stats.recv_calls++;
+	for (int i = 0; i < n; ++i) frag_file(ep, &ep->in_addr[i], ep->dgram[i], lens[i]);
+}
+
+/*
+ * sends len bytes of buf to addr as one message, and waits until it is all
+ * acked. anything else that shows up meanwhile is kept for frag_recv, and
+ * other sends keep going. -1 if the peer stopped acking, or the message
+ * is bigger than a receiver takes
+ */
+int frag_send(frag_ep_t *ep, struct sockaddr_in *addr, char *buf, int len) {
+	if (len > FRAG_MAX_MSG) return -1;
+	// posted messages were first
+	frag_flush(ep);
+
+	if (len <= FRAG_PAYLOAD) {
+		frag_hdr_t h = { ep->next_id++, len, 0, 0 };
+		ep->stats.msgs_out++;
+		return send_frag(ep, addr, &h, buf, len);
+	}
+
+	frag_send_t *s = send_start(ep, addr, buf, len, 0);
+	while (!s->status) {
+		long left = s->deadline - frag_now_us();
+		if (left > 0) {
+			int rc = wait_readable(ep->sd, -1, left);
+			if (rc > 0) frag_input(ep);
+		}
+		send_timeouts(ep);
+	}
+
+	frag_send_t **p = &ep->sends;
+	while (*p != s) p = &(*p)->next;
+	*p = s->next;
+	int rc = s->status == 1 ? 0 : -1;
+	free(s);
+	return rc;
+}
+
+/*
+ * queues buf (len bytes, frag frees it) to go to addr with the next
+ * frag_flush, so a run of small replies costs one sendmmsg. a message
+ * that needs fragments has its first window sent right away, frag_wait
+ * sees to the rest without anyone waiting on it
+ */
+void frag_post(frag_ep_t *ep, struct sockaddr_in *addr, char *buf, int len) {
+	if (len > FRAG_PAYLOAD) {
+		send_start(ep, addr, buf, len, 1);
+		return;
+	}
+
+	if (ep->nout == FRAG_BATCH) frag_flush(ep);
+	frag_out_t *o = &ep->out[ep->nout++];
+	o->addr = *addr;
+	o->h.id = ep->next_id++;
+	o->h.len = len;
+	o->h.off = 0;
+	o->h.flags = 0;
+	swap_hdr(&o->h); // it only goes out
+	o->buf = buf;
+	ep->stats.msgs_out++;
+}
+
+// sends everything frag_post queued
+void frag_flush(frag_ep_t *ep) {
+	if (!ep->nout) return;
+
+	struct sockaddr_in addrs[FRAG_BATCH];
+	struct iovec iov[2 * FRAG_BATCH];
+	for (int i = 0; i < ep->nout; ++i) {
+		addrs[i] = ep->out[i].addr;
+		iov[2 * i].iov_base = &ep->out[i].h;
+		iov[2 * i].iov_len = sizeof(frag_hdr_t);
+		iov[2 * i + 1].iov_base = ep->out[i].buf;
+		iov[2 * i + 1].iov_len = le32toh(ep->out[i].h.len);
+	}
+	UDP_WriteMany(ep->sd, addrs, iov, 2, ep->nout);
+	ep->stats.frags_out += ep->nout;
+	ep->stats.send_calls++;
+
+	for (int i = 0; i < ep->nout; ++i) free(ep->out[i].buf);
+	ep->nout = 0;
+}
+
+// frag_wait also returns when fd (non-blocking, e.g. a pipe) becomes
+// readable, whatever is in it gets drained
+void frag_set_wake(frag_ep_t *ep, int fd) {
+	ep->wake_fd = fd;
+}
+
+// waits up to timeout_us (< 0 for ever) for a whole message to be ready,
+// moving posted multi-fragment sends along meanwhile. 1 if there is one,
+// 0 on timeout, 2 if the wake fd woke it up, -1 if select failed (e.g. a
+// signal)
+int frag_wait(frag_ep_t *ep, long timeout_us) {
+	// nothing posted sits around while we sleep
+	frag_flush(ep);
+	send_timeouts(ep);
+
+	double deadline = frag_now_us() + timeout_us;
+	while (!ep->ready) {
+		long left = -1;
+		if (timeout_us >= 0) {
+			left = deadline - frag_now_us();
+			if (left <= 0) return 0;
+		}
+		long sl = send_left(ep);
+		int for_send = sl >= 0 && (left < 0 || sl < left);
+		int rc = wait_readable(ep->sd, ep->wake_fd, for_send ? sl : left);
+		if (rc < 0) return -1;
+		if (rc == 0) {
+			if (!for_send) return 0;
+			send_timeouts(ep);
+			continue;
+		}
+		if (rc == 2) {
+			char buf[64];
+			while (read(ep->wake_fd, buf, sizeof(buf)) > 0);
+			return 2;
+		}
+		frag_input(ep);
+	}
+	return 1;
+}
+
+// oldest complete message (NUL-terminated, caller frees it), NULL if none is ready
+char* frag_recv(frag_ep_t *ep, struct sockaddr_in *addr, int *len) {
+	frag_msg_t *m = ep->ready;
+	if (m == NULL) return NULL;
+	ep->ready = m->next;
+	if (ep->ready == NULL) ep->ready_tail = NULL;
+
+	char *buf = m->buf;
+	if (addr) *addr = m->addr;
+	if (len) *len = m->len;
+	free(m);
+	return buf;
+}
+
+void frag_print_stats(frag_ep_t *ep) {
+	printf("frag: msgs in %ld out %ld, frags in %ld out %ld, acks in %ld out %ld, resends %ld dropped %ld, recv calls %ld send calls %ld\n",
+			ep->stats.msgs_in, ep->stats.msgs_out, ep->stats.frags_in, ep->stats.frags_out,
+			ep->stats.acks_in, ep->stats.acks_out, ep->stats.resends, ep->stats.dropped,
+			ep->stats.recv_calls, ep->stats.send_calls);
+}
+
+void frag_close(frag_ep_t *ep) {
+	frag_flush(ep);
+	// posted sends finish (or give up) first
+	long left;
+	while ((left = send_left(ep)) >= 0) {
+		if (wait_readable(ep->sd, -1, left) > 0) frag_input(ep);
+		send_timeouts(ep);
+	}
+	send_timeouts(ep);
+	while (ep->partial) {
+		frag_msg_t *m = ep->partial;
+		ep->partial = m->next;
+		free(m->buf);
+		free(m);
+	}
+	char *buf;
+	while ((buf = frag_recv(ep, NULL, NULL))) free(buf);
+	free(ep->dgram[0]);
+	free(ep);
+}
@@ -0,0 +1,97 @@
+#ifndef __frag_h__
+#define __frag_h__
+
+#include <netinet/in.h>
+
+// bytes of message carried by one datagram
+#define FRAG_PAYLOAD (60000)
+
+// fragments sent before the sender waits for an ack, has to fit the socket buffers
+#define FRAG_WINDOW (8)
+
+// biggest message either side accepts
+#define FRAG_MAX_MSG (4 << 20)
+
+// messages being reassembled (or recently finished) that are remembered per endpoint
+#define FRAG_MAX_PARTIAL (64)
+
+#define FRAG_ACK (1)
+
+// datagrams taken per recvmmsg, and replies frag_post holds for one sendmmsg
+#define FRAG_BATCH (32)
+
+// in front of every datagram, little-endian on the wire
+typedef struct __frag_hdr {
+	unsigned int id;    // message id, picked by the sender
+	unsigned int len;   // length of the whole message
+	unsigned int off;   // where this fragment goes, for an ack how much arrived in order
+	unsigned int flags;
+} frag_hdr_t;
+
+typedef struct __frag_msg {
+	struct sockaddr_in addr;
+	unsigned int id, len, got;
+	char *buf;         // NULL once handed out
+	int done;
+	struct __frag_msg *next;
+} frag_msg_t;
+
+typedef struct __frag_stats {
+	long msgs_in, msgs_out;
+	long frags_in, frags_out;
+	long acks_in, acks_out;
+	long resends;      // fragments sent again after an ack timeout
+	long dropped;      // fragments that didn't fit anything
+	long recv_calls, send_calls; // syscalls, a recv_call can bring several datagrams
+} frag_stats_t;
+
+// a single fragment message waiting for frag_flush
+typedef struct __frag_out {
+	struct sockaddr_in addr;
+	frag_hdr_t h;       // in wire order
+	char *buf;
+} frag_out_t;
+
+// a message going out a window of fragments at a time, moved along by
+// the acks that come in and by frag_wait when they don't
+typedef struct __frag_send {
+	struct sockaddr_in addr;
+	frag_hdr_t h;
+	char *buf;
+	unsigned int sent, acked;
+	int tries;          // windows given up on in a row
+	double deadline;    // when the one in flight is
+	int owned;          // posted: buf is freed and the send forgotten once it finishes
+	int status;         // 1 all acked, -1 the peer stopped acking, 0 still going
+	struct __frag_send *next;
+} frag_send_t;
+
+// one UDP socket's worth of message state
+typedef struct __frag_ep {
+	int sd;
+	int wake_fd;          // see frag_set_wake, -1 if none
+	unsigned int next_id;
+	frag_msg_t *partial;  // oldest first
+	int npartial;
+	frag_msg_t *ready, *ready_tail; // complete, waiting for frag_recv
+	char *dgram[FRAG_BATCH];              // receive buffers
+	struct sockaddr_in in_addr[FRAG_BATCH]; // ... and who each datagram came from
+	frag_out_t out[FRAG_BATCH];           // posted, not sent yet
+	int nout;
+
+	frag_send_t *sends;   // multi-fragment messages on their way
+
+	frag_stats_t stats;
+} frag_ep_t;
+
+frag_ep_t* frag_open(int sd);
+int frag_send(frag_ep_t *ep, struct sockaddr_in *addr, char *buf, int len);
+void frag_post(frag_ep_t *ep, struct sockaddr_in *addr, char *buf, int len);
+void frag_flush(frag_ep_t *ep);
+void frag_set_wake(frag_ep_t *ep, int fd);
+int frag_wait(frag_ep_t *ep, long timeout_us);
+char* frag_recv(frag_ep_t *ep, struct sockaddr_in *addr, int *len);
+void frag_print_stats(frag_ep_t *ep);
+void frag_close(frag_ep_t *ep);
+
+#endif // __frag_h__
@@ -0,0 +1,385 @@
+/*
+ * io.c - I/O engines under ufs.c's block access
+ * "blocking" does plain pread/pwrite (adjacent requests go out as one
+ * preadv/pwritev), "uring" pushes a whole batch through io_uring with one
+ * io_uring_enter and can use registered buffers.
+ * both can be used from several threads: the ring has one owner at a time,
+ * and whoever finds it taken does their requests the blocking way instead
+ * of queueing behind someone else's batch and fsync
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "io.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define IO_URING
+#endif
+
+#define IO_URING_ENTRIES (256)
+#define IO_MAX_IOV (1024) // IOV_MAX on linux
+
+#define io_stat_add(e, field, n) __atomic_fetch_add(&(e)->stats.field, (n), __ATOMIC_RELAXED)
+
+/* blocking engine start */
+
+static int blocking_submit(io_engine_t *e, io_req_t *reqs, int n, int fsync_after) {
+	struct iovec iov[IO_MAX_IOV];
+	for (int i = 0; i < n; ) {
+		// run of requests of the same kind that are back to back on disk
+		int cnt = 0;
+		size_t total = 0;
+		off_t addr = reqs[i].addr;
+		int write = reqs[i].write;
+		while (i < n && cnt < IO_MAX_IOV && reqs[i].write == write && reqs[i].addr == addr + (off_t)total) {
+			iov[cnt].iov_base = reqs[i].buf;
+			iov[cnt].iov_len = reqs[i].len;
+			total += reqs[i].len;
+			cnt++; i++;
+		}
+
+		ssize_t rc = write ? pwritev(e->fd, iov, cnt, addr) : preadv(e->fd, iov, cnt, addr);
+		io_stat_add(e, syscalls, 1);
+		if (rc != (ssize_t)total) return -1;
+	}
+
+	if (fsync_after) {
+		io_stat_add(e, syscalls, 1);
+		if (fsync(e->fd) == -1) return -1;
+	}
+	return 0;
+}
+
+static int blocking_register_buffers(io_engine_t *e, struct iovec *iov, int n) {
+	(void)e; (void)iov; (void)n;
+	return -1; // nothing to gain
+}
+
+static void blocking_close(io_engine_t *e) {
+	(void)e;
+}
+
+/* blocking engine end */
+
+#ifdef IO_URING
+
+/* io_uring engine start */
+
+typedef struct __uring {
+	int ring_fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+	int fixed; // buffers are registered
+	pthread_mutex_t lock; // held while a submission owns the ring
+} uring_t;
+
+static int uring_enter(uring_t *u, unsigned int to_submit, unsigned int min_complete) {
+	return syscall(__NR_io_uring_enter, u->ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static uring_t* uring_setup() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &p);
+	if (fd < 0) return NULL;
+
+	uring_t *u = malloc(sizeof(uring_t));
+	memset(u, 0, sizeof(uring_t));
+	u->ring_fd = fd;
+	u->sq_entries = p.sq_entries;
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz) u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) goto fail;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto fail;
+
+	char *sq = u->sq_ptr, *cq = u->cq_ptr;
+	u->sq_head = (unsigned int*)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	u->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	pthread_mutex_init(&u->lock, NULL);
+	return u;
+
+fail:
+	close(fd);
+	free(u);
+	return NULL;
+}
+
+// finishes a short transfer the slow way
+static int uring_finish(io_engine_t *e, io_req_t *r, int done) {
+	while ((size_t)done < r->len) {
+		ssize_t rc = r->write ? pwrite(e->fd, (char*)r->buf + done, r->len - done, r->addr + done)
+			: pread(e->fd, (char*)r->buf + done, r->len - done, r->addr + done);
+		io_stat_add(e, syscalls, 1);
+		if (rc <= 0) return -1;
+		done += rc;
+	}
+	return 0;
+}
+
+static int uring_submit_locked(io_engine_t *e, io_req_t *reqs, int n, int fsync_after) {
+	uring_t *u = e->priv;
+	int err = 0;
+
+	for (int i = 0; i < n || fsync_after; ) {
+		unsigned int tail = *u->sq_tail;
+		unsigned int queued = 0;
+		while (i < n && queued < u->sq_entries - 1) {
+			io_req_t *r = &reqs[i];
+			unsigned int idx = tail & *u->sq_mask;
+			struct io_uring_sqe *sqe = &u->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			if (u->fixed && r->buf_index >= 0) {
+				sqe->opcode = r->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+				sqe->buf_index = r->buf_index;
+			} else {
+				sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+			}
+			sqe->fd = e->fd;
+			sqe->addr = (unsigned long)r->buf;
+			sqe->len = r->len;
+			sqe->off = r->addr;
+			sqe->user_data = i;
+			u->sq_array[idx] = idx;
+			tail++; queued++; i++;
+		}
+
+		// the fsync rides in the same submission; drain holds it back until
+		// every write ahead of it is done without chaining the writes themselves
+		int with_fsync = fsync_after && i == n;
+		if (with_fsync) {
+			unsigned int idx = tail & *u->sq_mask;
+			struct io_uring_sqe *sqe = &u->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->flags = IOSQE_IO_DRAIN;
+			sqe->fd = e->fd;
+			sqe->user_data = (unsigned long long)-1;
+			u->sq_array[idx] = idx;
+			tail++; queued++;
+			fsync_after = 0;
+		}
+		__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+		// the kernel may take fewer entries than asked (or none, with EAGAIN
+		// or EBUSY while completions are waiting to be reaped). only what it
+		// took is waited for. if it takes no more while nothing is in flight,
+		// or fails outright, the entries it left are taken back off the ring
+		// and go the blocking way once the rest are done
+		unsigned int submitted = 0, reaped = 0, rest = 0;
+		while (reaped < queued) {
+			if (submitted < queued) {
+				int rc = uring_enter(u, queued - submitted, 0);
+				io_stat_add(e, syscalls, 1);
+				if (rc > 0) {
+					submitted += rc;
+				} else if (submitted == reaped || (rc < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR)) {
+					rest = queued - submitted;
+					tail -= rest;
+					__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+					queued = submitted;
+					continue;
+				}
+			}
+			unsigned int head = *u->cq_head;
+			if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+				if (submitted > reaped) {
+					uring_enter(u, 0, 1);
+					io_stat_add(e, syscalls, 1);
+				}
+				continue;
+			}
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			if (cqe->user_data == (unsigned long long)-1) {
+				if (cqe->res < 0) err = 1;
+			} else {
+				io_req_t *r = &reqs[cqe->user_data];
+				if (cqe->res < 0 || ((size_t)cqe->res < r->len && uring_finish(e, r, cqe->res) == -1)) err = 1;
+			}
+			__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+			reaped++;
+		}
+		if (rest) {
+			// the fsync is the last entry, so it's among those left if it was queued
+			int left = rest - with_fsync;
+			io_stat_add(e, busy, 1);
+			if (blocking_submit(e, reqs + i - left, left, with_fsync) == -1) err = 1;
+		}
+	}
+	return err ? -1 : 0;
+}
+
+static int uring_submit(io_engine_t *e, io_req_t *reqs, int n, int fsync_after) {
+	uring_t *u = e->priv;
+	if (pthread_mutex_trylock(&u->lock)) {
+		io_stat_add(e, busy, 1);
+		return blocking_submit(e, reqs, n, fsync_after);
+	}
+	int rc = uring_submit_locked(e, reqs, n, fsync_after);
+	pthread_mutex_unlock(&u->lock);
+	return rc;
+}
+
+static int uring_register_buffers(io_engine_t *e, struct iovec *iov, int n) {
+	uring_t *u = e->priv;
+	if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS, iov, n) < 0) return -1;
+	u->fixed = 1;
+	return 0;
+}
+
+static void uring_close(io_engine_t *e) {
+	uring_t *u = e->priv;
+	munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_sz);
+	munmap(u->sq_ptr, u->sq_sz);
+	close(u->ring_fd);
+	pthread_mutex_destroy(&u->lock);
+	free(u);
+}
+
+/* io_uring engine end */
+
+#endif // IO_URING
+
+// name is "blocking" or "uring", uring falls back to blocking where it isn't available
+io_engine_t* io_open(char *name, int fd) {
+	io_engine_t *e = malloc(sizeof(io_engine_t));
+	memset(e, 0, sizeof(io_engine_t));
+	e->fd = fd;
+
+#ifdef IO_URING
+	if (name && !strcmp(name, "uring")) {
+		uring_t *u = uring_setup();
+		if (u) {
+			e->name = "uring";
+			e->priv = u;
+			e->submit = uring_submit;
+			e->register_buffers = uring_register_buffers;
+			e->close = uring_close;
+			return e;
+		}
+		perror("io_open io_uring setup fail, using blocking io");
+	}
+#endif
+
+	e->name = "blocking";
+	e->submit = blocking_submit;
+	e->register_buffers = blocking_register_buffers;
+	e->close = blocking_close;
+	return e;
+}
+
+static int io_submit(io_engine_t *e, io_req_t *reqs, int n, int fsync_after) {
+	io_stat_add(e, submits, 1);
+	io_stat_add(e, reqs, n);
+	if (fsync_after) io_stat_add(e, fsyncs, 1);
+	return e->submit(e, reqs, n, fsync_after);
+}
+
+int io_read(io_engine_t *e, void *buf, size_t len, off_t addr) {
+	io_req_t r = { 0, buf, len, addr, -1 };
+	return io_submit(e, &r, 1, 0);
+}
+
+int io_write(io_engine_t *e, void *buf, size_t len, off_t addr) {
+	io_req_t r = { 1, buf, len, addr, -1 };
+	return io_submit(e, &r, 1, 0);
+}
+
+// same thing for a buffer registered with the engine
+int io_rw_fixed(io_engine_t *e, int write, void *buf, size_t len, off_t addr, int buf_index) {
+	io_req_t r = { write, buf, len, addr, buf_index };
+	return io_submit(e, &r, 1, 0);
+}
+
+int io_fsync(io_engine_t *e) {
+	return io_submit(e, NULL, 0, 1);
+}
+
+void io_print_stats(io_engine_t *e) {
+	printf("io: %s engine, submits %ld reqs %ld syscalls %ld fsyncs %ld busy %ld\n",
+			e->name, e->stats.submits, e->stats.reqs, e->stats.syscalls, e->stats.fsyncs, e->stats.busy);
+}
+
+void io_close(io_engine_t *e) {
+	e->close(e);
+	free(e);
+}
+
+/* batches start */
+
+void io_batch_init(io_batch_t *b) {
+	memset(b, 0, sizeof(io_batch_t));
+}
+
+void io_batch_add(io_batch_t *b, int write, void *buf, size_t len, off_t addr, int buf_index) {
+	if (b->n == b->cap) {
+		b->cap = b->cap ? b->cap * 2 : 64;
+		b->reqs = realloc(b->reqs, sizeof(io_req_t) * b->cap);
+	}
+	io_req_t *r = &b->reqs[b->n++];
+	r->write = write;
+	r->buf = buf;
+	r->len = len;
+	r->addr = addr;
+	r->buf_index = buf_index;
+}
+
+void* io_batch_scratch(io_batch_t *b, size_t size) {
+	if (b->nscratch == b->scratch_cap) {
+		b->scratch_cap = b->scratch_cap ? b->scratch_cap * 2 : 8;
+		b->scratch = realloc(b->scratch, sizeof(void*) * b->scratch_cap);
+	}
+	return b->scratch[b->nscratch++] = malloc(size);
+}
+
+// runs the batch and empties it, it can be reused afterwards
+int io_batch_submit(io_engine_t *e, io_batch_t *b, int fsync_after) {
+	int rc = 0;
+	if (b->n || fsync_after) rc = io_submit(e, b->reqs, b->n, fsync_after);
+	for (int i = 0; i < b->nscratch; ++i) free(b->scratch[i]);
+	b->n = 0;
+	b->nscratch = 0;
+	return rc;
+}
+
+void io_batch_free(io_batch_t *b) {
+	for (int i = 0; i < b->nscratch; ++i) free(b->scratch[i]);
+	free(b->reqs);
+	free(b->scratch);
+	io_batch_init(b);
+}
+
+/* batches end */
@@ -0,0 +1,59 @@
+#ifndef __io_h__
+#define __io_h__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// one block-device style request
+typedef struct __io_req {
+	int write;
+	void *buf;
+	size_t len;
+	off_t addr;
+	int buf_index; // registered buffer buf lives in, -1 if none
+} io_req_t;
+
+// requests collected over a commit and handed to the engine in one go.
+// scratch memory hangs off the batch until it has been submitted
+typedef struct __io_batch {
+	io_req_t *reqs;
+	int n, cap;
+	void **scratch;
+	int nscratch, scratch_cap;
+} io_batch_t;
+
+typedef struct __io_stats {
+	long submits;  // calls into the engine
+	long reqs;
+	long syscalls; // read/write/fsync or io_uring_enter calls made for them
+	long fsyncs;
+	long busy;     // submissions (or what the ring wouldn't take of them) that went the blocking way
+} io_stats_t;
+
+typedef struct __io_engine {
+	char *name;
+	int fd;
+	// runs every request, and then an fsync if asked to; returns once all are done
+	int (*submit)(struct __io_engine *e, io_req_t *reqs, int n, int fsync_after);
+	// lets requests use buf_index, 0 on success
+	int (*register_buffers)(struct __io_engine *e, struct iovec *iov, int n);
+	void (*close)(struct __io_engine *e);
+	void *priv;
+	io_stats_t stats;
+} io_engine_t;
+
+io_engine_t* io_open(char *name, int fd);
+int io_read(io_engine_t *e, void *buf, size_t len, off_t addr);
+int io_write(io_engine_t *e, void *buf, size_t len, off_t addr);
+int io_rw_fixed(io_engine_t *e, int write, void *buf, size_t len, off_t addr, int buf_index);
+int io_fsync(io_engine_t *e);
+void io_print_stats(io_engine_t *e);
+void io_close(io_engine_t *e);
+
+void io_batch_init(io_batch_t *b);
+void io_batch_add(io_batch_t *b, int write, void *buf, size_t len, off_t addr, int buf_index);
+void* io_batch_scratch(io_batch_t *b, size_t size);
+int io_batch_submit(io_engine_t *e, io_batch_t *b, int fsync_after);
+void io_batch_free(io_batch_t *b);
+
+#endif // __io_h__
@@ -0,0 +1,177 @@
+/*
+ * itable.c - the part of the inode table that is in memory
+ * inode table blocks are paged in on first use and dropped again with
+ * CLOCK once more than max are resident. blocks holding inodes changed
+ * since the last commit are pinned until the commit has taken its image.
+ * every itable_get is matched by an itable_put, and a block stays put while
+ * somebody is using it. loads happen outside the lock, whoever wants a block
+ * that is still loading waits for it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "itable.h"
+
+static int itable_hash(itable_t *t, int blk) {
+	return (int)(((unsigned int)blk * 2654435761u) & t->table_mask);
+}
+
+static itable_buf_t* itable_lookup(itable_t *t, int blk) {
+	for (itable_buf_t *b = t->table[itable_hash(t, blk)]; b; b = b->next) {
+		if (b->blk == blk) return b;
+	}
+	return NULL;
+}
+
+static void itable_unhash(itable_t *t, itable_buf_t *b) {
+	itable_buf_t **p = &t->table[itable_hash(t, b->blk)];
+	while (*p != b) p = &(*p)->next;
+	*p = b->next;
+	b->next = NULL;
+	b->blk = -1;
+}
+
+static void itable_hash_in(itable_t *t, itable_buf_t *b, int blk) {
+	b->blk = blk;
+	b->ref = 1;
+	int h = itable_hash(t, blk);
+	b->next = t->table[h];
+	t->table[h] = b;
+}
+
+static itable_buf_t* itable_new_buf(itable_t *t) {
+	if (t->nbufs == t->cap) {
+		t->cap *= 2;
+		t->bufs = realloc(t->bufs, sizeof(itable_buf_t*) * t->cap);
+	}
+	itable_buf_t *b = malloc(sizeof(itable_buf_t));
+	memset(b, 0, sizeof(itable_buf_t));
+	b->blk = -1;
+	b->slot = t->nbufs;
+	t->bufs[t->nbufs++] = b;
+	if (t->nbufs > t->stats.max_resident) t->stats.max_resident = t->nbufs;
+	return b;
+}
+
+// a slot to reuse: a free one, or an unpinned block the clock hand gets to
+// twice. NULL if everything is pinned
+static itable_buf_t* itable_victim(itable_t *t) {
+	for (int i = 0; i < 2 * t->nbufs; ++i) {
+		itable_buf_t *b = t->bufs[t->hand];
+		t->hand = (t->hand + 1) % t->nbufs;
+		if (b->blk == -1) return b;
+		if (b->pinned || b->users) continue;
+		if (b->ref) {
+			b->ref = 0;
+			continue;
+		}
+		itable_unhash(t, b);
+		t->stats.evictions++;
+		return b;
+	}
+	return NULL;
+}
+
+itable_t* itable_init(int max, itable_load_t load, void *arg) {
+	itable_t *t = malloc(sizeof(itable_t));
+	memset(t, 0, sizeof(itable_t));
+	t->max = max > 0 ? max : 1;
+	t->cap = t->max;
+	t->bufs = malloc(sizeof(itable_buf_t*) * t->cap);
+	t->load = load;
+	t->arg = arg;
+
+	int table_sz = 1;
+	while (table_sz < t->max * 2) table_sz <<= 1;
+	t->table = calloc(table_sz, sizeof(itable_buf_t*));
+	t->table_mask = table_sz - 1;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->loaded, NULL);
+	return t;
+}
+
+// gives back a slot nobody uses once the table is over max
+static void itable_trim(itable_t *t, itable_buf_t *b) {
+	if (b->pinned || b->users || t->nbufs <= t->max) return;
+	itable_unhash(t, b);
+	t->stats.evictions++;
+	t->bufs[b->slot] = t->bufs[--t->nbufs];
+	t->bufs[b->slot]->slot = b->slot;
+	if (t->hand >= t->nbufs) t->hand = 0;
+	free(b);
+}
+
+// block blk of the inode table, loaded if it isn't resident. with pin set it
+// stays until itable_unpin. NULL if the load failed, otherwise it has to be
+// given back with itable_put
+char* itable_get(itable_t *t, int blk, int pin) {
+	pthread_mutex_lock(&t->lock);
+	itable_buf_t *b;
+	while ((b = itable_lookup(t, blk)) && b->loading) pthread_cond_wait(&t->loaded, &t->lock);
+	if (b) {
+		t->stats.hits++;
+		b->ref = 1;
+		b->users++;
+	} else {
+		t->stats.misses++;
+		if (t->nbufs >= t->max) b = itable_victim(t);
+		if (b == NULL) b = itable_new_buf(t);
+		itable_hash_in(t, b, blk);
+		b->users = 1;
+		b->loading = 1;
+		pthread_mutex_unlock(&t->lock);
+		int rc = t->load(t->arg, blk, b->data);
+		pthread_mutex_lock(&t->lock);
+		b->loading = 0;
+		pthread_cond_broadcast(&t->loaded);
+		if (rc == -1) {
+			b->users = 0;
+			itable_unhash(t, b);
+			pthread_mutex_unlock(&t->lock);
+			return NULL;
+		}
+	}
+	if (pin) b->pinned = 1;
+	pthread_mutex_unlock(&t->lock);
+	return b->data;
+}
+
+void itable_put(itable_t *t, int blk) {
+	pthread_mutex_lock(&t->lock);
+	itable_buf_t *b = itable_lookup(t, blk);
+	if (b) {
+		b->users--;
+		itable_trim(t, b);
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+// blk's changes are committed. blocks over max that were only kept for
+// being pinned go right away
+void itable_unpin(itable_t *t, int blk) {
+	pthread_mutex_lock(&t->lock);
+	itable_buf_t *b = itable_lookup(t, blk);
+	if (b) {
+		b->pinned = 0;
+		itable_trim(t, b);
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+void itable_print_stats(itable_t *t) {
+	long total = t->stats.hits + t->stats.misses;
+	printf("itable: %d/%d blocks resident (peak %d), hits %ld misses %ld (hit rate %.1f%%) evictions %ld\n",
+			t->nbufs, t->max, t->stats.max_resident, t->stats.hits, t->stats.misses,
+			total ? 100.0 * t->stats.hits / total : 0.0, t->stats.evictions);
+}
+
+void itable_free(itable_t *t) {
+	for (int i = 0; i < t->nbufs; ++i) free(t->bufs[i]);
+	free(t->bufs);
+	free(t->table);
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->loaded);
+	free(t);
+}
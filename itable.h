@@ -0,0 +1,52 @@
+#ifndef __itable_h__
+#define __itable_h__
+
+#include <pthread.h>
+
+#include "ufs.h"
+
+// one resident block of the inode table
+typedef struct __itable_buf {
+	int blk;                    // block within the inode table, -1 if the slot is free
+	int ref;                    // clock reference bit
+	int pinned;                 // has inodes changed since the last commit, can't be dropped
+	int users;                  // itable_gets not put back yet, can't be dropped either
+	int loading;                // being read in, data isn't there yet
+	int slot;                   // index in bufs
+	struct __itable_buf *next;  // hash chain
+	char data[UFS_BLOCK_SIZE];
+} itable_buf_t;
+
+typedef struct __itable_stats {
+	long hits;
+	long misses;
+	long evictions;
+	int max_resident; // most blocks that were in memory at once
+} itable_stats_t;
+
+// fills buf with inode table block blk, -1 on failure
+typedef int (*itable_load_t)(void *arg, int blk, char *buf);
+
+typedef struct __itable {
+	int max;              // resident blocks to stay within, pinned ones can push past it
+	int nbufs;
+	int cap;
+	itable_buf_t **bufs;
+	itable_buf_t **table; // hash table keyed by block number
+	int table_mask;
+	int hand;             // clock hand
+	itable_load_t load;
+	void *arg;
+	itable_stats_t stats;
+	pthread_mutex_t lock; // everything above
+	pthread_cond_t loaded;
+} itable_t;
+
+itable_t* itable_init(int max, itable_load_t load, void *arg);
+char* itable_get(itable_t *t, int blk, int pin);
+void itable_put(itable_t *t, int blk);
+void itable_unpin(itable_t *t, int blk);
+void itable_print_stats(itable_t *t);
+void itable_free(itable_t *t);
+
+#endif // __itable_h__
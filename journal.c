@@ -0,0 +1,356 @@
+/*
+ * journal.c - metadata write-ahead journal
+ * metadata blocks changed by a commit are appended to a circular log as
+ * one record and only written to their home locations at checkpoint time.
+ * until then the committed images are served from memory.
+ * lock covers the block maps and is never held over I/O, so lookups don't
+ * wait on a checkpoint. commits and checkpoints take ckpt_lock, one at a time
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "journal.h"
+
+/* block maps start */
+
+static jbuf_t* jmap_find(jmap_t *m, int blk) {
+	for (jbuf_t *b = m->table[(unsigned int)blk % JMAP_SZ]; b; b = b->next) {
+		if (b->blk == blk) return b;
+	}
+	return NULL;
+}
+
+static void jmap_link(jmap_t *m, jbuf_t *b) {
+	int h = (unsigned int)b->blk % JMAP_SZ;
+	b->next = m->table[h];
+	m->table[h] = b;
+	m->count++;
+}
+
+static jbuf_t* jmap_unlink(jmap_t *m, int blk) {
+	jbuf_t **p = &m->table[(unsigned int)blk % JMAP_SZ];
+	for (; *p; p = &(*p)->next) {
+		if ((*p)->blk != blk) continue;
+		jbuf_t *b = *p;
+		*p = b->next;
+		m->count--;
+		return b;
+	}
+	return NULL;
+}
+
+static void jmap_clear(jmap_t *m) {
+	for (int i = 0; i < JMAP_SZ; ++i) {
+		jbuf_t *b = m->table[i];
+		while (b) {
+			jbuf_t *next = b->next;
+			free(b);
+			b = next;
+		}
+		m->table[i] = NULL;
+	}
+	m->count = 0;
+}
+
+/* block maps end */
+
+static unsigned int checksum(unsigned int h, void *buf, size_t count) {
+	unsigned char *p = buf;
+	for (size_t i = 0; i < count; ++i) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static off_t log_addr(journal_t *j, unsigned int pos) {
+	return (off_t)(j->addr + 1 + pos % j->len) * UFS_BLOCK_SIZE;
+}
+
+// nblocks consecutive log blocks starting at pos, wrapping around the end.
+// reads happen right away, writes are queued on b
+static int log_io(journal_t *j, unsigned int pos, char *buf, int nblocks, io_batch_t *b) {
+	while (nblocks > 0) {
+		int n = j->len - pos % j->len;
+		if (n > nblocks) n = nblocks;
+		size_t sz = (size_t)n * UFS_BLOCK_SIZE;
+		if (b) io_batch_add(b, 1, buf, sz, log_addr(j, pos), -1);
+		else if (io_read(j->io, buf, sz, log_addr(j, pos)) == -1) return -1;
+		buf += sz; pos += n; nblocks -= n;
+	}
+	return 0;
+}
+
+static int write_super(journal_t *j) {
+	char block[UFS_BLOCK_SIZE];
+	memset(block, 0, UFS_BLOCK_SIZE);
+	journal_super_t *js = (journal_super_t*)block;
+	js->magic = JOURNAL_MAGIC;
+	js->seq = j->start_seq;
+	js->start = j->start;
+	if (io_write(j->io, block, UFS_BLOCK_SIZE, (off_t)j->addr * UFS_BLOCK_SIZE) == -1) return -1;
+	return io_fsync(j->io);
+}
+
+// replays every complete record from start onwards into the home locations
+static int replay(journal_t *j) {
+	char *buf = malloc((size_t)(JOURNAL_MAX_BLOCKS + 1) * UFS_BLOCK_SIZE);
+	journal_desc_t *d = (journal_desc_t*)buf;
+	unsigned int pos = j->start;
+	int scanned = 0;
+
+	while (scanned < j->len) {
+		if (log_io(j, pos, buf, 1, NULL) == -1) break;
+		if (d->magic != JOURNAL_DESC_MAGIC || d->seq != j->seq) break;
+		if (d->nblocks > JOURNAL_MAX_BLOCKS || scanned + d->nblocks + 1 > (unsigned int)j->len) break;
+		if (log_io(j, pos + 1, buf + UFS_BLOCK_SIZE, d->nblocks, NULL) == -1) break;
+
+		unsigned int h = checksum(2166136261u, d->blocks, d->nblocks * sizeof(unsigned int));
+		h = checksum(h, buf + UFS_BLOCK_SIZE, (size_t)d->nblocks * UFS_BLOCK_SIZE);
+		if (h != d->checksum) break; // torn record, never got its fsync
+
+		io_batch_t b;
+		io_batch_init(&b);
+		for (unsigned int i = 0; i < d->nblocks; ++i) {
+			io_batch_add(&b, 1, buf + (size_t)(i + 1) * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE,
+					(off_t)d->blocks[i] * UFS_BLOCK_SIZE, -1);
+		}
+		int rc = io_batch_submit(j->io, &b, 0);
+		io_batch_free(&b);
+		if (rc == -1) {
+			free(buf);
+			return -1;
+		}
+
+		pos = (pos + d->nblocks + 1) % j->len;
+		scanned += d->nblocks + 1;
+		j->seq++;
+		j->stats.replayed++;
+	}
+	free(buf);
+
+	j->start = j->head = pos;
+	j->start_seq = j->seq;
+	if (!j->stats.replayed) return 0;
+	if (io_fsync(j->io) == -1) return -1;
+	return write_super(j);
+}
+
+journal_t* journal_open(io_engine_t *io, int addr, int len) {
+	journal_t *j = malloc(sizeof(journal_t));
+	memset(j, 0, sizeof(journal_t));
+	j->io = io;
+	j->addr = addr;
+	j->len = len - 1;
+
+	journal_super_t js;
+	if (io_read(io, &js, sizeof(js), (off_t)addr * UFS_BLOCK_SIZE) == -1 || js.magic != JOURNAL_MAGIC) {
+		fprintf(stderr, "journal_open bad journal super, probably corrupted\n");
+		exit(1);
+	}
+	j->start = js.start % j->len;
+	j->seq = js.seq;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_mutex_init(&j->ckpt_lock, NULL);
+
+	if (replay(j) == -1) {
+		fprintf(stderr, "journal_open replay fail\n");
+		exit(1);
+	}
+	return j;
+}
+
+// copies count bytes at off of the latest image of blk if the journal has
+// one (the home copy may be stale), 0 if it doesn't
+int journal_get(journal_t *j, int blk, int off, void *buf, size_t count) {
+	pthread_mutex_lock(&j->lock);
+	jbuf_t *b = jmap_find(&j->tx, blk);
+	if (b == NULL) b = jmap_find(&j->done, blk);
+	if (b) memcpy(buf, b->data + off, count);
+	pthread_mutex_unlock(&j->lock);
+	return b != NULL;
+}
+
+// image of blk to modify in the running transaction. if fresh is set the
+// caller has to fill it in, otherwise it starts as the latest image. the
+// image is the caller's until the commit, nobody else may be changing blk
+char* journal_tx_block(journal_t *j, int blk, int *fresh) {
+	pthread_mutex_lock(&j->lock);
+	jbuf_t *b = jmap_find(&j->tx, blk);
+	*fresh = 0;
+	if (b == NULL) {
+		b = malloc(sizeof(jbuf_t));
+		b->blk = blk;
+		jbuf_t *old = jmap_find(&j->done, blk);
+		if (old) memcpy(b->data, old->data, UFS_BLOCK_SIZE);
+		else *fresh = 1;
+		jmap_link(&j->tx, b);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return b->data;
+}
+
+static int checkpoint(journal_t *j);
+
+// blk stopped being metadata (freed and reused for file data). a live record
+// still holding it would clobber the new contents on replay, so checkpoint
+int journal_forget(journal_t *j, int blk) {
+	pthread_mutex_lock(&j->lock);
+	free(jmap_unlink(&j->tx, blk));
+	int live = jmap_find(&j->done, blk) != NULL;
+	pthread_mutex_unlock(&j->lock);
+	if (live) return journal_checkpoint(j);
+	return 0;
+}
+
+static void keep_committed(journal_t *j, jbuf_t *b) {
+	free(jmap_unlink(&j->done, b->blk));
+	jmap_link(&j->done, b);
+}
+
+/*
+ * queues one record with the given images plus every block of the running
+ * transaction on b. the caller submits b with an fsync, a record that
+ * doesn't make it fails its checksum and is ignored by replay
+ */
+static int commit(journal_t *j, int *blks, char **images, int n, io_batch_t *b) {
+	int total = n + j->tx.count;
+	if (!total) return 0;
+
+	jbuf_t **tx = malloc(sizeof(jbuf_t*) * (j->tx.count + 1));
+	int ntx = 0;
+	for (int i = 0; i < JMAP_SZ; ++i) {
+		for (jbuf_t *t = j->tx.table[i]; t; t = t->next) tx[ntx++] = t;
+	}
+
+	// too big to ever fit in the log: checkpoint and write in place like the non-journaled path does
+	if (total > (int)JOURNAL_MAX_BLOCKS || total + 1 > j->len) {
+		if (checkpoint(j) == -1) {
+			free(tx);
+			return -1;
+		}
+		for (int i = 0; i < n; ++i) {
+			io_batch_add(b, 1, images[i], UFS_BLOCK_SIZE, (off_t)blks[i] * UFS_BLOCK_SIZE, -1);
+		}
+		for (int i = 0; i < ntx; ++i) {
+			char *img = io_batch_scratch(b, UFS_BLOCK_SIZE);
+			memcpy(img, tx[i]->data, UFS_BLOCK_SIZE);
+			io_batch_add(b, 1, img, UFS_BLOCK_SIZE, (off_t)tx[i]->blk * UFS_BLOCK_SIZE, -1);
+		}
+		free(tx);
+		pthread_mutex_lock(&j->lock);
+		jmap_clear(&j->tx);
+		pthread_mutex_unlock(&j->lock);
+		return 0;
+	}
+
+	if (j->used + total + 1 > j->len && checkpoint(j) == -1) {
+		free(tx);
+		return -1;
+	}
+
+	char *buf = io_batch_scratch(b, (size_t)(total + 1) * UFS_BLOCK_SIZE);
+	memset(buf, 0, UFS_BLOCK_SIZE);
+	journal_desc_t *d = (journal_desc_t*)buf;
+	d->magic = JOURNAL_DESC_MAGIC;
+	d->seq = j->seq;
+	d->nblocks = total;
+	for (int i = 0; i < n; ++i) {
+		d->blocks[i] = blks[i];
+		memcpy(buf + (size_t)(i + 1) * UFS_BLOCK_SIZE, images[i], UFS_BLOCK_SIZE);
+	}
+	for (int i = 0; i < ntx; ++i) {
+		d->blocks[n + i] = tx[i]->blk;
+		memcpy(buf + (size_t)(n + i + 1) * UFS_BLOCK_SIZE, tx[i]->data, UFS_BLOCK_SIZE);
+	}
+	d->checksum = checksum(2166136261u, d->blocks, total * sizeof(unsigned int));
+	d->checksum = checksum(d->checksum, buf + UFS_BLOCK_SIZE, (size_t)total * UFS_BLOCK_SIZE);
+
+	log_io(j, j->head, buf, total + 1, b);
+
+	j->head = (j->head + total + 1) % j->len;
+	j->used += total + 1;
+	j->seq++;
+	j->stats.records++;
+	j->stats.blocks += total;
+
+	// committed images stay in memory until the next checkpoint
+	pthread_mutex_lock(&j->lock);
+	for (int i = 0; i < n; ++i) {
+		jbuf_t *c = malloc(sizeof(jbuf_t));
+		c->blk = blks[i];
+		memcpy(c->data, images[i], UFS_BLOCK_SIZE);
+		keep_committed(j, c);
+	}
+	for (int i = 0; i < ntx; ++i) {
+		jmap_unlink(&j->tx, tx[i]->blk);
+		keep_committed(j, tx[i]);
+	}
+	pthread_mutex_unlock(&j->lock);
+	free(tx);
+	return 0;
+}
+
+int journal_commit(journal_t *j, int *blks, char **images, int n, io_batch_t *b) {
+	pthread_mutex_lock(&j->ckpt_lock);
+	int rc = commit(j, blks, images, n, b);
+	pthread_mutex_unlock(&j->ckpt_lock);
+	return rc;
+}
+
+// done only changes under ckpt_lock, which the caller holds, so its images
+// can be written without the map lock
+static int checkpoint(journal_t *j) {
+	if (!j->used) return 0;
+
+	io_batch_t batch;
+	io_batch_init(&batch);
+	pthread_mutex_lock(&j->lock);
+	for (int i = 0; i < JMAP_SZ; ++i) {
+		for (jbuf_t *b = j->done.table[i]; b; b = b->next) {
+			io_batch_add(&batch, 1, b->data, UFS_BLOCK_SIZE, (off_t)b->blk * UFS_BLOCK_SIZE, -1);
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+	int rc = io_batch_submit(j->io, &batch, 1);
+	io_batch_free(&batch);
+	if (rc == -1) return -1;
+
+	j->start = j->head;
+	j->start_seq = j->seq;
+	j->used = 0;
+	if (write_super(j) == -1) return -1;
+
+	pthread_mutex_lock(&j->lock);
+	jmap_clear(&j->done);
+	pthread_mutex_unlock(&j->lock);
+	j->stats.checkpoints++;
+	return 0;
+}
+
+// writes committed images home and frees the log space they used
+int journal_checkpoint(journal_t *j) {
+	pthread_mutex_lock(&j->ckpt_lock);
+	int rc = checkpoint(j);
+	pthread_mutex_unlock(&j->ckpt_lock);
+	return rc;
+}
+
+void journal_print_stats(journal_t *j) {
+	printf("journal: %d log blocks, %d in use, records %ld blocks %ld checkpoints %ld replayed %ld\n",
+			j->len, j->used, j->stats.records, j->stats.blocks,
+			j->stats.checkpoints, j->stats.replayed);
+}
+
+void journal_close(journal_t *j) {
+	journal_checkpoint(j);
+	jmap_clear(&j->tx);
+	jmap_clear(&j->done);
+	pthread_mutex_destroy(&j->lock);
+	pthread_mutex_destroy(&j->ckpt_lock);
+	free(j);
+}
@@ -0,0 +1,83 @@
+#ifndef __journal_h__
+#define __journal_h__
+
+#include <pthread.h>
+
+#include "ufs.h"
+#include "io.h"
+
+#define JOURNAL_MAGIC (0x6a726e6c) // "jrnl"
+#define JOURNAL_DESC_MAGIC (0x6a646573) // "jdes"
+
+// most blocks one record can carry, limited by what fits in a descriptor block
+#define JOURNAL_MAX_BLOCKS ((UFS_BLOCK_SIZE - 4 * sizeof(unsigned int)) / sizeof(unsigned int))
+
+/*
+ * on-disk layout: the first block of the journal region is the journal
+ * super, the rest is a circular log of records. a record is a descriptor
+ * block followed by the images of the blocks it lists. records between
+ * start and the first descriptor with the wrong seq or a bad checksum are
+ * the ones that still have to be replayed.
+ */
+typedef struct __journal_super {
+	unsigned int magic;
+	unsigned int seq;   // seq of the record at start
+	unsigned int start; // log block (0 based) of the oldest live record
+} journal_super_t;
+
+typedef struct __journal_desc {
+	unsigned int magic;
+	unsigned int seq;
+	unsigned int nblocks;
+	unsigned int checksum; // over blocks[] and the block images
+	unsigned int blocks[JOURNAL_MAX_BLOCKS]; // home addresses
+} journal_desc_t;
+
+// in-memory block image, chained in a small hash map keyed by block number
+typedef struct __jbuf {
+	int blk;
+	struct __jbuf *next;
+	char data[UFS_BLOCK_SIZE];
+} jbuf_t;
+
+#define JMAP_SZ (256)
+
+typedef struct __jmap {
+	jbuf_t *table[JMAP_SZ];
+	int count;
+} jmap_t;
+
+typedef struct __journal_stats {
+	long records;
+	long blocks;       // block images written to the log
+	long checkpoints;
+	long replayed;     // records replayed by journal_open
+} journal_stats_t;
+
+typedef struct __journal {
+	io_engine_t *io;
+	int addr;           // journal super block
+	int len;            // log blocks following it
+	unsigned int start; // oldest live record
+	unsigned int head;  // where the next record goes
+	int used;           // log blocks between start and head
+	unsigned int seq;   // seq of the next record
+	unsigned int start_seq;
+
+	jmap_t tx;          // metadata blocks changed since the last commit
+	jmap_t done;        // committed but not yet checkpointed home
+	journal_stats_t stats;
+	pthread_mutex_t lock;      // tx and done
+	pthread_mutex_t ckpt_lock; // the log, held by commits and checkpoints
+} journal_t;
+
+journal_t* journal_open(io_engine_t *io, int addr, int len);
+int journal_get(journal_t *j, int blk, int off, void *buf, size_t count);
+char* journal_tx_block(journal_t *j, int blk, int *fresh);
+int journal_forget(journal_t *j, int blk);
+int journal_commit(journal_t *j, int *blks, char **images, int n, io_batch_t *b);
+int journal_checkpoint(journal_t *j);
+void journal_print_stats(journal_t *j);
+void journal_close(journal_t *j);
+
+#endif // __journal_h__
@@ -1,15 +1,22 @@
 /*
  * mfs.c - client side filesystem implementation
- * just simple network wrappers with made-up serialization
+ * just simple network wrappers, the wire format is in proto.h. every call
+ * goes through the same window of requests in flight, the synchronous ones
+ * just wait for theirs
  * created on mar 14 2024 by ashish ahuja
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 #include "udp.h"
+#include "frag.h"
 #include "mfs.h"
+#include "proto.h"
 
 #define DEBUG
 
@@ -17,114 +24,1125 @@
 
 struct sockaddr_in addrSnd, addrRcv;
 int mfs_sd;
+int mfs_max_io = MFS_BLOCK_SIZE;
+frag_ep_t *mfs_ep;
+unsigned int mfs_xid;
+unsigned int mfs_client;
 
-int MFS_Init(char *hostname, int port) {
-	mfs_sd = UDP_Open(6996);
-	int rc = UDP_FillSockAddr(&addrSnd, hostname, port);
+/*
+ * every request, whether a caller waits for it or not, is an op in flight
+ * until its reply comes back. the reply that comes back completes it:
+ * through its callback, on the queue MFS_Poll takes from, or for the
+ * synchronous calls by setting done for wait_op
+ */
+typedef struct __mfs_op {
+	unsigned int xid;
+	int op;
+	int args[3];
+	char *msg;          // the request as sent, kept for resends
+	int len;
+	double sent;        // when it last went out
+	char *buf;          // where read data goes
+	int nbytes;
+	MFS_Callback_t cb;
+	void *arg;          // for a synchronous op, where results other than ret go
+	int sync;           // somebody is in wait_op for it
+	int done, ret;
+	struct __mfs_op *next;
+} mfs_op_t;
+
+// the ops of a compound request, kept to fix up the caches and fill read
+// buffers once its results are back
+typedef struct __compound_op {
+	int op;
+	int args[3];
+	char *name;
+	char *buf;
+	int nbytes;
+} compound_op_t;
+
+struct __MFS_Compound_t {
+	char *msg;       // the proto_op_ts and their payloads so far
+	int len;
+	int reply_len;   // the most the results of the ops so far take
+	int n;
+	compound_op_t ops[MFS_COMPOUND_MAX];
+	char *results;   // the reply payload
+	int results_len;
+};
+
+// where a PROTO_READDIRPLUS reply goes
+typedef struct __readdir {
+	MFS_DirEntPlus_t *ents;
+	int max, n;
+} readdir_t;
+
+mfs_op_t *mfs_inflight;                // newest first
+int mfs_ninflight;
+int mfs_window = MFS_DEFAULT_WINDOW;
+mfs_op_t *mfs_polled, *mfs_polled_tail; // completed, for MFS_Poll
+
+double mfs_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void complete(mfs_op_t *op, int ret) {
+	op->done = 1;
+	op->ret = ret;
+	free(op->msg);
+	op->msg = NULL;
+	if (op->sync) return;
+
+	if (op->cb) {
+		MFS_Completion_t c = { op->xid, ret, op->arg };
+		MFS_Callback_t cb = op->cb;
+		free(op);
+		cb(&c);
+		return;
+	}
+	op->next = NULL;
+	if (mfs_polled_tail) mfs_polled_tail->next = op;
+	else mfs_polled = op;
+	mfs_polled_tail = op;
+}
+
+/*
+ * cache start
+ * what lookups found, including names that aren't there, and the type and
+ * size of the inodes they found. an entry is good for mfs_ttl seconds, and
+ * this client's own creats, unlinks and writes fix up or drop the entries
+ * they change. both tables are direct mapped, a new entry replaces
+ * whatever was in its slot
+ */
+
+typedef struct __name_ent {
+	int pinum;
+	char name[28];
+	int inum;        // -1 if the name isn't there
+	double expires;  // 0 for an empty slot
+} name_ent_t;
+
+typedef struct __attr_ent {
+	int inum;
+	int type, size;
+	double expires;
+} attr_ent_t;
+
+double mfs_ttl = MFS_DEFAULT_TTL_MS / 1000.0;
+name_ent_t mfs_names[MFS_CACHE_SLOTS];
+attr_ent_t mfs_attrs[MFS_CACHE_SLOTS];
+
+// fnv-1a of the parent and the name
+name_ent_t* name_slot(int pinum, char *name) {
+	unsigned int h = 2166136261u ^ (unsigned int)pinum;
+	h *= 16777619u;
+	for (; *name; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return &mfs_names[h % MFS_CACHE_SLOTS];
+}
+
+// 1 and the inum (-1 for a name known not to be there) if the cache has it
+int name_get(int pinum, char *name, int *inum) {
+	name_ent_t *e = name_slot(pinum, name);
+	if (e->expires <= mfs_now() || e->pinum != pinum || strcmp(e->name, name)) return 0;
+	*inum = e->inum;
+	return 1;
+}
+
+void name_put(int pinum, char *name, int inum) {
+	if (mfs_ttl <= 0 || strlen(name) >= sizeof(((name_ent_t*)0)->name)) return;
+	name_ent_t *e = name_slot(pinum, name);
+	e->pinum = pinum;
+	strcpy(e->name, name);
+	e->inum = inum;
+	e->expires = mfs_now() + mfs_ttl;
+}
+
+void name_drop(int pinum, char *name) {
+	name_ent_t *e = name_slot(pinum, name);
+	if (e->pinum == pinum && !strcmp(e->name, name)) e->expires = 0;
+}
+
+// NULL unless the cache has inum's attributes
+attr_ent_t* attr_get(int inum) {
+	attr_ent_t *a = &mfs_attrs[(unsigned int)inum % MFS_CACHE_SLOTS];
+	if (a->expires <= mfs_now() || a->inum != inum) return NULL;
+	return a;
+}
+
+void attr_put(int inum, int type, int size) {
+	if (mfs_ttl <= 0) return;
+	attr_ent_t *a = &mfs_attrs[(unsigned int)inum % MFS_CACHE_SLOTS];
+	a->inum = inum;
+	a->type = type;
+	a->size = size;
+	a->expires = mfs_now() + mfs_ttl;
+}
+
+void attr_drop(int inum) {
+	attr_ent_t *a = &mfs_attrs[(unsigned int)inum % MFS_CACHE_SLOTS];
+	if (a->inum == inum) a->expires = 0;
+}
+
+/*
+ * page cache: file data by (inum, block). a page holds one contiguous run
+ * of the block that matches the server (or is dirty, i.e. written here and
+ * not sent yet). reads that the pages cover are answered from them, writes
+ * to a file whose size is known are buffered and merged while they stay
+ * contiguous, and go out with MFS_Flush, when mfs_write_behind bytes are
+ * dirty, or before anything that would read around them. clean pages are
+ * dropped when a lookup reports a size other than the one cached, so an
+ * MFS_Open sees what other clients flushed before it
+ */
+
+typedef struct __page {
+	int used;
+	int inum, blk;
+	int lo, hi;      // valid bytes of the block
+	int dlo, dhi;    // the dirty part of them, dlo == dhi when clean
+	int ref;         // for the clock
+	int failed;      // the last write of the dirty part failed, it waits for the next flush
+	int next;        // hash chain, -1 ends it
+	char data[MFS_BLOCK_SIZE];
+} page_t;
+
+page_t mfs_pages[MFS_CACHE_PAGES];
+int mfs_page_hash[MFS_CACHE_PAGES];
+int mfs_clock;
+int mfs_dirty;   // bytes
+int mfs_failed;  // pages
+int mfs_write_behind = MFS_DEFAULT_WRITE_BEHIND;
+
+int write_chunk(int inum, char *buffer, int offset, int nbytes);
+
+int page_bucket(int inum, int blk) {
+	return ((unsigned int)inum * 31 + (unsigned int)blk) % MFS_CACHE_PAGES;
+}
+
+page_t* page_find(int inum, int blk) {
+	for (int i = mfs_page_hash[page_bucket(inum, blk)]; i != -1; i = mfs_pages[i].next) {
+		if (mfs_pages[i].inum == inum && mfs_pages[i].blk == blk) return &mfs_pages[i];
+	}
+	return NULL;
+}
+
+void page_unhash(page_t *p) {
+	int *i = &mfs_page_hash[page_bucket(p->inum, p->blk)];
+	while (&mfs_pages[*i] != p) i = &mfs_pages[*i].next;
+	*i = p->next;
+	mfs_dirty -= p->dhi - p->dlo;
+	mfs_failed -= p->failed;
+	p->failed = 0;
+	p->used = 0;
+}
+
+void page_drop(int inum) {
+	for (int i = 0; i < MFS_CACHE_PAGES; ++i) {
+		if (mfs_pages[i].used && mfs_pages[i].inum == inum) page_unhash(&mfs_pages[i]);
+	}
+}
+
+void page_drop_clean(int inum) {
+	for (int i = 0; i < MFS_CACHE_PAGES; ++i) {
+		page_t *p = &mfs_pages[i];
+		if (p->used && p->inum == inum && p->dlo == p->dhi) page_unhash(p);
+	}
+}
+
+int page_cmp(const void *a, const void *b) {
+	page_t *p = *(page_t**)a, *q = *(page_t**)b;
+	if (p->inum != q->inum) return p->inum < q->inum ? -1 : 1;
+	return p->blk < q->blk ? -1 : p->blk > q->blk;
 }
 
-char *proc_call(char *msg) {
-	struct timeval tv;
+/*
+ * sends the dirty pages of inum (-1 for every file), in offset order since
+ * each write may extend the file for the next. runs of dirty bytes across
+ * pages go out as one request. -1 if any write failed, the pages it had
+ * stay dirty and marked, for the next call on their file to report
+ */
+int page_flush(int inum) {
+	page_t *dirty[MFS_CACHE_PAGES];
+	int n = 0;
+	for (int i = 0; i < MFS_CACHE_PAGES; ++i) {
+		page_t *p = &mfs_pages[i];
+		if (p->used && p->dlo != p->dhi && (inum == -1 || p->inum == inum)) dirty[n++] = p;
+	}
+	if (n == 0) return 0;
+	qsort(dirty, n, sizeof(page_t*), page_cmp);
 
-	fd_set fdset;
-	FD_ZERO(&fdset);
-	FD_SET(mfs_sd, &fdset);
+	char *buf = malloc(mfs_max_io);
+	int ret = 0;
+	for (int i = 0; i < n; ) {
+		int j = i + 1, len = dirty[i]->dhi - dirty[i]->dlo;
+		memcpy(buf, dirty[i]->data + dirty[i]->dlo, len);
+		while (j < n && dirty[j]->inum == dirty[i]->inum && dirty[j]->blk == dirty[j - 1]->blk + 1
+				&& dirty[j - 1]->dhi == MFS_BLOCK_SIZE && dirty[j]->dlo == 0
+				&& len + dirty[j]->dhi <= mfs_max_io) {
+			memcpy(buf + len, dirty[j]->data, dirty[j]->dhi);
+			len += dirty[j]->dhi;
+			j++;
+		}
+		int rc = write_chunk(dirty[i]->inum, buf, dirty[i]->blk * MFS_BLOCK_SIZE + dirty[i]->dlo, len);
+		for (; i < j; ++i) {
+			mfs_failed -= dirty[i]->failed;
+			dirty[i]->failed = rc == -1;
+			mfs_failed += dirty[i]->failed;
+			if (rc == -1) continue;
+			mfs_dirty -= dirty[i]->dhi - dirty[i]->dlo;
+			dirty[i]->dlo = dirty[i]->dhi = 0;
+		}
+		if (rc == -1) ret = -1;
+	}
+	free(buf);
+	return ret;
+}
+
+// 1 if inum has pages whose write failed
+int page_failed(int inum) {
+	if (mfs_failed == 0) return 0;
+	for (int i = 0; i < MFS_CACHE_PAGES; ++i) {
+		if (mfs_pages[i].used && mfs_pages[i].failed && mfs_pages[i].inum == inum) return 1;
+	}
+	return 0;
+}
+
+// -1 if writes of inum failed in some earlier flush and still do
+int page_check(int inum) {
+	return page_failed(inum) ? page_flush(inum) : 0;
+}
+
+// an empty page for (inum, blk), evicting a clean one not used lately.
+// NULL if every page is dirty and the writes of those left fail
+page_t* page_alloc(int inum, int blk) {
+	page_t *p = NULL;
+	for (int flushed = 0; p == NULL; flushed = 1) {
+		for (int i = 0; i < 2 * MFS_CACHE_PAGES && p == NULL; ++i) {
+			page_t *q = &mfs_pages[mfs_clock];
+			mfs_clock = (mfs_clock + 1) % MFS_CACHE_PAGES;
+			if (q->used && (q->dlo != q->dhi || q->ref)) {
+				q->ref = 0;
+				continue;
+			}
+			if (q->used) page_unhash(q);
+			p = q;
+		}
+		if (p != NULL) break;
+		if (flushed) return NULL;
+		page_flush(-1); // all dirty, what fails is marked for its file
+	}
+	p->used = 1;
+	p->inum = inum;
+	p->blk = blk;
+	p->lo = p->hi = p->dlo = p->dhi = 0;
+	p->ref = 1;
+	int b = page_bucket(inum, blk);
+	p->next = mfs_page_hash[b];
+	mfs_page_hash[b] = p - mfs_pages;
+	return p;
+}
+
+// 1 if the pages had all nbytes at offset
+int page_read(int inum, char *buffer, int offset, int nbytes) {
+	if (nbytes <= 0 || offset < 0) return 0;
+	for (int off = offset; off < offset + nbytes; ) {
+		int blk = off / MFS_BLOCK_SIZE, s = off % MFS_BLOCK_SIZE;
+		int e = offset + nbytes - blk * MFS_BLOCK_SIZE;
+		if (e > MFS_BLOCK_SIZE) e = MFS_BLOCK_SIZE;
+		page_t *p = page_find(inum, blk);
+		if (p == NULL || s < p->lo || e > p->hi) return 0;
+		memcpy(buffer + off - offset, p->data + s, e - s);
+		p->ref = 1;
+		off += e - s;
+	}
+	return 1;
+}
+
+// the server has these bytes, keep them. inum has nothing dirty
+void page_fill(int inum, char *buffer, int offset, int nbytes) {
+	for (int off = offset; off < offset + nbytes; ) {
+		int blk = off / MFS_BLOCK_SIZE, s = off % MFS_BLOCK_SIZE;
+		int e = offset + nbytes - blk * MFS_BLOCK_SIZE;
+		if (e > MFS_BLOCK_SIZE) e = MFS_BLOCK_SIZE;
+		page_t *p = page_find(inum, blk);
+		if (p == NULL) p = page_alloc(inum, blk);
+		if (p == NULL) return; // nothing to evict, it just isn't cached
+		if (p->lo == p->hi || e < p->lo || s > p->hi) {
+			p->lo = s;
+			p->hi = e;
+		}
+		if (s < p->lo) p->lo = s;
+		if (e > p->hi) p->hi = e;
+		memcpy(p->data + s, buffer + off - offset, e - s);
+		off += e - s;
+	}
+}
+
+// size of inum once its dirty pages are sent, given the server's
+int page_size(int inum, int size) {
+	for (int i = 0; i < MFS_CACHE_PAGES; ++i) {
+		page_t *p = &mfs_pages[i];
+		if (p->used && p->inum == inum && p->dlo != p->dhi && p->blk * MFS_BLOCK_SIZE + p->dhi > size)
+			size = p->blk * MFS_BLOCK_SIZE + p->dhi;
+	}
+	return size;
+}
+
+// 1 if a write there can wait in the cache: the file is a regular one
+// whose size (with what's dirty) is known, and the write doesn't leave a
+// hole, which the server would refuse
+int page_can_buffer(int inum, int offset, int nbytes) {
+	if (nbytes <= 0 || offset < 0 || nbytes > mfs_write_behind) return 0;
+	attr_ent_t *a = attr_get(inum);
+	if (a == NULL || a->type != MFS_REGULAR_FILE) return 0;
+	return offset <= page_size(inum, a->size);
+}
+
+// buffers the write, merging it into the dirty part of each page it hits.
+// a page that would end up with two separate dirty runs is sent first.
+// -1 if a page couldn't be had or sent, some of the write may be buffered
+int page_write(int inum, char *buffer, int offset, int nbytes) {
+	for (int off = offset; off < offset + nbytes; ) {
+		int blk = off / MFS_BLOCK_SIZE, s = off % MFS_BLOCK_SIZE;
+		int e = offset + nbytes - blk * MFS_BLOCK_SIZE;
+		if (e > MFS_BLOCK_SIZE) e = MFS_BLOCK_SIZE;
+		page_t *p = page_find(inum, blk);
+		if (p == NULL) p = page_alloc(inum, blk);
+		if (p == NULL) return -1;
+		if (p->dlo != p->dhi && (e < p->dlo || s > p->dhi) && page_flush(inum) == -1) return -1;
+		if (p->lo == p->hi || e < p->lo || s > p->hi) {
+			p->lo = s;
+			p->hi = e;
+		}
+		if (s < p->lo) p->lo = s;
+		if (e > p->hi) p->hi = e;
+		mfs_dirty -= p->dhi - p->dlo;
+		if (p->dlo == p->dhi) {
+			p->dlo = s;
+			p->dhi = e;
+		}
+		if (s < p->dlo) p->dlo = s;
+		if (e > p->dhi) p->dhi = e;
+		mfs_dirty += p->dhi - p->dlo;
+		memcpy(p->data + s, buffer + off - offset, e - s);
+		p->ref = 1;
+		off += e - s;
+	}
+	return 0;
+}
+
+// nobody is left to tell but stderr
+void page_flush_at_exit() {
+	if (page_flush(-1) == -1) fprintf(stderr, "MFS: buffered writes failed at exit, %d bytes lost\n", mfs_dirty);
+}
+
+void page_init() {
+	static int registered;
+	for (int i = 0; i < MFS_CACHE_PAGES; ++i) {
+		mfs_pages[i].used = 0;
+		mfs_page_hash[i] = -1;
+	}
+	mfs_dirty = 0;
+	mfs_failed = 0;
+	if (!registered) atexit(page_flush_at_exit);
+	registered = 1;
+}
+
+// attributes fresh from the server. a size other than the cached one
+// means the file's clean pages may be stale
+void attr_update(int inum, int type, int size) {
+	attr_ent_t *a = attr_get(inum);
+	if (a == NULL || a->size != size) page_drop_clean(inum);
+	attr_put(inum, type, size);
+}
+
+// the components of a path that resolved, with the error of the next one
+void cache_path(int pinum, char *path, int32_t *inums, int depth, int ret) {
+	char *copy = strdup(path), *save;
+	if (*path == '/') pinum = 0;
+	char *name = strtok_r(copy, "/", &save);
+	for (int i = 0; name && i < depth; ++i) {
+		name_put(pinum, name, inums[i]);
+		pinum = inums[i];
+		name = strtok_r(NULL, "/", &save);
+	}
+	if (name && ret == -1) name_put(pinum, name, -1);
+	free(copy);
+}
+
+// a mutation is on its way: drop what it is about to make stale
+void cache_submitted(int op, int a0, char *name) {
+	int inum;
+	switch (op) {
+	case PROTO_CREAT:
+		name_drop(a0, name);
+		attr_drop(a0); // the parent grows
+		break;
+	case PROTO_UNLINK:
+		// dirty pages of a file whose inum we can't tell must not outlive
+		// it, the inum may come back as another file
+		if (name_get(a0, name, &inum) && inum >= 0) {
+			attr_drop(inum);
+			page_drop(inum);
+		} else {
+			page_flush(-1);
+		}
+		name_drop(a0, name);
+		attr_drop(a0);
+		break;
+	}
+}
+
+// op got ret back, with payload (len bytes) in the reply
+void cache_completed(mfs_op_t *op, int ret, char *payload, int len) {
+	char *name = op->msg + sizeof(proto_req_t);
+	attr_ent_t *a;
+	switch (op->op) {
+	case PROTO_LOOKUP:
+		// other errors are about the parent, not the name
+		if (ret == -1 || ret >= 0) name_put(op->args[0], name, ret);
+		if (ret >= 0 && len == sizeof(proto_attr_t)) {
+			proto_attr_t attr;
+			memcpy(&attr, payload, sizeof(attr));
+			proto_swap_attr(&attr);
+			attr_update(ret, attr.type, attr.size);
+		}
+		break;
+	case PROTO_LOOKUP_PATH: {
+		proto_path_t p;
+		if (len < (int)sizeof(p)) break;
+		memcpy(&p, payload, sizeof(p));
+		proto_swap_path(&p);
+		if (p.depth < 0 || len != (int)(sizeof(p) + p.depth * sizeof(int32_t))) break;
+		int32_t *inums = malloc(p.depth * sizeof(int32_t) + 1);
+		memcpy(inums, payload + sizeof(p), p.depth * sizeof(int32_t));
+		proto_swap_inums(inums, p.depth);
+		cache_path(op->args[0], name, inums, p.depth, ret);
+		if (ret >= 0 && p.attr.type != -1) attr_update(ret, p.attr.type, p.attr.size);
+		if (op->arg) *(int*)op->arg = p.depth;
+		free(inums);
+		break;
+	}
+	case PROTO_STAT:
+		if (ret == 0 && len == sizeof(proto_attr_t)) {
+			proto_attr_t attr;
+			memcpy(&attr, payload, sizeof(attr));
+			proto_swap_attr(&attr);
+			attr_update(op->args[0], attr.type, attr.size);
+		}
+		break;
+	case PROTO_CREAT: {
+		name_drop(op->args[0], name);
+		attr_drop(op->args[0]);
+		int32_t inum;
+		if (ret != 0 || len != sizeof(inum)) break;
+		memcpy(&inum, payload, sizeof(inum));
+		proto_swap_inums(&inum, 1);
+		// the new inum may have been another file's, that this client cached
+		attr_drop(inum);
+		page_drop(inum);
+		name_put(op->args[0], name, inum);
+		break;
+	}
+	case PROTO_READDIRPLUS: {
+		// every entry is a lookup's worth for the caches
+		readdir_t *rd = op->arg;
+		rd->n = 0;
+		if (ret < 0 || len % sizeof(proto_dirent_t)) break;
+		for (int i = 0; i < len / (int)sizeof(proto_dirent_t) && i < rd->max; ++i) {
+			proto_dirent_t d;
+			memcpy(&d, payload + i * sizeof(d), sizeof(d));
+			proto_swap_dirent(&d);
+			d.name[sizeof(d.name) - 1] = '\0';
+			MFS_DirEntPlus_t *e = &rd->ents[rd->n++];
+			strcpy(e->name, d.name);
+			e->inum = d.inum;
+			e->type = d.attr.type;
+			e->size = d.attr.type == MFS_REGULAR_FILE ? page_size(d.inum, d.attr.size) : d.attr.size;
+			name_put(op->args[0], d.name, d.inum);
+			if (d.attr.type != -1) attr_update(d.inum, d.attr.type, d.attr.size);
+		}
+		break;
+	}
+	case PROTO_COMPOUND: {
+		// MFS_CompoundRun goes through the results
+		MFS_Compound_t *c = op->arg;
+		c->results = malloc(len + 1);
+		memcpy(c->results, payload, len);
+		c->results_len = len;
+		break;
+	}
+	case PROTO_UNLINK:
+		if (ret == 0) name_put(op->args[0], name, -1);
+		break;
+	case PROTO_WRITE:
+		a = attr_get(op->args[0]);
+		if (a && ret == 0 && op->args[1] + op->args[2] > a->size) a->size = op->args[1] + op->args[2];
+		if (ret != 0) attr_drop(op->args[0]);
+		if (!op->sync) page_drop_clean(op->args[0]); // an asynchronous one, around the pages
+		break;
+	}
+}
+
+/* cache end */
+
+// the reply m (rc bytes) finishes the op in flight with its xid, if there
+// is one. 1 if it did
+int take_reply(char *m, int rc) {
+	if (rc < (int)sizeof(proto_reply_t)) return 0;
+	proto_reply_t *r = (proto_reply_t*)m;
+	proto_swap_reply(r);
+	if (r->len != rc - sizeof(proto_reply_t)) return 0;
+
+	mfs_op_t **p = &mfs_inflight;
+	while (*p && (*p)->xid != r->xid) p = &(*p)->next;
+	mfs_op_t *op = *p;
+	if (op == NULL) return 0; // an answer to a resend of something already done
+	*p = op->next;
+	mfs_ninflight--;
 
-	do {
-		tv.tv_sec = TIMEOUT;
-		tv.tv_usec = 0;
 #ifdef DEBUG
-		printf("client::sending request %s\n", msg);
+	printf("client::got reply [op:%d xid:%u ret:%d len:%d]\n", r->op, r->xid, r->ret, r->len);
 #endif
-		int rc = UDP_Write(mfs_sd, &addrSnd, msg, BUFFER_SIZE);
-		if (rc < 0) {
-			fprintf(stderr,"client::send fail\n");
-			exit(1);
-		}
+	int ret = r->version == PROTO_VERSION ? r->ret : -1;
+	if (op->buf && ret == 0) {
+		if (r->len != (unsigned int)op->nbytes) ret = -1;
+		else memcpy(op->buf, m + sizeof(proto_reply_t), op->nbytes);
+	}
+	cache_completed(op, ret, m + sizeof(proto_reply_t), r->len);
+	complete(op, ret);
+	return 1;
+}
 
+/*
+ * waits up to timeout seconds (< 0 for as long as it takes) for replies
+ * and hands out the ones that came. anything unanswered for TIMEOUT
+ * seconds is sent again, with the same xid so the server knows it's a
+ * retransmit. returns how many requests completed
+ */
+int pump(double timeout) {
+	double now = mfs_now();
+	double deadline = timeout < 0 ? -1 : now + timeout;
+	while (1) {
+		double wait = -1; // for ever
+		if (deadline >= 0) wait = deadline > now ? deadline - now : 0;
+		for (mfs_op_t *op = mfs_inflight; op; op = op->next) {
+			if (op->sent + TIMEOUT <= now) {
 #ifdef DEBUG
-		printf("client::waiting for reply\n");
+				printf("client::sending request again xid %u\n", op->xid);
 #endif
-	} while (select(mfs_sd + 1, &fdset, NULL, NULL, &tv) != 1); 
+				// a big request the server stopped acking just gets sent again
+				frag_send(mfs_ep, &addrSnd, op->msg, op->len);
+				op->sent = now = mfs_now();
+			}
+			if (wait < 0 || op->sent + TIMEOUT - now < wait) wait = op->sent + TIMEOUT - now;
+		}
+		if (wait < 0) return 0; // nothing in flight and no end to waiting
 
-	char *reply = malloc(BUFFER_SIZE);
-	int rc = UDP_Read(mfs_sd, &addrRcv, reply, BUFFER_SIZE); 
+		// at least a look at the socket
+		int rc = frag_wait(mfs_ep, (long)(wait * 1000000) + 1);
+		now = mfs_now();
+		if (rc == 1) break;
+		if (deadline >= 0 && now >= deadline) return 0;
+	}
+
+	// the ops complete in the order their replies came
+	int got = 0;
+	char *m;
+	int rc;
+	while ((m = frag_recv(mfs_ep, &addrRcv, &rc))) {
+		got += take_reply(m, rc);
+		free(m);
+	}
+	return got;
+}
+
+/*
+ * sends a request with len bytes of payload once there is room in the
+ * window. read data goes to buf. the op stays in flight until its reply,
+ * unless the send failed: then it is done already, with -1
+ */
+mfs_op_t* submit(int op, int a0, int a1, int a2, char *payload, int len, char *buf, int nbytes) {
+	while (mfs_ninflight >= mfs_window) pump(-1);
+
+	proto_req_t req;
+	req.version = PROTO_VERSION;
+	req.op = op;
+	req.flags = 0;
+	req.xid = mfs_xid;
+	req.client = mfs_client;
+	req.arg[0] = a0;
+	req.arg[1] = a1;
+	req.arg[2] = a2;
+	req.len = len;
+	mfs_xid = (mfs_xid + 1) & 0x7fffffff; // xids handed out fit an int
+
+	cache_submitted(op, a0, payload);
+
+	mfs_op_t *o = calloc(1, sizeof(mfs_op_t));
+	o->xid = req.xid;
+	o->op = op;
+	o->args[0] = a0;
+	o->args[1] = a1;
+	o->args[2] = a2;
+	o->len = sizeof(proto_req_t) + len;
+	o->msg = malloc(o->len);
+	o->buf = buf;
+	o->nbytes = nbytes;
+	proto_swap_req(&req);
+	memcpy(o->msg, &req, sizeof(proto_req_t));
+	if (len) memcpy(o->msg + sizeof(proto_req_t), payload, len);
 
 #ifdef DEBUG
-	printf("client::got reply [size:%d contents:(%s)\n", rc, reply);
+	printf("client::sending request op %d xid %u len %d\n", op, o->xid, len);
 #endif
-	return reply;
+	if (frag_send(mfs_ep, &addrSnd, o->msg, o->len) == -1) {
+		free(o->msg);
+		o->msg = NULL;
+		o->done = 1;
+		o->ret = -1;
+		return o;
+	}
+	o->sent = mfs_now();
+	o->next = mfs_inflight;
+	mfs_inflight = o;
+	mfs_ninflight++;
+	return o;
 }
 
-int MFS_Lookup(int pinum, char *name) {
-	char *msg = malloc(BUFFER_SIZE);
-	int bw = sprintf(msg, "0 %d", pinum);
-	memcpy(msg + bw + 1, name, strlen(name) + 1);
+// waits for an op submitted with sync set, returns what it returned
+int wait_op(mfs_op_t *op) {
+	while (!op->done) pump(-1);
+	int ret = op->ret;
+	free(op);
+	return ret;
+}
 
-	char *reply = proc_call(msg);
+// for the synchronous requests
+int call(int op, int a0, int a1, int a2, char *payload, int len, char *buf, int nbytes) {
+	mfs_op_t *o = submit(op, a0, a1, a2, payload, len, buf, nbytes);
+	o->sync = 1;
+	return wait_op(o);
+}
 
-	int ret;
-	sscanf(reply, "%d", &ret);
+// the asynchronous requests, tagged with the xid they return
+int call_async(int op, int a0, int a1, int a2, char *payload, int len, char *buf, int nbytes,
+		MFS_Callback_t cb, void *arg) {
+	if (mfs_ep == NULL) return -1;
+	mfs_op_t *o = submit(op, a0, a1, a2, payload, len, buf, nbytes);
+	if (o->done) {
+		free(o);
+		return -1;
+	}
+	o->cb = cb;
+	o->arg = arg;
+	return o->xid;
+}
 
-	free(msg); free(reply);
-	return ret;
+int MFS_Init(char *hostname, int port) {
+	mfs_sd = UDP_Open(0); // any free port, so several clients can share a host
+	int rc = UDP_FillSockAddr(&addrSnd, hostname, port);
+	if (rc == -1) return -1;
+	mfs_ep = frag_open(mfs_sd);
+	page_init();
+	mfs_xid = mfs_ep->next_id & 0x7fffffff;
+	// the server tells requests apart by client id and xid
+	if (getrandom(&mfs_client, sizeof(mfs_client), 0) != sizeof(mfs_client))
+		mfs_client = mfs_xid ^ (unsigned int)getpid() << 16;
+
+	// how much one read/write request may carry. a server speaking
+	// another version of the protocol says -1
+	int max_io = call(PROTO_INIT, MFS_MAX_IO, 0, 0, NULL, 0, NULL, 0);
+	if (max_io == -1) return -1;
+	if (max_io >= MFS_BLOCK_SIZE) mfs_max_io = max_io;
+	return 0;
 }
 
-int MFS_Write(int inum, char* buffer, int offset, int nbytes) {
-	char *msg = malloc(BUFFER_SIZE);
-	int bw = sprintf(msg, "2 %d %d %d", inum, offset, nbytes);
-	memcpy(msg + bw + 1, buffer, nbytes);
+int MFS_Lookup(int pinum, char *name) {
+	int inum;
+	if (name_get(pinum, name, &inum)) return inum;
+	return call(PROTO_LOOKUP, pinum, 0, 0, name, strlen(name) + 1, NULL, 0);
+}
 
-	char *reply = proc_call(msg);
+/*
+ * resolves every component of path in one request, or none if the cache
+ * knows them all. the inum of the last, or what looking up the one that
+ * failed returned, with its index (from 0) in failed. failed is -1 when
+ * they all resolved
+ */
+int MFS_LookupPath(int pinum, char *path, int *failed) {
+	int depth = -1, inum = -1, known = 1;
+	char *copy = strdup(path), *save;
+	int p = *path == '/' ? 0 : pinum;
+	char *name = strtok_r(copy, "/", &save);
+	for (depth = 0; name; name = strtok_r(NULL, "/", &save), depth++) {
+		if (!name_get(p, name, &inum)) {
+			known = 0;
+			break;
+		}
+		if (inum < 0) break;
+		p = inum;
+	}
+	free(copy);
+	if (!known || depth == 0) {
+		depth = 0;
+		mfs_op_t *o = submit(PROTO_LOOKUP_PATH, pinum, 0, 0, path, strlen(path) + 1, NULL, 0);
+		o->sync = 1;
+		o->arg = &depth;
+		inum = wait_op(o);
+	}
+	if (failed) *failed = inum < 0 ? depth : -1;
+	return inum;
+}
 
-	int ret;
-	sscanf(reply, "%d", &ret);
+// a lookup that always asks the server, so the size it reports
+// revalidates the cached pages
+int MFS_Open(int pinum, char *name) {
+	name_drop(pinum, name);
+	return MFS_Lookup(pinum, name);
+}
 
-	free(msg); free(reply);
-	return ret;
+int MFS_Flush(int inum) {
+	return page_flush(inum);
 }
 
-int MFS_Read(int inum, char *buffer, int offset, int nbytes) {
-	char *msg = malloc(BUFFER_SIZE);
-	int bw = sprintf(msg, "3 %d %d %d", inum, offset, nbytes);
+// from the attribute cache if it can, what's dirty here counts
+int MFS_Stat(int inum, MFS_Stat_t *m) {
+	attr_ent_t *a = attr_get(inum);
+	int type, size;
+	if (a) {
+		type = a->type;
+		size = a->size;
+	} else {
+		proto_attr_t attr;
+		mfs_op_t *o = submit(PROTO_STAT, inum, 0, 0, NULL, 0, (char*)&attr, sizeof(attr));
+		o->sync = 1;
+		if (wait_op(o) == -1) return -1;
+		proto_swap_attr(&attr);
+		type = attr.type;
+		size = attr.size;
+	}
+	m->type = type;
+	m->size = page_size(inum, size);
+	return 0;
+}
+
+int MFS_ReadDirPlus(int inum, int *cookie, MFS_DirEntPlus_t *ents, int max) {
+	int fit = mfs_max_io / sizeof(proto_dirent_t);
+	if (max <= 0) return -1;
+	if (max > fit) max = fit;
+	readdir_t rd = { ents, max, 0 };
+	mfs_op_t *o = submit(PROTO_READDIRPLUS, inum, *cookie, max, NULL, 0, NULL, 0);
+	o->sync = 1;
+	o->arg = &rd;
+	int next = wait_op(o);
+	if (next < 0) return -1;
+	*cookie = next;
+	return rd.n;
+}
+
+int MFS_Shutdown() {
+	if (page_flush(-1) == -1) return -1;
+	return call(PROTO_SHUTDOWN, 0, 0, 0, NULL, 0, NULL, 0);
+}
+
+int write_chunk(int inum, char* buffer, int offset, int nbytes) {
+	return call(PROTO_WRITE, inum, offset, nbytes, buffer, nbytes, NULL, 0);
+}
 
-	char *reply = proc_call(msg);
+// writes the page cache can't hold go straight out, after what it has
+// buffered for the file. up to mfs_max_io bytes go in one request, anything
+// bigger takes several. each one may extend what the last one wrote, so
+// they go one at a time. -1 too if buffered writes of the file failed
+// since the last call on it
+int MFS_Write(int inum, char* buffer, int offset, int nbytes) {
+	if (page_check(inum) == -1) return -1;
+	if (page_can_buffer(inum, offset, nbytes) && page_write(inum, buffer, offset, nbytes) == 0) {
+		// other files' failures wait for calls on those
+		if (mfs_dirty > mfs_write_behind && page_flush(-1) == -1 && page_failed(inum)) return -1;
+		return 0;
+	}
+	if (page_flush(inum) == -1) return -1;
+	for (int done = 0; done < nbytes || done == 0; done += mfs_max_io) {
+		int sz = nbytes - done < mfs_max_io ? nbytes - done : mfs_max_io;
+		if (write_chunk(inum, buffer + done, offset + done, sz) == -1) {
+			page_drop(inum);
+			return -1;
+		}
+	}
+	if (nbytes > 0 && offset >= 0) page_fill(inum, buffer, offset, nbytes);
+	return 0;
+}
 
-	int cur = 0, ret = 0;
-	sscanf(reply, "%d%n", &ret, &cur);
-	memcpy(buffer, reply + cur + 1, nbytes);
-	free(msg); free(reply);
+// reads the page cache can't answer go to the server once the file's
+// dirty pages are there. reads bigger than mfs_max_io have all their
+// pieces in flight at once
+int MFS_Read(int inum, char *buffer, int offset, int nbytes) {
+	if (page_check(inum) == -1) return -1;
+	if (page_read(inum, buffer, offset, nbytes)) return 0;
+	if (page_flush(inum) == -1) return -1;
+	int n = nbytes > mfs_max_io ? (nbytes + mfs_max_io - 1) / mfs_max_io : 1;
+	mfs_op_t **ops = malloc(sizeof(mfs_op_t*) * n);
+	for (int i = 0; i < n; ++i) {
+		int done = i * mfs_max_io;
+		int sz = nbytes - done < mfs_max_io ? nbytes - done : mfs_max_io;
+		ops[i] = submit(PROTO_READ, inum, offset + done, sz, NULL, 0, buffer + done, sz);
+		ops[i]->sync = 1;
+	}
+	int ret = 0;
+	for (int i = 0; i < n; ++i) {
+		if (wait_op(ops[i]) == -1) ret = -1;
+	}
+	free(ops);
+	if (ret == 0 && nbytes > 0 && offset >= 0) page_fill(inum, buffer, offset, nbytes);
 	return ret;
 }
 
 int MFS_Creat(int pinum, int type, char* name) {
-	char *msg = malloc(BUFFER_SIZE);
-	int bw = sprintf(msg, "4 %d %d", pinum, type);
-	memcpy(msg + bw + 1, name, strlen(name) + 1);
+	return call(PROTO_CREAT, pinum, type, 0, name, strlen(name) + 1, NULL, 0);
+}
+
+int MFS_Unlink(int pinum, char *name) {
+	return call(PROTO_UNLINK, pinum, 0, 0, name, strlen(name) + 1, NULL, 0);
+}
 
-	char *reply = proc_call(msg);
+int MFS_SetCacheTTL(int ms) {
+	if (ms < 0) return -1;
+	mfs_ttl = ms / 1000.0;
+	memset(mfs_names, 0, sizeof(mfs_names));
+	memset(mfs_attrs, 0, sizeof(mfs_attrs));
+	return 0;
+}
 
-	int ret;
-	sscanf(reply, "%d", &ret);
+int MFS_SetWriteBehind(int bytes) {
+	if (bytes < 0) return -1;
+	mfs_write_behind = bytes;
+	return page_flush(-1);
+}
 
-	free(msg); free(reply);
-	return ret;
+/* asynchronous api start */
+
+int MFS_SetWindow(int n) {
+	if (n < 1) return -1;
+	mfs_window = n;
+	return 0;
 }
 
-int MFS_Unlink(int pinum, char *name) {
-	char *msg = malloc(BUFFER_SIZE);
-	int bw = sprintf(msg, "5 %d", pinum);
-	memcpy(msg + bw + 1, name, strlen(name) + 1);
+int MFS_LookupAsync(int pinum, char *name, MFS_Callback_t cb, void *arg) {
+	return call_async(PROTO_LOOKUP, pinum, 0, 0, name, strlen(name) + 1, NULL, 0, cb, arg);
+}
+
+int MFS_WriteAsync(int inum, char *buffer, int offset, int nbytes, MFS_Callback_t cb, void *arg) {
+	if (nbytes > mfs_max_io) return -1;
+	if (page_flush(inum) == -1) return -1;
+	page_drop(inum);
+	return call_async(PROTO_WRITE, inum, offset, nbytes, buffer, nbytes, NULL, 0, cb, arg);
+}
 
-	char *reply = proc_call(msg);
+int MFS_ReadAsync(int inum, char *buffer, int offset, int nbytes, MFS_Callback_t cb, void *arg) {
+	if (nbytes > mfs_max_io) return -1;
+	if (page_flush(inum) == -1) return -1;
+	return call_async(PROTO_READ, inum, offset, nbytes, NULL, 0, buffer, nbytes, cb, arg);
+}
 
-	int ret;
-	sscanf(reply, "%d", &ret);
+int MFS_CreatAsync(int pinum, int type, char *name, MFS_Callback_t cb, void *arg) {
+	return call_async(PROTO_CREAT, pinum, type, 0, name, strlen(name) + 1, NULL, 0, cb, arg);
+}
 
-	free(msg); free(reply);
-	return ret;
+int MFS_UnlinkAsync(int pinum, char *name, MFS_Callback_t cb, void *arg) {
+	return call_async(PROTO_UNLINK, pinum, 0, 0, name, strlen(name) + 1, NULL, 0, cb, arg);
+}
+
+int MFS_Poll(MFS_Completion_t *c, int timeout_ms) {
+	double deadline = mfs_now() + timeout_ms / 1000.0;
+	while (mfs_polled == NULL) {
+		if (!mfs_ninflight) return -1;
+		double left = timeout_ms < 0 ? -1 : deadline - mfs_now();
+		if (timeout_ms >= 0 && left <= 0) return 0;
+		pump(left);
+	}
+
+	mfs_op_t *op = mfs_polled;
+	mfs_polled = op->next;
+	if (mfs_polled == NULL) mfs_polled_tail = NULL;
+	c->xid = op->xid;
+	c->ret = op->ret;
+	c->arg = op->arg;
+	free(op);
+	return 1;
+}
+
+int MFS_Drain() {
+	while (mfs_ninflight) pump(-1);
+	return 0;
+}
+
+/* asynchronous api end */
+
+/* compound start */
+
+MFS_Compound_t* MFS_CompoundNew() {
+	return calloc(1, sizeof(MFS_Compound_t));
+}
+
+void MFS_CompoundFree(MFS_Compound_t *c) {
+	for (int i = 0; i < c->n; ++i) free(c->ops[i].name);
+	free(c->msg);
+	free(c);
 }
 
+// appends an op, the index it gets or -1 if it can't have one. the request
+// and its reply have to fit in one message
+int compound_add(MFS_Compound_t *c, int op, int a0, int a1, int a2, char *payload, int len, char *buf, int nbytes) {
+	if (c->n == MFS_COMPOUND_MAX || len > mfs_max_io || nbytes > mfs_max_io) return -1;
+	int rlen = sizeof(proto_result_t) + (op == PROTO_READ ? nbytes : op == PROTO_LOOKUP ? (int)sizeof(proto_attr_t)
+			: op == PROTO_CREAT ? (int)sizeof(int32_t) : 0);
+	if (sizeof(proto_req_t) + c->len + sizeof(proto_op_t) + len > FRAG_MAX_MSG
+			|| sizeof(proto_reply_t) + c->reply_len + rlen > FRAG_MAX_MSG) return -1;
+	proto_op_t o;
+	memset(&o, 0, sizeof(o));
+	o.op = op;
+	o.arg[0] = a0;
+	o.arg[1] = a1;
+	o.arg[2] = a2;
+	o.len = len;
+	if (a0 <= MFS_RESULT(0)) {
+		o.arg[0] = MFS_RESULT(0) - a0;
+		if (o.arg[0] >= c->n) return -1; // only earlier results
+		o.flags |= PROTO_ARG_RESULT(0);
+	}
+	proto_swap_op(&o);
+	c->msg = realloc(c->msg, c->len + sizeof(o) + len);
+	memcpy(c->msg + c->len, &o, sizeof(o));
+	if (len) memcpy(c->msg + c->len + sizeof(o), payload, len);
+	c->len += sizeof(o) + len;
+	c->reply_len += rlen;
+
+	compound_op_t *e = &c->ops[c->n];
+	e->op = op;
+	e->args[0] = a0;
+	e->args[1] = a1;
+	e->args[2] = a2;
+	e->name = op == PROTO_CREAT || op == PROTO_UNLINK || op == PROTO_LOOKUP ? strdup(payload) : NULL;
+	e->buf = buf;
+	e->nbytes = nbytes;
+	return c->n++;
+}
+
+int MFS_CompoundLookup(MFS_Compound_t *c, int pinum, char *name) {
+	return compound_add(c, PROTO_LOOKUP, pinum, 0, 0, name, strlen(name) + 1, NULL, 0);
+}
+
+int MFS_CompoundCreat(MFS_Compound_t *c, int pinum, int type, char *name) {
+	return compound_add(c, PROTO_CREAT, pinum, type, 0, name, strlen(name) + 1, NULL, 0);
+}
+
+int MFS_CompoundWrite(MFS_Compound_t *c, int inum, char *buffer, int offset, int nbytes) {
+	return compound_add(c, PROTO_WRITE, inum, offset, nbytes, buffer, nbytes, NULL, 0);
+}
+
+int MFS_CompoundRead(MFS_Compound_t *c, int inum, char *buffer, int offset, int nbytes) {
+	return compound_add(c, PROTO_READ, inum, offset, nbytes, NULL, 0, buffer, nbytes);
+}
+
+int MFS_CompoundUnlink(MFS_Compound_t *c, int pinum, char *name) {
+	return compound_add(c, PROTO_UNLINK, pinum, 0, 0, name, strlen(name) + 1, NULL, 0);
+}
+
+// what an op of a compound has done to the caches. a0 is its first arg,
+// with any earlier result it took
+void compound_completed(compound_op_t *e, int a0, int ret, char *payload, int len) {
+	int inum;
+	attr_ent_t *a;
+	switch (e->op) {
+	case PROTO_LOOKUP:
+		if (ret == -1 || ret >= 0) name_put(a0, e->name, ret);
+		if (ret >= 0 && len == sizeof(proto_attr_t)) {
+			proto_attr_t attr;
+			memcpy(&attr, payload, sizeof(attr));
+			proto_swap_attr(&attr);
+			attr_update(ret, attr.type, attr.size);
+		}
+		break;
+	case PROTO_CREAT:
+		name_drop(a0, e->name);
+		attr_drop(a0);
+		if (ret < 0) break;
+		// the new inum may have been another file's, that this client cached
+		attr_drop(ret);
+		page_drop(ret);
+		name_put(a0, e->name, ret);
+		break;
+	case PROTO_WRITE:
+		a = attr_get(a0);
+		if (a && ret == 0 && e->args[1] + e->args[2] > a->size) a->size = e->args[1] + e->args[2];
+		if (ret != 0) attr_drop(a0);
+		page_drop(a0);
+		break;
+	case PROTO_READ:
+		if (ret == 0 && len == e->nbytes) memcpy(e->buf, payload, len);
+		break;
+	case PROTO_UNLINK:
+		if (name_get(a0, e->name, &inum) && inum >= 0) {
+			attr_drop(inum);
+			page_drop(inum);
+		}
+		name_drop(a0, e->name);
+		if (ret == 0) name_put(a0, e->name, -1);
+		attr_drop(a0);
+		break;
+	}
+}
+
+/*
+ * sends the ops as one request. the server runs them in order, stopping at
+ * the first that fails, and commits them together. rets gets what each one
+ * returned (-1 for those that didn't run), a creat's being the inum it
+ * made. how many succeeded, -1 if there are no ops, buffered writes
+ * failed to go out before them or the request couldn't be sent
+ */
+int MFS_CompoundRun(MFS_Compound_t *c, int *rets) {
+	if (c->n == 0) return -1;
+	// buffered writes go first, the ops may read or change those files
+	if (page_flush(-1) == -1) return -1;
+	c->results = NULL;
+	c->results_len = 0;
+	mfs_op_t *o = submit(PROTO_COMPOUND, c->n, 0, 0, c->msg, c->len, NULL, 0);
+	o->sync = 1;
+	o->arg = c;
+	// no results means no reply, the request couldn't be sent
+	if (wait_op(o) == -1 && c->results == NULL) return -1;
+
+	int ok = 0, pos = 0;
+	for (int i = 0; i < c->n; ++i) {
+		rets[i] = -1;
+		proto_result_t r;
+		if (c->results_len - pos < (int)sizeof(r)) continue;
+		memcpy(&r, c->results + pos, sizeof(r));
+		proto_swap_result(&r);
+		pos += sizeof(r);
+		if (r.len > (unsigned int)(c->results_len - pos)) {
+			pos = c->results_len;
+			continue;
+		}
+		compound_op_t *e = &c->ops[i];
+		int a0 = e->args[0] <= MFS_RESULT(0) ? rets[MFS_RESULT(0) - e->args[0]] : e->args[0];
+		rets[i] = r.ret;
+		compound_completed(e, a0, r.ret, c->results + pos, r.len);
+		pos += r.len;
+		if (r.ret >= 0) ok++;
+	}
+	free(c->results);
+	c->results = NULL;
+	return ok;
+}
+
+/* compound end */
+
 /*
 int main(void) {
 	char *hostname = "localhost"; int portnum = 6969;
@@ -17,27 +17,124 @@
 
 #define BUFFER_SIZE (8192)
 
+// largest MFS_Read/MFS_Write asked of the server in one request, it may
+// settle for less at MFS_Init. bigger calls are split up
+#define MFS_MAX_IO (1 << 20)
+
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
     int size;   // bytes
     // note: no permissions, access times, etc.
 } MFS_Stat_t;
 
+// a directory entry with the attributes of what it names (MFS_ReadDirPlus),
+// type -1 if that went away while the entry was read
+typedef struct __MFS_DirEntPlus_t {
+    char name[28];
+    int  inum;
+    int  type;
+    int  size;
+} MFS_DirEntPlus_t;
+
 typedef struct __MFS_DirEnt_t {
     char name[28];  // up to 28 bytes of name in directory (including \0)
     int  inum;      // inode number of entry (-1 means entry not used)
 } MFS_DirEnt_t;
 
+// how long the client trusts what lookups told it (MFS_SetCacheTTL, 0 turns the cache off)
+#define MFS_DEFAULT_TTL_MS (1000)
+
+// entries in each of the client's lookup and attribute caches
+#define MFS_CACHE_SLOTS (1024)
+
+// blocks of file data the client caches
+#define MFS_CACHE_PAGES (256)
+
+// dirty bytes the client holds before it sends them (MFS_SetWriteBehind,
+// 0 sends every write as it is made)
+#define MFS_DEFAULT_WRITE_BEHIND (256 * 1024)
+
+// requests the asynchronous calls may have in flight at once (MFS_SetWindow)
+#define MFS_DEFAULT_WINDOW (32)
+
+// how an asynchronous request turned out
+typedef struct __MFS_Completion_t {
+    int xid;    // what the call that sent it returned
+    int ret;    // what the synchronous call would have returned
+    void *arg;  // as passed to it
+} MFS_Completion_t;
+
+typedef void (*MFS_Callback_t)(MFS_Completion_t *c);
+
 extern struct sockaddr_in addrSnd, addrRcv;
 extern int mfs_sd;
+extern int mfs_max_io;
 
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
+// every component of a path like "a/b/c" in one request (a leading '/'
+// starts at the root). the last one's inum, or what MFS_Lookup of the
+// one that failed returned, with its index from 0 in *failed (-1 if none)
+int MFS_LookupPath(int pinum, char *path, int *failed);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int offset, int nbytes);
 int MFS_Read(int inum, char *buffer, int offset, int nbytes);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
+// up to max entries of directory inum from *cookie (0 to start) on, with
+// their attributes. returns how many, *cookie is where the next call goes
+// on from, 0 once the last entry has been returned
+int MFS_ReadDirPlus(int inum, int *cookie, MFS_DirEntPlus_t *ents, int max);
+int MFS_SetCacheTTL(int ms);
+
+// writes may sit in the client's page cache until MFS_Flush sends the
+// file's (inum -1 for all of them), which is what closing a file should
+// do. errors in the writes it sends show up there, or in the next call on
+// the file when another flush sent them; the pages stay dirty, so a later
+// flush tries again. MFS_Open is MFS_Lookup
+// but always asks the server, dropping cached pages if the file's size
+// changed. what's still dirty at exit is flushed then
+int MFS_Open(int pinum, char *name);
+int MFS_Flush(int inum);
+int MFS_SetWriteBehind(int bytes);
+
+// asynchronous calls. each sends its request and returns the xid tagging
+// it (-1 if it can't be sent), the completion goes to cb or, with cb NULL,
+// to MFS_Poll. replies come in any order. a call made with the window full
+// waits for a completion first. reads and writes are at most one request
+// (the max settled at MFS_Init), a read's buffer is filled on completion
+int MFS_SetWindow(int n);
+int MFS_LookupAsync(int pinum, char *name, MFS_Callback_t cb, void *arg);
+int MFS_WriteAsync(int inum, char *buffer, int offset, int nbytes, MFS_Callback_t cb, void *arg);
+int MFS_ReadAsync(int inum, char *buffer, int offset, int nbytes, MFS_Callback_t cb, void *arg);
+int MFS_CreatAsync(int pinum, int type, char *name, MFS_Callback_t cb, void *arg);
+int MFS_UnlinkAsync(int pinum, char *name, MFS_Callback_t cb, void *arg);
+// 1 and a completion in c, 0 if none came in timeout_ms (< 0 waits for
+// ever), -1 if nothing is in flight to wait for
+int MFS_Poll(MFS_Completion_t *c, int timeout_ms);
+// waits for everything in flight, callbacks run, MFS_Poll ones are kept
+int MFS_Drain();
+
+// compound requests: ops added to one go to the server in one request, run
+// in order until one fails, and are committed together. the inum or pinum
+// of an op may be MFS_RESULT(i), the result of op i before it, where a
+// creat's result is the inum it made. the add calls return the op's index
+// (-1 if it can't be added, which includes the request or its reply
+// outgrowing one message). read buffers are filled by MFS_CompoundRun
+#define MFS_COMPOUND_MAX (256)
+#define MFS_RESULT(i) (-16 - (i))
+
+typedef struct __MFS_Compound_t MFS_Compound_t;
+
+MFS_Compound_t* MFS_CompoundNew();
+int MFS_CompoundLookup(MFS_Compound_t *c, int pinum, char *name);
+int MFS_CompoundCreat(MFS_Compound_t *c, int pinum, int type, char *name);
+int MFS_CompoundWrite(MFS_Compound_t *c, int inum, char *buffer, int offset, int nbytes);
+int MFS_CompoundRead(MFS_Compound_t *c, int inum, char *buffer, int offset, int nbytes);
+int MFS_CompoundUnlink(MFS_Compound_t *c, int pinum, char *name);
+// how many ops succeeded, rets[i] what op i returned (-1 if it didn't run)
+int MFS_CompoundRun(MFS_Compound_t *c, int *rets);
+void MFS_CompoundFree(MFS_Compound_t *c);
 
 #endif // __MFS_h__
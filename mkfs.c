@@ -6,9 +6,10 @@
 #include <unistd.h>
 
 #include "ufs.h"
+#include "journal.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-j <num_journal_blocks>] [-V <format version>] [-I <inode size>]\n");
     exit(1);
 }
 
@@ -17,9 +18,12 @@ int main(int argc, char *argv[]) {
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
+    int num_journal = 64;
+    int version = -1;
+    int inode_size = 0;
     int visual = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:j:V:I:v")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -27,6 +31,15 @@ int main(int argc, char *argv[]) {
 	case 'd':
 	    num_data = atoi(optarg);
 	    break;
+	case 'j':
+	    num_journal = atoi(optarg);
+	    break;
+	case 'V':
+	    version = atoi(optarg);
+	    break;
+	case 'I':
+	    inode_size = atoi(optarg);
+	    break;
 	case 'f':
 	    image_file = optarg;
 	    break;
@@ -58,6 +71,17 @@ int main(int argc, char *argv[]) {
 
     assert(num_inodes >= 32);
     assert(num_data >= 32);
+    assert(num_journal == 0 || num_journal >= 2); // journal super + at least one log block
+    // bigger inodes mean inline data, extents otherwise
+    if (version == -1)
+	version = inode_size ? UFS_VERSION_INLINE : UFS_VERSION_EXTENT;
+    if (version == UFS_VERSION_INLINE && !inode_size)
+	inode_size = 512;
+    assert(version >= UFS_VERSION_DIRECT && version <= UFS_VERSION_INLINE);
+    if (version == UFS_VERSION_INLINE)
+	assert(inode_size >= 256 && inode_size <= UFS_BLOCK_SIZE && !(inode_size & (inode_size - 1)));
+    else
+	assert(inode_size == 0);
 
     // presumed: block 0 is the super block
     super_t s;
@@ -65,6 +89,9 @@ int main(int argc, char *argv[]) {
     // totals
     s.num_inodes = num_inodes;
     s.num_data = num_data;
+    s.version = version;
+    s.clean = 1; // nothing to recover on a fresh image
+    s.inode_size = version == UFS_VERSION_INLINE ? inode_size : (int)sizeof(inode_t);
 
     // inode bitmap
     int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
@@ -82,16 +109,20 @@ int main(int argc, char *argv[]) {
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
+    int total_inode_bytes = num_inodes * s.inode_size;
     s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
     if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
 	s.inode_region_len++;
 
+    // metadata journal
+    s.journal_addr = s.inode_region_addr + s.inode_region_len;
+    s.journal_len = num_journal;
+
     // data blocks
-    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
+    s.data_region_addr = s.journal_addr + s.journal_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.journal_len + s.data_region_len;
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -101,11 +132,14 @@ int main(int argc, char *argv[]) {
     }
 
     printf("total blocks        %d\n", total_blocks);
-    printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
+    printf("  inodes            %d [size of each: %d]\n", num_inodes, s.inode_size);
     printf("  data blocks       %d\n", num_data);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    printf("  journal address/len      %d [%d]\n", s.journal_addr, s.journal_len);
+    printf("  format version           %d%s\n", s.version, s.version == UFS_VERSION_INLINE ? " [extents, inline data]"
+	    : s.version == UFS_VERSION_EXTENT ? " [extents]" : " [direct pointers]");
 
     // first, zero out all the blocks
     int i;
@@ -157,6 +191,18 @@ int main(int argc, char *argv[]) {
     rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
+    //
+    // empty journal: the log starts at its first block with record seq 1
+    //
+    if (s.journal_len) {
+	journal_super_t js;
+	js.magic = JOURNAL_MAGIC;
+	js.seq = 1;
+	js.start = 0;
+	rc = pwrite(fd, &js, sizeof(js), s.journal_addr * UFS_BLOCK_SIZE);
+	assert(rc == sizeof(js));
+    }
+
     // 
     // need to write out root directory contents to first data block
     // create a root directory, with nothing in it
@@ -190,6 +236,8 @@ int main(int argc, char *argv[]) {
 	    printf("d");
 	for (i = 0; i < s.inode_region_len; i++)
 	    printf("I");
+	for (i = 0; i < s.journal_len; i++)
+	    printf("J");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
 	printf("\n\n");
@@ -0,0 +1,52 @@
+/*
+ * proto.c - byte order of the wire headers in proto.h
+ * nothing to do on little-endian hosts
+ */
+
+#include <endian.h>
+
+#include "proto.h"
+
+void proto_swap_req(proto_req_t *r) {
+	r->flags = htole16(r->flags);
+	r->xid = htole32(r->xid);
+	r->client = htole32(r->client);
+	for (int i = 0; i < 3; ++i) r->arg[i] = htole32(r->arg[i]);
+	r->len = htole32(r->len);
+}
+
+void proto_swap_reply(proto_reply_t *r) {
+	r->flags = htole16(r->flags);
+	r->xid = htole32(r->xid);
+	r->ret = htole32(r->ret);
+	r->len = htole32(r->len);
+}
+
+void proto_swap_attr(proto_attr_t *a) {
+	a->type = htole32(a->type);
+	a->size = htole32(a->size);
+}
+
+void proto_swap_path(proto_path_t *p) {
+	p->depth = htole32(p->depth);
+	proto_swap_attr(&p->attr);
+}
+
+void proto_swap_inums(int32_t *inums, int n) {
+	for (int i = 0; i < n; ++i) inums[i] = htole32(inums[i]);
+}
+
+void proto_swap_op(proto_op_t *o) {
+	for (int i = 0; i < 3; ++i) o->arg[i] = htole32(o->arg[i]);
+	o->len = htole32(o->len);
+}
+
+void proto_swap_result(proto_result_t *r) {
+	r->ret = htole32(r->ret);
+	r->len = htole32(r->len);
+}
+
+void proto_swap_dirent(proto_dirent_t *d) {
+	d->inum = htole32(d->inum);
+	proto_swap_attr(&d->attr);
+}
@@ -0,0 +1,106 @@
+#ifndef __proto_h__
+#define __proto_h__
+
+#include <stdint.h>
+
+/*
+ * wire format between mfs.c and server.c. every message is one of these
+ * headers, all fields little-endian, followed by len bytes of payload.
+ * frag.c carries it, a datagram is only as long as the message
+ */
+
+#define PROTO_VERSION (2)
+
+// proto_req_t.op, arg[] is what each one takes
+#define PROTO_LOOKUP (0) // pinum, payload is the name, reply payload the proto_attr_t of what it found
+#define PROTO_STAT   (1) // inum, reply payload is its proto_attr_t
+#define PROTO_WRITE  (2) // inum, offset, nbytes, payload is the data
+#define PROTO_READ   (3) // inum, offset, nbytes, reply payload is the data
+#define PROTO_CREAT  (4) // pinum, type, payload is the name, reply payload the new inum (int32_t)
+#define PROTO_UNLINK (5) // pinum, payload is the name
+#define PROTO_SHUTDOWN (6) // the server replies, then shuts down cleanly
+#define PROTO_INIT   (7) // biggest read/write the client wants, ret is what it gets
+#define PROTO_LOOKUP_PATH (8) // pinum, payload is a path of names split by '/' (one leading
+                              // '/' starts at the root), reply payload is a proto_path_t
+                              // then the int32_t inum of each component it resolved
+#define PROTO_COMPOUND (9) // number of ops, payload is that many proto_op_t each followed by
+                           // its payload. they run in order until one fails, and are
+                           // committed together. reply payload is a proto_result_t, then its
+                           // payload, for each op that ran. ret is 0 if they all succeeded
+
+#define PROTO_READDIRPLUS (10) // dir inum, cookie (0 to start), most entries (0 for as many as
+                              // fit a read). reply payload is a proto_dirent_t per entry, ret
+                              // the cookie to go on from, 0 after the last entry
+
+// most ops one PROTO_COMPOUND may carry
+#define PROTO_COMPOUND_MAX (256)
+
+typedef struct __proto_req {
+	uint8_t version;
+	uint8_t op;
+	uint16_t flags;  // none yet
+	uint32_t xid;    // picked by the client, the reply carries it back
+	uint32_t client; // random id of the client, with xid it names the request
+	int32_t arg[3];
+	uint32_t len;    // payload bytes
+} proto_req_t;
+
+typedef struct __proto_reply {
+	uint8_t version;
+	uint8_t op;
+	uint16_t flags;
+	uint32_t xid;
+	int32_t ret;
+	uint32_t len;    // payload bytes
+} proto_reply_t;
+
+// what the client caches about an inode
+typedef struct __proto_attr {
+	int32_t type;
+	int32_t size;
+} proto_attr_t;
+
+// how far a PROTO_LOOKUP_PATH got. ret is the last inum, or the lookup
+// error of the component after the depth that resolved
+typedef struct __proto_path {
+	int32_t depth;
+	proto_attr_t attr; // of the last inum, type -1 if there is none
+} proto_path_t;
+
+// one operation of a PROTO_COMPOUND: any of the single requests but
+// PROTO_INIT, PROTO_SHUTDOWN and PROTO_COMPOUND. a creat's result there is the new inum
+typedef struct __proto_op {
+	uint8_t op;
+	uint8_t flags;   // PROTO_ARG_RESULT(n): arg[n] is the index of an earlier op, and takes its result
+	uint16_t pad;
+	int32_t arg[3];
+	uint32_t len;    // payload bytes
+} proto_op_t;
+
+#define PROTO_ARG_RESULT(n) (1 << (n))
+
+typedef struct __proto_result {
+	uint8_t op;
+	uint8_t pad[3];
+	int32_t ret;
+	uint32_t len;    // payload bytes, as in the reply to a single request
+} proto_result_t;
+
+// a directory entry with the attributes of what it names
+typedef struct __proto_dirent {
+	char name[28];
+	int32_t inum;
+	proto_attr_t attr; // type -1 if it went away before it could be read
+} proto_dirent_t;
+
+// between host and wire byte order, either way round
+void proto_swap_req(proto_req_t *r);
+void proto_swap_reply(proto_reply_t *r);
+void proto_swap_attr(proto_attr_t *a);
+void proto_swap_path(proto_path_t *p);
+void proto_swap_inums(int32_t *inums, int n);
+void proto_swap_op(proto_op_t *o);
+void proto_swap_result(proto_result_t *r);
+void proto_swap_dirent(proto_dirent_t *d);
+
+#endif // __proto_h__
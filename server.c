@@ -2,107 +2,846 @@
  * server.c - file server implementation
  * simple wrapper around ufs.c
  * created on mar 14 2024 by ashish ahuja
+ *
+ * requests come in on one or more shards, each a UDP socket on the server's
+ * port (SO_REUSEPORT) with its own thread pinned to a CPU. a shard receives
+ * requests, hands them to a pool of workers that run them against ufs in
+ * parallel, and sends the replies they hand back (holding them for group
+ * commit if need be). the main thread just handles signals
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ufs.h"
 #include "udp.h"
-
-// some ops like write have max nbytes of 4096, so 8192 seems good
-#define BUFFER_SIZE (8192)
+#include "frag.h"
+#include "proto.h"
+#include "drc.h"
 
 #define DEBUG
 
-int main(int argc, char **argv) {
-	assert(argc > 2);
-	int portnum = strtol(argv[1], NULL, 10);
+// group commit flushes early once this many mutations are waiting (-b)
+#define GC_DEFAULT_BATCH (32)
 
-	int sd = UDP_Open(portnum); 
-	assert(sd > -1);
+// replies to mutations remembered for retransmits (-r)
+#define DRC_DEFAULT_ENTRIES (4096)
 
-	ufs *nfs = ufs_init(argv[2]); assert(nfs != NULL);
+// quiet time after which the server lets ufs do its lazy work (journal checkpoints)
+#define IDLE_USEC (100000)
 
-	/*
-	 * serialization fmt: normal ints in the beginning in a null-terminated
-	 * string (space-separated), remaining bytes are whatever buffer etc.
-	 */
-	while (1) {
-		struct sockaddr_in addr;
-		char *msg = malloc(sizeof(char) * BUFFER_SIZE);
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t stop = 0;
+
+void handle_sigusr1(int sig) {
+	(void)sig;
+	dump_stats = 1;
+}
+
+void handle_stop(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+void usage() {
+	fprintf(stderr, "usage: server [-c <cache_blocks>] [-i <inode_blocks>] [-m] [-e <blocking|uring>] [-g <group commit window usec>] [-b <max batch>] [-t <workers>] [-s <shards>] [-r <reply cache entries>] <port> <disk image>\n");
+	exit(1);
+}
+
+double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// which request a reply answers, for the duplicate request cache
+typedef struct __req_key {
+	unsigned int client, xid;
+	int cached; // went through drc_begin, drc_end once the reply is out
+} req_key_t;
+
+// a reply that can't go out until the batch it belongs to is on disk
+typedef struct __held_reply {
+	struct sockaddr_in addr;
+	char *reply;
+	int len;
+	req_key_t key;
+} held_reply_t;
+
+typedef struct __gc_stats {
+	long batches;
+	long mutations;
+	long max_batch;
+	double sync_us, max_sync_us; // ufs_sync time
+	double hold_us, max_hold_us; // first reply held to replies out
+} gc_stats_t;
+
+typedef struct __batch {
+	held_reply_t *held;
+	int n, cap;
+	int mutations;     // how many of the held replies are for mutations
+	double opened;     // when the first reply was held
+	double deadline;
+	int window;        // -g, 0 if group commit is off
+	int max;           // -b
+	drc_t *drc;        // NULL if -r 0
+	gc_stats_t stats;
+} batch_t;
+
+struct __shard;
+
+// one request on its way through a worker
+typedef struct __work {
+	struct sockaddr_in addr;
+	char *msg;
+	int len;
+	char *reply;
+	int reply_len;
+	int mutation;
+	req_key_t key;
+	struct __shard *shard; // the one it came in on, the reply goes out there
+	struct __work *next;
+} work_t;
+
+// fifo of work between the shards and the workers
+typedef struct __work_queue {
+	work_t *head, *tail;
+	int closed; // nothing more is coming
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} work_queue_t;
+
+// what the workers and shards share
+typedef struct __server {
+	ufs *nfs;
+	work_queue_t todo; // requests
+	int nworkers;      // 0 runs requests on the shard threads
+	drc_t *drc;
+	int inflight;      // requests handed to the workers and not answered yet
+	int stopping;      // set by the main thread, the shards finish up
+	struct __shard *shards;
+	int nshards;
+} server_t;
+
+// one socket on the port and the thread serving it. a client's datagrams
+// always land on the same socket, so all its fragments and acks do too
+typedef struct __shard {
+	int id;
+	int sd;
+	frag_ep_t *ep;
+	batch_t batch;
+	work_queue_t done; // requests with their replies
+	int wake[2];       // pipe that gets the shard out of frag_wait when something is done
+	pthread_t thread;
+	server_t *srv;
+} shard_t;
+
+void print_gc_stats(server_t *srv) {
+	gc_stats_t s;
+	memset(&s, 0, sizeof(s));
+	for (int i = 0; i < srv->nshards; ++i) {
+		gc_stats_t *t = &srv->shards[i].batch.stats;
+		s.batches += t->batches;
+		s.mutations += t->mutations;
+		if (t->max_batch > s.max_batch) s.max_batch = t->max_batch;
+		s.sync_us += t->sync_us;
+		if (t->max_sync_us > s.max_sync_us) s.max_sync_us = t->max_sync_us;
+		s.hold_us += t->hold_us;
+		if (t->max_hold_us > s.max_hold_us) s.max_hold_us = t->max_hold_us;
+	}
+	if (!s.batches) {
+		printf("group commit: no batches\n");
+		return;
+	}
+	printf("group commit: %ld batches, %ld mutations, avg batch %.2f, max batch %ld\n",
+			s.batches, s.mutations, (double)s.mutations / s.batches, s.max_batch);
+	printf("group commit: sync avg %.1fus max %.1fus, hold avg %.1fus max %.1fus\n",
+			s.sync_us / s.batches, s.max_sync_us, s.hold_us / s.batches, s.max_hold_us);
+}
+
+void batch_hold(batch_t *b, struct sockaddr_in *addr, char *reply, int len, req_key_t *key) {
+	if (b->n == b->cap) {
+		b->cap = b->cap ? b->cap * 2 : GC_DEFAULT_BATCH;
+		b->held = realloc(b->held, b->cap * sizeof(held_reply_t));
+	}
+	b->held[b->n].addr = *addr;
+	b->held[b->n].reply = reply;
+	b->held[b->n].len = len;
+	b->held[b->n].key = *key;
+	b->n++;
+}
+
+// reply is about to go out, a retransmit of its request gets a copy from now on
+void reply_sent(batch_t *b, req_key_t *key, char *reply, int len) {
+	if (key->cached) drc_end(b->drc, key->client, key->xid, reply, len);
+}
+
+// one commit + fsync for the whole batch, then release the replies
+void batch_flush(batch_t *b, ufs *nfs, frag_ep_t *ep) {
+	double start = now_us();
+	if (ufs_sync(nfs) == -1) {
+		fprintf(stderr, "server group commit sync fail\n");
+		exit(1);
+	}
+	double end = now_us();
+
+	// frag owns the replies once they are posted
+	for (int i = 0; i < b->n; ++i) {
+		held_reply_t *h = &b->held[i];
+		reply_sent(b, &h->key, h->reply, h->len);
+		frag_post(ep, &h->addr, h->reply, h->len);
+	}
+	frag_flush(ep);
+	double sent = now_us();
+
+	gc_stats_t *s = &b->stats;
+	s->batches++;
+	s->mutations += b->mutations;
+	if (b->mutations > s->max_batch) s->max_batch = b->mutations;
+	s->sync_us += end - start;
+	if (end - start > s->max_sync_us) s->max_sync_us = end - start;
+	s->hold_us += sent - b->opened;
+	if (sent - b->opened > s->max_hold_us) s->max_hold_us = sent - b->opened;
+
+	b->n = 0;
+	b->mutations = 0;
+}
+
+void queue_init(work_queue_t *q) {
+	q->head = q->tail = NULL;
+	q->closed = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+void queue_push(work_queue_t *q, work_t *w) {
+	w->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail) q->tail->next = w;
+	else q->head = w;
+	q->tail = w;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// oldest work in q. NULL if there is none, with wait set only once q is
+// closed and empty
+work_t* queue_pop(work_queue_t *q, int wait) {
+	pthread_mutex_lock(&q->lock);
+	while (wait && !q->head && !q->closed) pthread_cond_wait(&q->cond, &q->lock);
+	work_t *w = q->head;
+	if (w) {
+		q->head = w->next;
+		if (q->head == NULL) q->tail = NULL;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return w;
+}
+
+void queue_close(work_queue_t *q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// posts w's reply (it goes out with the shard's next frag_flush), or holds
+// it for the batch's fsync. frees w
+void send_reply(batch_t *b, work_t *w, ufs *nfs, frag_ep_t *ep) {
+	// anything answered while mutations wait for their fsync may have
+	// seen their changes, so it waits for the same fsync. they can be
+	// another shard's, that is what ufs_sync_pending catches
+	if (!b->window || (!w->mutation && !b->n && !ufs_sync_pending(nfs))) {
+		reply_sent(b, &w->key, w->reply, w->reply_len);
+		frag_post(ep, &w->addr, w->reply, w->reply_len);
+		free(w);
+		return;
+	}
+
+	if (!b->n) {
+		b->opened = now_us();
+		b->deadline = b->opened + b->window;
+	}
+	if (w->mutation) b->mutations++;
+	batch_hold(b, &w->addr, w->reply, w->reply_len, &w->key);
+	free(w);
+	if (b->mutations >= b->max) batch_flush(b, nfs, ep);
+}
+
+int handle_request(ufs *nfs, char *msg, int len, char **reply, int *reply_len);
+
+void* worker(void *arg) {
+	server_t *srv = arg;
+	work_t *w;
+	while ((w = queue_pop(&srv->todo, 1))) {
+		w->mutation = handle_request(srv->nfs, w->msg, w->len, &w->reply, &w->reply_len);
+		free(w->msg);
+		shard_t *sh = w->shard;
+		queue_push(&sh->done, w);
+		// a full pipe already has a wakeup in it
+		if (write(sh->wake[1], "", 1) == -1 && errno != EAGAIN) perror("server wake");
+	}
+	return NULL;
+}
+
+// the name a request carries, NULL unless it is NUL terminated inside the payload
+char* req_name(char *payload, int len) {
+	if (len <= 0 || memchr(payload, '\0', len) == NULL) return NULL;
+	return payload;
+}
+
+/*
+ * looks up each component of path in turn, starting from pinum, and puts
+ * the inums they resolve to in inums. returns the last one, or the lookup
+ * error of the first that failed (-1 for an empty path). depth is how many
+ * resolved. path gets cut up
+ */
+int lookup_path(ufs *nfs, int pinum, char *path, int32_t *inums, int *depth) {
+	*depth = 0;
+	if (*path == '/') pinum = 0;
+	int inum = -1;
+	char *save;
+	for (char *name = strtok_r(path, "/", &save); name; name = strtok_r(NULL, "/", &save)) {
+		inum = ufs_lookup(nfs, pinum, name);
+		if (inum < 0) return inum;
+		inums[(*depth)++] = pinum = inum;
+	}
+	return inum;
+}
+
+/*
+ * runs one operation with its args and plen bytes of payload, returns its
+ * ret. what it answers with goes in *reply from off on (grown to fit), len
+ * bytes of it. mutation is set if it modified the file system
+ */
+int run_op(ufs *nfs, int op, int32_t *arg, char *payload, int plen, char **reply, int off, uint32_t *len, int *mutation) {
+	int ret = -1;
+	char *name;
+	*len = 0;
+	switch (op) {
+	case PROTO_LOOKUP: {
+		if ((name = req_name(payload, plen))) ret = ufs_lookup(nfs, arg[0], name);
+		// what it found comes with its attributes, for the client's cache
+		proto_attr_t a;
+		if (ret < 0 || ufs_stat(nfs, ret, &a.type, &a.size) == -1) break;
+		proto_swap_attr(&a);
+		*reply = realloc(*reply, off + sizeof(a));
+		memcpy(*reply + off, &a, sizeof(a));
+		*len = sizeof(a);
+		break;
+	}
+	case PROTO_STAT: {
+		proto_attr_t a;
+		if ((ret = ufs_stat(nfs, arg[0], &a.type, &a.size)) == -1) break;
+		proto_swap_attr(&a);
+		*reply = realloc(*reply, off + sizeof(a));
+		memcpy(*reply + off, &a, sizeof(a));
+		*len = sizeof(a);
+		break;
+	}
+	case PROTO_READDIRPLUS: {
+		int max = UFS_MAX_IO / sizeof(proto_dirent_t);
+		if (arg[2] > 0 && arg[2] < max) max = arg[2];
+		dir_ent_t *ents = malloc(sizeof(dir_ent_t) * max);
+		int next, n = ufs_readdir(nfs, arg[0], arg[1], ents, max, &next);
+		if (n == -1) {
+			free(ents);
+			break;
+		}
+		// each child's attributes are looked up once the directory is unlocked
+		*reply = realloc(*reply, off + n * sizeof(proto_dirent_t));
+		proto_dirent_t *d = (proto_dirent_t*)(*reply + off);
+		for (int i = 0; i < n; ++i) {
+			memcpy(d[i].name, ents[i].name, sizeof(d[i].name));
+			d[i].inum = ents[i].inum;
+			if (ufs_stat(nfs, ents[i].inum, &d[i].attr.type, &d[i].attr.size) == -1) {
+				d[i].attr.type = -1;
+				d[i].attr.size = 0;
+			}
+			proto_swap_dirent(&d[i]);
+		}
+		free(ents);
+		*len = n * sizeof(proto_dirent_t);
+		ret = next;
+		break;
+	}
+	case PROTO_SHUTDOWN:
+		// main does the clean shutdown, which still sends this reply
+		ret = 0;
+		kill(getpid(), SIGTERM);
+		break;
+	case PROTO_LOOKUP_PATH: {
+		if ((name = req_name(payload, plen)) == NULL) break;
+		// no more components than the path has bytes
+		*reply = realloc(*reply, off + sizeof(proto_path_t) + plen * sizeof(int32_t));
+		proto_path_t *p = (proto_path_t*)(*reply + off);
+		int32_t *inums = (int32_t*)(p + 1);
+		ret = lookup_path(nfs, arg[0], name, inums, &p->depth);
+		p->attr.type = -1;
+		p->attr.size = 0;
+		if (ret >= 0 && ufs_stat(nfs, ret, &p->attr.type, &p->attr.size) == -1) p->attr.type = -1;
+		*len = sizeof(proto_path_t) + p->depth * sizeof(int32_t);
+		proto_swap_inums(inums, p->depth);
+		proto_swap_path(p);
+		break;
+	}
+	case PROTO_WRITE:
 #ifdef DEBUG
-		printf("server::waiting...\n");
+		printf("inum buf offset nbytes %d %d %d\n", arg[0], arg[1], arg[2]);
 #endif
-		int rc = UDP_Read(sd, &addr, msg, BUFFER_SIZE); 
+		// the data has to all be there
+		if (arg[2] > 0 && arg[2] == plen) ret = ufs_write(nfs, arg[0], payload, arg[1], arg[2]);
+		*mutation = 1;
+		break;
+	case PROTO_READ: {
+		int nbytes = arg[2];
+		if (nbytes <= 0 || nbytes > UFS_MAX_IO) break;
 
+		// read straight into the reply, behind its header
+		*reply = realloc(*reply, off + nbytes);
+		ret = ufs_read(nfs, arg[0], *reply + off, arg[1], nbytes);
+		if (ret == 0) *len = nbytes;
+		break;
+	}
+	case PROTO_CREAT: {
+		if ((name = req_name(payload, plen))) ret = ufs_creat(nfs, arg[0], arg[1], name);
+		*mutation = 1;
+		// the client has to forget what it cached about the inum's last file
+		int32_t inum;
+		if (ret != 0 || (inum = ufs_lookup(nfs, arg[0], name)) < 0) break;
+		proto_swap_inums(&inum, 1);
+		*reply = realloc(*reply, off + sizeof(inum));
+		memcpy(*reply + off, &inum, sizeof(inum));
+		*len = sizeof(inum);
+		break;
+	}
+	case PROTO_UNLINK:
+		if ((name = req_name(payload, plen))) ret = ufs_unlink(nfs, arg[0], name);
+		*mutation = 1;
+		break;
+	case PROTO_INIT:
+		// settles the largest read/write a request may carry
+		ret = arg[0] < UFS_MAX_IO ? arg[0] : UFS_MAX_IO;
+		break;
+	}
+	return ret;
+}
+
+// the most op o can put in a reply after its proto_result_t
+int op_reply_max(proto_op_t *o) {
+	switch (o->op) {
+	case PROTO_READ:
+		return o->arg[2] > 0 ? o->arg[2] : 0;
+	case PROTO_LOOKUP:
+	case PROTO_STAT:
+		return sizeof(proto_attr_t);
+	case PROTO_CREAT:
+		return sizeof(int32_t);
+	case PROTO_READDIRPLUS:
+		return UFS_MAX_IO;
+	case PROTO_LOOKUP_PATH:
+		return sizeof(proto_path_t) + o->len * sizeof(int32_t);
+	}
+	return 0;
+}
+
+/*
+ * the nops operations packed in payload, in order until one fails. an arg
+ * flagged PROTO_ARG_RESULT takes what an earlier op returned, which for a
+ * creat is the inum it made. their commits are held until the end so the
+ * lot goes to disk at once. a proto_result_t and the op's answer go in
+ * *reply from off for each one run, an op whose answer might not fit in
+ * one message fails with the rest. 0 if they all succeeded
+ */
+int run_compound(ufs *nfs, int nops, char *payload, int plen, char **reply, int off, uint32_t *len, int *mutation) {
+	*len = 0;
+	if (nops <= 0 || nops > PROTO_COMPOUND_MAX) return -1;
+	int32_t results[PROTO_COMPOUND_MAX];
+	int pos = 0, at = off, ret = 0;
+
+	ufs_hold_commits(nfs);
+	for (int i = 0; i < nops && ret == 0; ++i) {
+		proto_op_t o;
+		if (plen - pos < (int)sizeof(o)) {
+			ret = -1;
+			break;
+		}
+		memcpy(&o, payload + pos, sizeof(o));
+		proto_swap_op(&o);
+		char *op_payload = payload + pos + sizeof(o);
+		pos += sizeof(o);
+		if (o.len > (unsigned int)(plen - pos)) {
+			ret = -1;
+			break;
+		}
+		pos += o.len;
+
+		int ok = o.op != PROTO_INIT && o.op != PROTO_SHUTDOWN && o.op != PROTO_COMPOUND;
+		for (int k = 0; k < 3; ++k) {
+			if (!(o.flags & PROTO_ARG_RESULT(k))) continue;
+			if (o.arg[k] < 0 || o.arg[k] >= i) ok = 0;
+			else o.arg[k] = results[o.arg[k]];
+		}
+		// no result for it either, the client takes missing ones as failed
+		if (at + sizeof(proto_result_t) + op_reply_max(&o) > FRAG_MAX_MSG) {
+			ret = -1;
+			break;
+		}
+		uint32_t rlen = 0;
+		int rc = -1;
+		if (ok) rc = run_op(nfs, o.op, o.arg, op_payload, o.len, reply, at + sizeof(proto_result_t), &rlen, mutation);
+		if (o.op == PROTO_CREAT && rc == 0) rc = ufs_lookup(nfs, o.arg[0], op_payload);
+		results[i] = rc;
+		if (rc < 0) ret = -1;
+
+		*reply = realloc(*reply, at + sizeof(proto_result_t) + rlen);
+		proto_result_t r = { o.op, { 0 }, rc, rlen };
+		proto_swap_result(&r);
+		memcpy(*reply + at, &r, sizeof(r));
+		at += sizeof(r) + rlen;
+	}
+	if (ufs_release_commits(nfs) == -1) {
+		fprintf(stderr, "server compound sync fail\n");
+		exit(1);
+	}
+	*len = at - off;
+	return ret;
+}
+
+// runs one request of len bytes, returns 1 if it modified the file system.
+// the reply is allocated here, reply_len is how much of it to send
+int handle_request(ufs *nfs, char *msg, int len, char **reply, int *reply_len) {
+	*reply = malloc(sizeof(proto_reply_t));
+	*reply_len = sizeof(proto_reply_t);
+	proto_reply_t *r = (proto_reply_t*)*reply;
+	r->version = PROTO_VERSION;
+	r->flags = 0;
+	r->ret = -1;
+	r->len = 0;
+
+	proto_req_t req;
+	if (len < (int)sizeof(proto_req_t)) {
+		r->op = 0;
+		r->xid = 0;
+		proto_swap_reply(r);
+		return 0;
+	}
+	memcpy(&req, msg, sizeof(req));
+	proto_swap_req(&req);
+	r->op = req.op;
+	r->xid = req.xid;
+	char *payload = msg + sizeof(proto_req_t);
+	int plen = len - sizeof(proto_req_t);
+	// a client that speaks another version just gets -1 (MFS_Init fails on it)
+	if (req.version != PROTO_VERSION || req.len != (unsigned int)plen) {
+		proto_swap_reply(r);
+		return 0;
+	}
+
+	int mutation = 0;
+	uint32_t rlen;
+	int ret;
+	if (req.op == PROTO_COMPOUND)
+		ret = run_compound(nfs, req.arg[0], payload, plen, reply, sizeof(proto_reply_t), &rlen, &mutation);
+	else
+		ret = run_op(nfs, req.op, req.arg, payload, plen, reply, sizeof(proto_reply_t), &rlen, &mutation);
+	r = (proto_reply_t*)*reply;
+	r->ret = ret;
+	r->len = rlen;
+
+	*reply_len = sizeof(proto_reply_t) + r->len;
 #ifdef DEBUG
-		printf("server:: read message [size:%d contents:(%s)]\n", rc, msg);
+	printf("server::replying op %d xid %u ret %d len %d\n", r->op, r->xid, r->ret, r->len);
 #endif
+	proto_swap_reply(r);
+	return mutation;
+}
 
-		if (rc <= 0) {
-			free(msg);
-			continue;
+/*
+ * a mutation is looked up in the reply cache as it arrives. 1 if it is a
+ * retransmit that has been dealt with: dropped while the first copy still
+ * runs, or answered on ep with the reply that copy got
+ */
+int is_retransmit(drc_t *drc, char *msg, int len, struct sockaddr_in *addr, frag_ep_t *ep, req_key_t *key) {
+	key->cached = 0;
+	if (drc == NULL || len < (int)sizeof(proto_req_t)) return 0;
+	proto_req_t req;
+	memcpy(&req, msg, sizeof(req));
+	proto_swap_req(&req);
+	if (req.version != PROTO_VERSION) return 0;
+	if (req.op != PROTO_WRITE && req.op != PROTO_CREAT && req.op != PROTO_UNLINK && req.op != PROTO_COMPOUND) return 0;
+
+	key->client = req.client;
+	key->xid = req.xid;
+	char *reply;
+	int reply_len;
+	int st = drc_begin(drc, key->client, key->xid, &reply, &reply_len);
+	if (st == DRC_NEW) {
+		key->cached = 1;
+		return 0;
+	}
+	if (st == DRC_DONE) frag_post(ep, addr, reply, reply_len);
+	return 1;
+}
+
+/*
+ * one shard's event loop, runs until the main thread sets stopping.
+ * messages are in the format of proto.h, frag.c takes care of the ones
+ * that don't fit in one datagram
+ */
+void* shard_loop(void *arg) {
+	shard_t *sh = arg;
+	server_t *srv = sh->srv;
+	ufs *nfs = srv->nfs;
+	batch_t *batch = &sh->batch;
+
+	while (!__atomic_load_n(&srv->stopping, __ATOMIC_RELAXED)) {
+		// what the workers have finished
+		work_t *w;
+		while ((w = queue_pop(&sh->done, 0))) {
+			__atomic_fetch_sub(&srv->inflight, 1, __ATOMIC_RELAXED);
+			send_reply(batch, w, nfs, sh->ep);
 		}
-		char *reply = malloc(sizeof(char) * BUFFER_SIZE);
-
-		int fnum; int cur = 0, cur2 = 0;
-		sscanf(msg, "%d%n", &fnum, &cur);
-
-		//sprintf adds a null character at the end be careful
-		if (fnum == 0) {
-			//MFS_Lookup
-			int pinum; char *name;
-			sscanf(msg + cur, "%d%n", &pinum, &cur2);
-			name = msg + cur + cur2 + 1;
-
-			int ret = ufs_lookup(nfs, pinum, name);
-
-			sprintf(reply, "%d", ret);
-		} else if (fnum == 2) {
-			//MFS_Write
-			int inum; int offset; int nbytes; char *buf;
-			sscanf(msg + cur, "%d%d%d%n", &inum, &offset, &nbytes, &cur2);
-			buf = msg + cur + cur2 + 1;
-
-			printf("inum buf offset nbytes %d %d %d\n", inum, offset, nbytes);
-			int ret = ufs_write(nfs, inum, buf, offset, nbytes);
-			sprintf(reply, "%d", ret);
-		} else if (fnum == 3) {
-			//MFS_Read
-			int inum, offset, nbytes;
-			sscanf(msg + cur, "%d%d%d", &inum, &offset, &nbytes); 
-			char *buf = malloc(nbytes);
-
-			int ret = ufs_read(nfs, inum, buf, offset, nbytes);
-
-			int cw = sprintf(reply, "%d", ret);
-			memcpy(reply + cw + 1, buf, nbytes);
-			free(buf);
-		} else if (fnum == 4) {
-			//MFS_Creat
-			int pinum, type; char *name;
-			sscanf(msg + cur, "%d%d%n", &pinum, &type, &cur2);
-			name = msg + cur + cur2 + 1;
-
-			int ret = ufs_creat(nfs, pinum, type, name); 
-			sprintf(reply, "%d", ret);
-		} else if (fnum == 5) {
-			//MFS_Unlink
-			int pinum; char *name;
-			sscanf(msg + cur, "%d%n", &pinum, &cur2);
-			name = msg + cur + cur2 + 1;
-
-			int ret = ufs_unlink(nfs, pinum, name);
-			sprintf(reply, "%d", ret);
+		// all of them in one sendmmsg
+		frag_flush(sh->ep);
+
+		// the replies are out, now read ahead for the streams they came from
+		ufs_readahead(nfs);
+
+		// a batch is open: only wait for more requests until its window closes
+		int rc;
+		if (batch->n) {
+			double left = batch->deadline - now_us();
+			if (left <= 0) {
+				batch_flush(batch, nfs, sh->ep);
+				continue;
+			}
+
+			rc = frag_wait(sh->ep, (long)left);
+			if (rc == 0) batch_flush(batch, nfs, sh->ep);
+		} else {
+			rc = frag_wait(sh->ep, IDLE_USEC);
+			if (rc == 0 && !__atomic_load_n(&srv->inflight, __ATOMIC_RELAXED)) ufs_idle(nfs);
 		}
+		if (rc != 1) continue;
 
+		struct sockaddr_in addr;
+		int len;
+		char *msg;
+		while ((msg = frag_recv(sh->ep, &addr, &len))) {
 #ifdef DEBUG
-		printf("server::replying %s\n", reply);
+			printf("server:: read message [size:%d]\n", len);
 #endif
-		rc = UDP_Write(sd, &addr, reply, BUFFER_SIZE);
+			req_key_t key;
+			if (is_retransmit(srv->drc, msg, len, &addr, sh->ep, &key)) {
+				free(msg);
+				continue;
+			}
+
+			w = malloc(sizeof(work_t));
+			w->key = key;
+			w->addr = addr;
+			w->msg = msg;
+			w->len = len;
+			w->shard = sh;
+			if (srv->nworkers) {
+				__atomic_fetch_add(&srv->inflight, 1, __ATOMIC_RELAXED);
+				queue_push(&srv->todo, w);
+				continue;
+			}
+
+			// -t 0, everything on this thread
+			w->mutation = handle_request(nfs, msg, len, &w->reply, &w->reply_len);
+			free(msg);
+			send_reply(batch, w, nfs, sh->ep);
+		}
 	}
-	return 0;
+	return NULL;
 }
 
+// keeps thread t on the i-th CPU this process may run on (wrapping around)
+void pin_thread(pthread_t t, int i) {
+	cpu_set_t allowed, one;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return;
+	int n = CPU_COUNT(&allowed);
+	if (n == 0) return;
+	i %= n;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed) || i--) continue;
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		pthread_setaffinity_np(t, sizeof(one), &one);
+		return;
+	}
+}
+
+int main(int argc, char **argv) {
+	ufs_opts_t opts;
+	opts.cache_blocks = UFS_DEFAULT_CACHE_BLOCKS;
+	opts.inode_blocks = UFS_DEFAULT_INODE_BLOCKS;
+	opts.group_commit = 0;
+	opts.use_mmap = 0;
+	opts.io_engine = "blocking";
+
+	int gc_window = 0, gc_batch = GC_DEFAULT_BATCH;
+	int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1) nworkers = 1;
+	int nshards = 1;
+	int drc_entries = DRC_DEFAULT_ENTRIES;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "c:i:me:g:b:t:s:r:")) != -1) {
+		switch (ch) {
+		case 'c':
+			opts.cache_blocks = atoi(optarg);
+			break;
+		case 'i':
+			opts.inode_blocks = atoi(optarg);
+			if (opts.inode_blocks < 1) usage();
+			break;
+		case 'm':
+			opts.use_mmap = 1;
+			break;
+		case 'e':
+			if (strcmp(optarg, "blocking") && strcmp(optarg, "uring")) usage();
+			opts.io_engine = optarg;
+			break;
+		case 'g':
+			gc_window = atoi(optarg);
+			break;
+		case 'b':
+			gc_batch = atoi(optarg);
+			break;
+		case 't':
+			nworkers = atoi(optarg);
+			if (nworkers < 0) usage();
+			break;
+		case 's':
+			nshards = atoi(optarg);
+			if (nshards < 1) usage();
+			break;
+		case 'r':
+			drc_entries = atoi(optarg);
+			if (drc_entries < 0) usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2 || gc_batch < 1) usage();
+	opts.group_commit = gc_window > 0;
+
+	int portnum = strtol(argv[0], NULL, 10);
+
+	server_t srv;
+	srv.nworkers = nworkers;
+	srv.drc = drc_entries ? drc_create(drc_entries) : NULL;
+	srv.inflight = 0;
+	srv.stopping = 0;
+	srv.nshards = nshards;
+	srv.shards = calloc(nshards, sizeof(shard_t));
+	queue_init(&srv.todo);
+
+	// a lone socket doesn't share the port, so a second server on it fails to bind
+	for (int i = 0; i < nshards; ++i) {
+		shard_t *sh = &srv.shards[i];
+		sh->id = i;
+		sh->srv = &srv;
+		sh->sd = nshards > 1 ? UDP_OpenShared(portnum) : UDP_Open(portnum);
+		assert(sh->sd > -1);
+		sh->ep = frag_open(sh->sd);
+		sh->batch.window = opts.group_commit ? gc_window : 0;
+		sh->batch.max = gc_batch;
+		sh->batch.drc = srv.drc;
+		queue_init(&sh->done);
+		if (pipe(sh->wake) == -1) {
+			perror("server pipe");
+			exit(1);
+		}
+		fcntl(sh->wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(sh->wake[1], F_SETFL, O_NONBLOCK);
+		frag_set_wake(sh->ep, sh->wake[0]);
+	}
+
+	ufs *nfs = ufs_init(argv[1], &opts); assert(nfs != NULL);
+	srv.nfs = nfs;
+
+	// signals are for the main thread, the rest never see them
+	sigset_t sigs, old;
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &old);
+	pthread_t *workers = malloc(sizeof(pthread_t) * (nworkers ? nworkers : 1));
+	for (int i = 0; i < nworkers; ++i) pthread_create(&workers[i], NULL, worker, &srv);
+	for (int i = 0; i < nshards; ++i) {
+		pthread_create(&srv.shards[i].thread, NULL, shard_loop, &srv.shards[i]);
+		pin_thread(srv.shards[i].thread, i);
+	}
+
+	// kill -USR1 dumps the stats
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	// SIGINT/SIGTERM shut down cleanly, so the next start skips recovery
+	sa.sa_handler = handle_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// the signals stay blocked outside sigsuspend, so none slips in between
+	// the check and the wait
+	while (!stop) {
+		sigsuspend(&old);
+		if (!dump_stats) continue;
+		dump_stats = 0;
+		ufs_print_stats(nfs);
+		for (int i = 0; i < nshards; ++i) {
+			if (nshards > 1) printf("shard %d: ", i);
+			frag_print_stats(srv.shards[i].ep);
+		}
+		if (opts.group_commit) print_gc_stats(&srv);
+		if (srv.drc) drc_print_stats(srv.drc);
+		fflush(stdout);
+	}
+
+	// the shards stop taking requests, the workers finish what they have,
+	// then held replies go out with their fsync and the image is marked clean
+	__atomic_store_n(&srv.stopping, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < nshards; ++i) {
+		if (write(srv.shards[i].wake[1], "", 1) == -1 && errno != EAGAIN) perror("server wake");
+		pthread_join(srv.shards[i].thread, NULL);
+	}
+	queue_close(&srv.todo);
+	for (int i = 0; i < nworkers; ++i) pthread_join(workers[i], NULL);
+	free(workers);
+	for (int i = 0; i < nshards; ++i) {
+		shard_t *sh = &srv.shards[i];
+		work_t *w;
+		while ((w = queue_pop(&sh->done, 0))) send_reply(&sh->batch, w, nfs, sh->ep);
+		if (sh->batch.n) batch_flush(&sh->batch, nfs, sh->ep);
+	}
+	ufs_clean(nfs);
+	for (int i = 0; i < nshards; ++i) {
+		shard_t *sh = &srv.shards[i];
+		close(sh->wake[0]);
+		close(sh->wake[1]);
+		frag_close(sh->ep);
+		UDP_Close(sh->sd);
+		free(sh->batch.held);
+	}
+	free(srv.shards);
+	if (srv.drc) drc_free(srv.drc);
+	return 0;
+}
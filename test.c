@@ -20,6 +20,14 @@ char *get_rand_str(int len) {
 	return ret;
 }
 
+// counts completions, and checks they came back as expected
+static int async_done = 0;
+
+void expect_zero(MFS_Completion_t *c) {
+	assert(c->ret == 0);
+	async_done++;
+}
+
 int main(void) {
 	puts("----------->WARNING: RUN ON EMPTY DISK<------------");
 	srand(time(NULL));
@@ -44,6 +52,29 @@ int main(void) {
 	assert(MFS_Lookup(1, "dir2") == 2);
 	assert(MFS_Lookup(2, "file") == 3);
 
+	/*
+	 * Lookups are cached, but never past this client's own creats and unlinks.
+	 */
+	assert(MFS_Lookup(1, "cached") == -1);
+	assert(MFS_Creat(1, MFS_REGULAR_FILE, "cached") == 0);
+	int cached = MFS_Lookup(1, "cached");
+	assert(cached > 0);
+	assert(MFS_Lookup(1, "cached") == cached);
+	assert(MFS_Unlink(1, "cached") == 0);
+	assert(MFS_Lookup(1, "cached") == -1);
+
+	/*
+	 * Whole paths in one request, and where they stop when they don't resolve.
+	 */
+	int failed;
+	assert(MFS_SetCacheTTL(MFS_DEFAULT_TTL_MS) == 0);
+	assert(MFS_LookupPath(0, "dir/dir2/file", &failed) == 3 && failed == -1);
+	assert(MFS_LookupPath(0, "dir/dir2/file", &failed) == 3 && failed == -1);
+	assert(MFS_LookupPath(2, "/dir//dir2/", &failed) == 2 && failed == -1);
+	assert(MFS_LookupPath(0, "dir/nope/file", &failed) == -1 && failed == 1);
+	assert(MFS_LookupPath(0, "dir/dir2/file/x", &failed) == -4 && failed == 3);
+	assert(MFS_LookupPath(0, "", &failed) == -1 && failed == 0);
+
 	char *str = get_rand_str(10000); 
 	for (int i = 0; i < 5; ++i) {
 		assert(MFS_Write(3, str + (2000 * i), 2000 * i, 2000) == 0); 
@@ -71,12 +102,189 @@ int main(void) {
 	free(str);
 	free(str2);
 
+	/*
+	 * One request well past a datagram: write 96KB in a single call,
+	 * read it back whole and across an unaligned middle.
+	 */
+	assert(MFS_Creat(1, MFS_REGULAR_FILE, "big") == 0);
+	int big = MFS_Lookup(1, "big");
+	assert(big > 0);
+	char *str3 = get_rand_str(96 * 1024);
+	assert(MFS_Write(big, str3, 0, 96 * 1024) == 0);
+	char *buf3 = malloc(96 * 1024);
+	assert(MFS_Read(big, buf3, 0, 96 * 1024) == 0);
+	assert(!memcmp(buf3, str3, 96 * 1024));
+	assert(MFS_Read(big, buf3, 5000, 70000) == 0);
+	assert(!memcmp(buf3, str3 + 5000, 70000));
+	assert(MFS_Read(big, buf3, 90 * 1024, 7 * 1024) == -1);
+	free(str3);
+	free(buf3);
+	assert(MFS_Unlink(1, "big") == 0);
+
+	/*
+	 * A small file (kept in its inode on images made with mkfs -I) that
+	 * then grows past what an inode holds.
+	 */
+	assert(MFS_Creat(1, MFS_REGULAR_FILE, "small") == 0);
+	int small = MFS_Lookup(1, "small");
+	assert(small > 0);
+	char *str4 = get_rand_str(6000);
+	char *buf4 = malloc(6000);
+	assert(MFS_Write(small, str4, 0, 200) == 0);
+	assert(MFS_Write(small, str4 + 200, 200, 100) == 0);
+	assert(MFS_Read(small, buf4, 0, 300) == 0);
+	assert(!memcmp(buf4, str4, 300));
+	assert(MFS_Read(small, buf4, 250, 100) == -1);
+	assert(MFS_Write(small, str4 + 250, 250, 5750) == 0);
+	assert(MFS_Read(small, buf4, 0, 6000) == 0);
+	assert(!memcmp(buf4, str4, 6000));
+	free(str4);
+	free(buf4);
+	assert(MFS_Unlink(1, "small") == 0);
+
+	/*
+	 * Small writes into one block wait in the page cache, merged, and are
+	 * read back from it. after MFS_Flush another read (past the cached
+	 * pages) has to see them on the server.
+	 */
+	assert(MFS_Creat(1, MFS_REGULAR_FILE, "paged") == 0);
+	int paged = MFS_Open(1, "paged");
+	assert(paged > 0);
+	char *str5 = get_rand_str(8192);
+	char *buf5 = malloc(8192);
+	for (int i = 0; i < 64; ++i) assert(MFS_Write(paged, str5 + 64 * i, 64 * i, 64) == 0);
+	assert(MFS_Read(paged, buf5, 100, 3000) == 0);
+	assert(!memcmp(buf5, str5 + 100, 3000));
+	assert(MFS_Write(paged, str5 + 4096, 4096, 4096) == 0);
+	assert(MFS_Flush(paged) == 0);
+	assert(MFS_SetCacheTTL(MFS_DEFAULT_TTL_MS) == 0);
+	assert(MFS_Open(1, "paged") == paged);
+	assert(MFS_Read(paged, buf5, 0, 8192) == 0);
+	assert(!memcmp(buf5, str5, 8192));
+	assert(MFS_Read(paged, buf5, 8000, 200) == -1);
+	free(str5);
+	free(buf5);
+	assert(MFS_Unlink(1, "paged") == 0);
+
+	/*
+	 * A compound: a directory, a file in it, written and read back, all in
+	 * one request. then one that stops at its failing op.
+	 */
+	MFS_Compound_t *comp = MFS_CompoundNew();
+	int rets[8];
+	char *str6 = get_rand_str(3000);
+	char buf6[3000];
+	assert(MFS_CompoundCreat(comp, 1, MFS_DIRECTORY, "cdir") == 0);
+	assert(MFS_CompoundCreat(comp, MFS_RESULT(0), MFS_REGULAR_FILE, "cfile") == 1);
+	assert(MFS_CompoundWrite(comp, MFS_RESULT(1), str6, 0, 3000) == 2);
+	assert(MFS_CompoundRead(comp, MFS_RESULT(1), buf6, 1000, 2000) == 3);
+	assert(MFS_CompoundLookup(comp, MFS_RESULT(0), "cfile") == 4);
+	assert(MFS_CompoundRun(comp, rets) == 5);
+	assert(rets[0] > 0 && rets[1] > 0 && rets[2] == 0 && rets[3] == 0 && rets[4] == rets[1]);
+	assert(!memcmp(buf6, str6 + 1000, 2000));
+	assert(MFS_Lookup(1, "cdir") == rets[0]);
+	int cdir = rets[0];
+	MFS_CompoundFree(comp);
+
+	comp = MFS_CompoundNew();
+	assert(MFS_CompoundUnlink(comp, cdir, "cfile") == 0);
+	assert(MFS_CompoundUnlink(comp, cdir, "cfile") == 1);
+	assert(MFS_CompoundUnlink(comp, 1, "cdir") == 2);
+	assert(MFS_CompoundRun(comp, rets) == 1);
+	assert(rets[0] == 0 && rets[1] == -1 && rets[2] == -1);
+	assert(MFS_Lookup(cdir, "cfile") == -1);
+	assert(MFS_Unlink(1, "cdir") == 0);
+	MFS_CompoundFree(comp);
+	free(str6);
+
+	// reads whose replies together would outgrow one message aren't taken
+	comp = MFS_CompoundNew();
+	for (int i = 0; i < 7; ++i) assert(MFS_CompoundRead(comp, 3, NULL, 0, MFS_MAX_IO / 2) == i);
+	assert(MFS_CompoundRead(comp, 3, NULL, 0, MFS_MAX_IO / 2) == -1);
+	MFS_CompoundFree(comp);
+
+	/*
+	 * Stat, and a directory listed with attributes a few entries per call.
+	 */
+	MFS_Stat_t st;
+	assert(MFS_Stat(3, &st) == 0 && st.type == MFS_REGULAR_FILE && st.size == 10000);
+	assert(MFS_Stat(1, &st) == 0 && st.type == MFS_DIRECTORY);
+	assert(MFS_Creat(1, MFS_REGULAR_FILE, "listed") == 0);
+	int listed = MFS_Lookup(1, "listed");
+	assert(MFS_Write(listed, "hello", 0, 5) == 0);
+	assert(MFS_Stat(listed, &st) == 0 && st.size == 5);
+	MFS_DirEntPlus_t ents[2];
+	int cookie = 0, seen = 0, found = 0;
+	do {
+		int n = MFS_ReadDirPlus(1, &cookie, ents, 2);
+		assert(n > 0 && n <= 2);
+		for (int i = 0; i < n; ++i, ++seen) {
+			if (strcmp(ents[i].name, "listed")) continue;
+			assert(ents[i].inum == listed && ents[i].type == MFS_REGULAR_FILE && ents[i].size == 5);
+			found = 1;
+		}
+	} while (cookie);
+	assert(found && seen == 4); // . .. dir2 listed
+	assert(MFS_Unlink(1, "listed") == 0);
+	cookie = 0;
+	assert(MFS_ReadDirPlus(3, &cookie, ents, 2) == -1);
+
+	/*
+	 * Pipelined: 20 creats and writes in flight with callbacks, lookups
+	 * and reads collected with MFS_Poll in whatever order they complete.
+	 * (an empty image only has 32 inodes)
+	 */
+	assert(MFS_SetWindow(16) == 0);
+	char names[20][16];
+	char data[20][100];
+	for (int i = 0; i < 20; ++i) {
+		sprintf(names[i], "async%d", i);
+		memset(data[i], 'a' + i % 26, sizeof(data[i]));
+		assert(MFS_CreatAsync(1, MFS_REGULAR_FILE, names[i], expect_zero, NULL) >= 0);
+	}
+	assert(MFS_Drain() == 0);
+	assert(async_done == 20);
+
+	int inums[20];
+	for (int i = 0; i < 20; ++i) assert(MFS_LookupAsync(1, names[i], NULL, &inums[i]) >= 0);
+	MFS_Completion_t c;
+	for (int i = 0; i < 20; ++i) {
+		assert(MFS_Poll(&c, -1) == 1);
+		assert(c.ret > 0);
+		*(int*)c.arg = c.ret;
+	}
+	assert(MFS_Poll(&c, 0) == -1);
+
+	async_done = 0;
+	for (int i = 0; i < 20; ++i) assert(MFS_WriteAsync(inums[i], data[i], 0, 100, expect_zero, NULL) >= 0);
+	assert(MFS_Drain() == 0);
+	assert(async_done == 20);
+
+	char back[20][100];
+	int xids[20];
+	for (int i = 0; i < 20; ++i) xids[i] = MFS_ReadAsync(inums[i], back[i], 0, 100, NULL, NULL);
+	for (int i = 0; i < 20; ++i) {
+		assert(MFS_Poll(&c, -1) == 1);
+		assert(c.ret == 0);
+		int j = 0;
+		while (xids[j] != c.xid) j++;
+		assert(!memcmp(back[j], data[j], 100));
+	}
+
+	async_done = 0;
+	for (int i = 0; i < 20; ++i) assert(MFS_UnlinkAsync(1, names[i], expect_zero, NULL) >= 0);
+	assert(MFS_Drain() == 0);
+	assert(async_done == 20);
+	assert(MFS_Lookup(1, "async0") == -1);
+
 	assert(MFS_Unlink(1, "dir2") == -1);
 	assert(MFS_Unlink(2, "file") == 0);
 	assert(MFS_Lookup(2, "file") == -1);
 	assert(MFS_Unlink(1, "dir2") == 0);
 	assert(MFS_Lookup(1, "dir2") == -1);
 
+	assert(MFS_Shutdown() == 0);
+
 	return 0;
 }
 
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "udp.h"
 
 // create a socket and bind it to a port on the current machine
@@ -26,6 +28,38 @@ int UDP_Open(int port) {
     return fd;
 }
 
+// like UDP_Open, but any number of sockets can be bound to the port this
+// way and the kernel spreads incoming packets over them by sender
+int UDP_OpenShared(int port) {
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+	perror("setsockopt");
+	close(fd);
+	return -1;
+    }
+
+    struct sockaddr_in my_addr;
+    bzero(&my_addr, sizeof(my_addr));
+
+    my_addr.sin_family      = AF_INET;
+    my_addr.sin_port        = htons(port);
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *) &my_addr, sizeof(my_addr)) == -1) {
+	perror("bind");
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
 // fill sockaddr_in struct with proper goodies
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
     bzero(addr, sizeof(struct sockaddr_in));
@@ -61,6 +95,56 @@ int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     return rc;
 }
 
+// receives whatever is already queued, up to n datagrams in one call:
+// the i-th goes in bufs[i] (size bytes), its length in lens[i] and its
+// sender in addrs[i]. returns how many, -1 if there were none
+int UDP_ReadMany(int fd, struct sockaddr_in *addrs, char **bufs, int *lens, int n, int size) {
+    struct mmsghdr msgs[n];
+    struct iovec iov[n];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < n; i++) {
+	iov[i].iov_base = bufs[i];
+	iov[i].iov_len = size;
+	msgs[i].msg_hdr.msg_name = &addrs[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int rc = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < rc; i++)
+	lens[i] = msgs[i].msg_len;
+    return rc;
+}
+
+// sends n datagrams with as few calls as the kernel allows, the i-th
+// gathered from iov[i * iovcnt] on. one that fails is dropped like any
+// lost datagram. returns how many went out
+int UDP_WriteMany(int fd, struct sockaddr_in *addrs, struct iovec *iov, int iovcnt, int n) {
+    struct mmsghdr msgs[n];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < n; i++) {
+	msgs[i].msg_hdr.msg_name = &addrs[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	msgs[i].msg_hdr.msg_iov = &iov[i * iovcnt];
+	msgs[i].msg_hdr.msg_iovlen = iovcnt;
+    }
+
+    int done = 0, sent = 0;
+    while (done < n) {
+	int rc = sendmmsg(fd, msgs + done, n - done, 0);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    done++; // skip the one it choked on
+	    continue;
+	}
+	done += rc;
+	sent += rc;
+    }
+    return sent;
+}
+
 int UDP_Close(int fd) {
     return close(fd);
 }
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -28,10 +29,13 @@
 // 
 
 int UDP_Open(int port);
+int UDP_OpenShared(int port);
 int UDP_Close(int fd);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
+int UDP_ReadMany(int fd, struct sockaddr_in *addrs, char **bufs, int *lens, int n, int size);
+int UDP_WriteMany(int fd, struct sockaddr_in *addrs, struct iovec *iov, int iovcnt, int n);
 
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
 
@@ -10,8 +10,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ufs.h"
+#include "alloc.h"
+#include "bcache.h"
+#include "dindex.h"
+#include "io.h"
+#include "itable.h"
+#include "journal.h"
 
 #define DEBUG 
 
@@ -19,41 +27,315 @@
 
 // in this bitmap 0 refers to MSB
 void set_bitmap(bitmap_t b, int i) {
-	b[i / 32] |= 1 << (31 - i);
+	b[i / 32] |= 1u << (31 - i % 32);
 }
 
 void reset_bitmap(bitmap_t b, int i) {
-	b[i / 32] &= ~(1 << (31 - i));
+	b[i / 32] &= ~(1u << (31 - i % 32));
 }
 
+// allocations change the word from other threads, see alloc.c
 int get_bitmap(bitmap_t b, int i) {
-	return b[i / 32] & (1 << (31 - i)) ? 1 : 0;
+	return __atomic_load_n(&b[i / 32], __ATOMIC_RELAXED) & (1u << (31 - i % 32)) ? 1 : 0;
 }
 
 int get_bitmap_sz(int n) {
 	return (n + 31) / 32;
 }
 
-int Read(int fd, int addr, void *buf, size_t count) {
-	int rc = lseek(fd, addr, SEEK_SET);
-	if (rc == -1) return -1;
+void mark_map_dirty(ufs *nfs, int blk) {
+	pthread_mutex_lock(&nfs->dirty_lock);
+	if (!nfs->map_dirty[blk]) {
+		nfs->map_dirty[blk] = 1;
+		nfs->map_dirty_list[nfs->map_ndirty++] = blk;
+	}
+	pthread_mutex_unlock(&nfs->dirty_lock);
+}
+
+int RawRead(ufs *nfs, off_t addr, void *buf, size_t count) {
+	if (nfs->map) {
+		if (addr < 0 || addr + count > nfs->map_size) return -1;
+		memcpy(buf, nfs->map + addr, count);
+		return 0;
+	}
+	if (nfs->cache) return bcache_read(nfs->cache, addr, buf, count);
+	return io_read(nfs->io, buf, count, addr);
+}
+
+int RawWrite(ufs *nfs, off_t addr, void *buf, size_t count) {
+	if (nfs->map) {
+		if (addr < 0 || addr + count > nfs->map_size) return -1;
+		memcpy(nfs->map + addr, buf, count);
+		for (off_t a = addr - addr % UFS_BLOCK_SIZE; a < addr + (off_t)count; a += UFS_BLOCK_SIZE)
+			mark_map_dirty(nfs, a / UFS_BLOCK_SIZE);
+		return 0;
+	}
+	if (nfs->cache) return bcache_write(nfs->cache, addr, buf, count);
+	return io_write(nfs->io, buf, count, addr);
+}
+
+// journaled metadata blocks that aren't checkpointed yet are newer than their home copy
+int Read(ufs *nfs, off_t addr, void *buf, size_t count) {
+	if (!nfs->journal) return RawRead(nfs, addr, buf, count);
+
+	char *p = buf;
+	while (count > 0) {
+		int off = addr % UFS_BLOCK_SIZE;
+		size_t sz = UFS_BLOCK_SIZE - off;
+		if (sz > count) sz = count;
+
+		if (!journal_get(nfs->journal, addr / UFS_BLOCK_SIZE, off, p, sz) && RawRead(nfs, addr, p, sz) == -1)
+			return -1;
 
-	rc = read(fd, buf, count);
-	if (rc != count) return -1;
+		p += sz; addr += sz; count -= sz;
+	}
 	return 0;
 }
 
-int Write(int fd, int addr, void *buf, size_t count) {
-	int rc = lseek(fd, addr, SEEK_SET);
-	if (rc == -1) return -1;
+// file data
+int Write(ufs *nfs, off_t addr, void *buf, size_t count) {
+	if (nfs->journal) {
+		__atomic_store_n(&nfs->data_pending, 1, __ATOMIC_RELAXED);
+		for (off_t a = addr - addr % UFS_BLOCK_SIZE; a < addr + (off_t)count; a += UFS_BLOCK_SIZE) {
+			if (journal_forget(nfs->journal, a / UFS_BLOCK_SIZE) == -1) return -1;
+		}
+	}
+	return RawWrite(nfs, addr, buf, count);
+}
 
-	rc = write(fd, buf, count);
-	if (rc != count) return -1;
+// directory blocks, these go through the journal when there is one
+int WriteMeta(ufs *nfs, off_t addr, void *buf, size_t count) {
+	if (!nfs->journal) return RawWrite(nfs, addr, buf, count);
+
+	char *p = buf;
+	while (count > 0) {
+		int blk = addr / UFS_BLOCK_SIZE;
+		int off = addr % UFS_BLOCK_SIZE;
+		size_t sz = UFS_BLOCK_SIZE - off;
+		if (sz > count) sz = count;
+
+		int fresh;
+		char *img = journal_tx_block(nfs->journal, blk, &fresh);
+		if (fresh && sz != UFS_BLOCK_SIZE && RawRead(nfs, (off_t)blk * UFS_BLOCK_SIZE, img, UFS_BLOCK_SIZE) == -1)
+			return -1;
+		// the home copy must not be written back over the journal's
+		if (nfs->cache) bcache_invalidate(nfs->cache, blk);
+		memcpy(img + off, p, sz);
+
+		p += sz; addr += sz; count -= sz;
+	}
 	return 0;
 }
 
+/*
+ * file data that may span many blocks. whole blocks skip the block cache
+ * (a big transfer would only flush it) and are queued on b, one request
+ * per stretch that is contiguous on disk, so the engine can do them as a
+ * few preadv/pwritevs. partial blocks at either end go through Read/Write
+ */
+int DataIO(ufs *nfs, io_batch_t *b, off_t addr, char *buf, size_t count, int write) {
+	off_t end = addr + count;
+	off_t first = (addr + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE * UFS_BLOCK_SIZE;
+	off_t last = end / UFS_BLOCK_SIZE * UFS_BLOCK_SIZE;
+	if (nfs->map || first >= last) return write ? Write(nfs, addr, buf, count) : Read(nfs, addr, buf, count);
+	if (write && nfs->journal) __atomic_store_n(&nfs->data_pending, 1, __ATOMIC_RELAXED);
+
+	if (addr < first) {
+		int rc = write ? Write(nfs, addr, buf, first - addr) : Read(nfs, addr, buf, first - addr);
+		if (rc == -1) return -1;
+	}
+
+	off_t run = -1; // start of the stretch being collected
+	for (off_t a = first; a <= last; a += UFS_BLOCK_SIZE) {
+		char *p = buf + (a - addr);
+		int blk = a / UFS_BLOCK_SIZE;
+		int cached = 0;
+		if (a < last) {
+			if (write) {
+				if (nfs->journal && journal_forget(nfs->journal, blk) == -1) return -1;
+				if (nfs->cache) bcache_invalidate(nfs->cache, blk);
+			} else {
+				// newer than the disk copy, copied straight into buf
+				if (nfs->journal) cached = journal_get(nfs->journal, blk, 0, p, UFS_BLOCK_SIZE);
+				if (!cached && nfs->cache) cached = bcache_peek(nfs->cache, blk, p);
+			}
+		}
+
+		if (run != -1 && (a == last || cached)) {
+			io_batch_add(b, write, buf + (run - addr), a - run, run, -1);
+			run = -1;
+		}
+		if (a == last) break;
+		if (!cached && run == -1) run = a;
+	}
+
+	if (last < end) {
+		int rc = write ? Write(nfs, last, buf + (last - addr), end - last) : Read(nfs, last, buf + (last - addr), end - last);
+		if (rc == -1) return -1;
+	}
+	return 0;
+}
+
+// fills buf with inode table block blk from wherever its latest copy is. not
+// through the block cache, commits write inode blocks around it
+int load_inode_block(void *arg, int blk, char *buf) {
+	ufs *nfs = arg;
+	int b = nfs->s.inode_region_addr + blk;
+	if (nfs->journal && journal_get(nfs->journal, b, 0, buf, UFS_BLOCK_SIZE)) return 0;
+	if (nfs->map) {
+		memcpy(buf, nfs->map + (off_t)b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+		return 0;
+	}
+	return io_read(nfs->io, buf, UFS_BLOCK_SIZE, (off_t)b * UFS_BLOCK_SIZE);
+}
+
+char* get_itable_block(ufs *nfs, int blk, int pin) {
+	char *data = itable_get(nfs->itable, blk, pin);
+	if (data == NULL) {
+		fprintf(stderr, "get_itable_block inode table read fail\n");
+		exit(1);
+	}
+	return data;
+}
+
+// inode inum, paged in if it isn't resident. the pointer is good while the
+// inode is locked (see lock_inode), or until the next get_inode when
+// nothing else runs, e.g. during ufs_init
+inode_t* get_inode(ufs *nfs, int inum) {
+	if (nfs->meta_in_map) return (inode_t*)((char*)nfs->inodes + (off_t)inum * nfs->inode_size);
+	char *blk = get_itable_block(nfs, inum / nfs->inodes_per_block, 0);
+	itable_put(nfs->itable, inum / nfs->inodes_per_block);
+	return (inode_t*)(blk + inum % nfs->inodes_per_block * nfs->inode_size);
+}
+
+// dirty tracking is per metadata block, the list keeps commits proportional to what changed
+void mark_meta_dirty(ufs *nfs, int blk) {
+	int i = blk - nfs->meta_addr;
+	pthread_mutex_lock(&nfs->dirty_lock);
+	if (!nfs->meta_dirty[i]) {
+		nfs->meta_dirty[i] = 1;
+		nfs->dirty_list[nfs->ndirty++] = blk;
+	}
+	pthread_mutex_unlock(&nfs->dirty_lock);
+}
+
+void mark_inode_dirty(ufs *nfs, int inum) {
+	mark_meta_dirty(nfs, nfs->s.inode_bitmap_addr + inum / (UFS_BLOCK_SIZE * 8));
+	mark_meta_dirty(nfs, nfs->s.inode_region_addr + inum / nfs->inodes_per_block);
+	// stays in memory until the commit has its image
+	if (nfs->itable) {
+		get_itable_block(nfs, inum / nfs->inodes_per_block, 1);
+		itable_put(nfs->itable, inum / nfs->inodes_per_block);
+	}
+}
+
+void mark_data_dirty(ufs *nfs, int dnum) {
+	mark_meta_dirty(nfs, nfs->s.data_bitmap_addr + dnum / (UFS_BLOCK_SIZE * 8));
+}
+
+void clear_dirty(ufs *nfs) {
+	for (int i = 0; i < nfs->ndirty; ++i) {
+		int blk = nfs->dirty_list[i];
+		nfs->meta_dirty[blk - nfs->meta_addr] = 0;
+		if (nfs->itable && blk >= nfs->s.inode_region_addr) itable_unpin(nfs->itable, blk - nfs->s.inode_region_addr);
+	}
+	nfs->ndirty = 0;
+}
+
+// regular files on extent images map their blocks with extents, directories
+// and everything on older images use the direct pointers
+int uses_extents(ufs *nfs, inode_t *inode) {
+	return nfs->s.version >= UFS_VERSION_EXTENT && inode->type == UFS_REGULAR_FILE;
+}
+
+// on inline images a regular file keeps its data in the inode, from the
+// block map on, until it outgrows it. files never shrink, so the size says which
+int is_inline(ufs *nfs, inode_t *inode) {
+	return nfs->inline_cap && inode->type == UFS_REGULAR_FILE && inode->size <= nfs->inline_cap;
+}
+
+char* inline_data(inode_t *inode) {
+	return (char*)inode->direct;
+}
+
 /* utilities end */
 
+/* locking start */
+
+pthread_rwlock_t* inode_lock(ufs *nfs, int inum) {
+	return &nfs->ilocks[inum % UFS_LOCK_STRIPES];
+}
+
+// inum's inode table block stays in memory while the lock is held, so
+// get_inode pointers stay good
+void lock_inode(ufs *nfs, int inum, int write) {
+	if (write) pthread_rwlock_wrlock(inode_lock(nfs, inum));
+	else pthread_rwlock_rdlock(inode_lock(nfs, inum));
+	if (nfs->itable) get_itable_block(nfs, inum / nfs->inodes_per_block, 0);
+}
+
+// lock_inode(nfs, inum, 0) for a reader that mustn't wait, -1 if the lock is taken
+int trylock_inode(ufs *nfs, int inum) {
+	if (pthread_rwlock_tryrdlock(inode_lock(nfs, inum))) return -1;
+	if (nfs->itable) get_itable_block(nfs, inum / nfs->inodes_per_block, 0);
+	return 0;
+}
+
+void unlock_inode(ufs *nfs, int inum) {
+	if (nfs->itable) itable_put(nfs->itable, inum / nfs->inodes_per_block);
+	pthread_rwlock_unlock(inode_lock(nfs, inum));
+}
+
+// the second inode of a creat or unlink (under ns_lock), first is already
+// write locked and may share inum's stripe
+void lock_inode2(ufs *nfs, int first, int inum) {
+	if (inode_lock(nfs, inum) != inode_lock(nfs, first)) pthread_rwlock_wrlock(inode_lock(nfs, inum));
+	if (nfs->itable) get_itable_block(nfs, inum / nfs->inodes_per_block, 0);
+}
+
+void unlock_inode2(ufs *nfs, int first, int inum) {
+	if (nfs->itable) itable_put(nfs->itable, inum / nfs->inodes_per_block);
+	if (inode_lock(nfs, inum) != inode_lock(nfs, first)) pthread_rwlock_unlock(inode_lock(nfs, inum));
+}
+
+void init_locks(ufs *nfs) {
+	nfs->ilocks = malloc(sizeof(pthread_rwlock_t) * UFS_LOCK_STRIPES);
+	for (int i = 0; i < UFS_LOCK_STRIPES; ++i) pthread_rwlock_init(&nfs->ilocks[i], NULL);
+
+	// a commit waiting for the lock holds off new mutations, or a steady
+	// stream of them would keep it out for good
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&nfs->commit_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	pthread_mutex_init(&nfs->ns_lock, NULL);
+	pthread_mutex_init(&nfs->ialloc_lock, NULL);
+	pthread_mutex_init(&nfs->dalloc_lock, NULL);
+	pthread_mutex_init(&nfs->dirty_lock, NULL);
+	pthread_mutex_init(&nfs->dindex_lock, NULL);
+	pthread_mutex_init(&nfs->ra_lock, NULL);
+	pthread_mutex_init(&nfs->ra_run_lock, NULL);
+}
+
+void free_locks(ufs *nfs) {
+	for (int i = 0; i < UFS_LOCK_STRIPES; ++i) pthread_rwlock_destroy(&nfs->ilocks[i]);
+	free(nfs->ilocks);
+	pthread_rwlock_destroy(&nfs->commit_lock);
+	pthread_mutex_destroy(&nfs->ns_lock);
+	pthread_mutex_destroy(&nfs->ialloc_lock);
+	pthread_mutex_destroy(&nfs->dalloc_lock);
+	pthread_mutex_destroy(&nfs->dirty_lock);
+	pthread_mutex_destroy(&nfs->dindex_lock);
+	pthread_mutex_destroy(&nfs->ra_lock);
+	pthread_mutex_destroy(&nfs->ra_run_lock);
+}
+
+/* locking end */
+
 /*
 typedef struct __ufs {
 	int fd;
@@ -75,12 +357,40 @@ typedef struct __dir_block_t {
 	dir_ent_t entries[128];
 } dir_block_t;*/
 
+int write_super(ufs *nfs) {
+	if (io_write(nfs->io, &nfs->s, sizeof(super_t), 0) == -1) return -1;
+	return io_fsync(nfs->io);
+}
+
 void ufs_clean(ufs *nfs) {
-	free(nfs->inode_bp);
-	free(nfs->data_bp);
-	free(nfs->inodes);
-	free(nfs->dirty_inode_bp);
-	free(nfs->dirty_data_bp);
+	if (nfs->sync_pending) ufs_sync(nfs);
+	if (nfs->journal) journal_close(nfs->journal);
+	if (nfs->cache) bcache_flush(nfs->cache, NULL);
+
+	// everything is on disk, the next ufs_init can take the bitmaps as they are
+	nfs->s.clean = 1;
+	if (write_super(nfs) == -1) fprintf(stderr, "ufs_clean superblock write fail\n");
+
+	if (!nfs->meta_in_map) {
+		free(nfs->inode_bp);
+		free(nfs->data_bp);
+		itable_free(nfs->itable);
+	}
+	if (nfs->map) {
+		munmap(nfs->map, nfs->map_size);
+		free(nfs->map_dirty);
+		free(nfs->map_dirty_list);
+	}
+	free(nfs->meta_dirty);
+	free(nfs->dirty_list);
+	free(nfs->ra);
+	alloc_free(nfs->ialloc);
+	alloc_free(nfs->dalloc);
+	for (int i = 0; i < nfs->s.num_inodes; ++i) dindex_free(nfs->dindex[i]);
+	free(nfs->dindex);
+	if (nfs->cache) bcache_free(nfs->cache);
+	free_locks(nfs);
+	io_close(nfs->io);
 	close(nfs->fd);
 	free(nfs);
 }
@@ -98,17 +408,22 @@ void print_superblock(super_t s) {
 	printf("data_region_len %d\n", s.data_region_len);
 	printf("num_inodes %d\n", s.num_inodes);
 	printf("num_data %d\n", s.num_data);
+	printf("journal_addr %d\n", s.journal_addr);
+	printf("journal_len %d\n", s.journal_len);
+	printf("version %d\n", s.version);
+	printf("clean %d\n", s.clean);
+	printf("inode_size %d\n", s.inode_size);
 	printf("=======================\n");
 }
 
 void print_bitmaps(ufs *nfs) {
 	printf("=======================\n");
 	printf("inode bitmap: ");
-	for (int i = 0; i < nfs->inode_bp_sz * sizeof(unsigned int) * 8; ++i) {
+	for (int i = 0; i < nfs->inode_bp_sz * (int)sizeof(unsigned int) * 8; ++i) {
 		printf("%d", get_bitmap(nfs->inode_bp, i));
 	}
 	printf("\ndata bitmap: ");
-	for (int i = 0; i < nfs->data_bp_sz * sizeof(unsigned int) * 8; ++i) {
+	for (int i = 0; i < nfs->data_bp_sz * (int)sizeof(unsigned int) * 8; ++i) {
 		printf("%d", get_bitmap(nfs->data_bp, i));
 	}
 	puts("");
@@ -118,20 +433,59 @@ void print_bitmaps(ufs *nfs) {
 void print_inodes(ufs *nfs) {
 	printf("=======================\n");
 	printf("Printing all inodes...\n");
-	for (int i =0; i < nfs->inode_bp_sz * sizeof(unsigned int) * 8; ++i) {
+	for (int i = 0; i < nfs->s.num_inodes; ++i) {
 		if (get_bitmap(nfs->inode_bp, i)) {
+			inode_t *inode = get_inode(nfs, i);
 			printf("-----Found inode %d-----\n", i);
-			printf("type %d\n", nfs->inodes[i].type);
-			printf("size %d\n", nfs->inodes[i].size);
+			printf("type %d\n", inode->type);
+			printf("size %d\n", inode->size);
+			if (is_inline(nfs, inode)) {
+				printf("inline data\n");
+				continue;
+			}
+			if (uses_extents(nfs, inode)) {
+				printf("extents %u, extent block %d\n", inode->nextents, (int)inode->ext_blk);
+				for (int j = 0; j < (int)inode->nextents && j < INODE_EXTENTS; ++j) {
+					printf("extent %d: %u+%u\n", j, inode->extents[j].start, inode->extents[j].len);
+				}
+				continue;
+			}
 			for (int j = 0; j < DIRECT_PTRS; ++j) {
-				printf("dptr %d: %u\n", j, nfs->inodes[i].direct[j]);
+				printf("dptr %d: %u\n", j, inode->direct[j]);
 			}
 		}
 	}
 	printf("=======================\n");
 }
 
-ufs* ufs_init(char *fname) {
+void ufs_print_stats(ufs *nfs) {
+	if (nfs->map) printf("backend: mmap, %zu bytes%s\n", nfs->map_size, nfs->meta_in_map ? ", metadata in place" : "");
+	if (nfs->cache) bcache_print_stats(nfs->cache);
+	else printf("bcache: disabled\n");
+	if (nfs->itable) itable_print_stats(nfs->itable);
+	if (nfs->journal) journal_print_stats(nfs->journal);
+	io_print_stats(nfs->io);
+}
+
+// lazy work for when the server has nothing else to do. the checkpoint
+// takes commit_lock like a commit does: one running on another thread
+// has its images in the journal before their record and data are on disk,
+// and those must not go home yet. if a commit or mutation has it, the
+// server wasn't idle after all
+void ufs_idle(ufs *nfs) {
+	if (!nfs->journal || pthread_rwlock_trywrlock(&nfs->commit_lock)) return;
+	int rc = 0;
+	if (!__atomic_load_n(&nfs->sync_pending, __ATOMIC_RELAXED)) rc = journal_checkpoint(nfs->journal);
+	pthread_rwlock_unlock(&nfs->commit_lock);
+	if (rc == -1) {
+		fprintf(stderr, "ufs_idle checkpoint fail\n");
+		exit(1);
+	}
+}
+
+void rebuild_data_bitmap(ufs *nfs); // needs the file block maps further down
+
+ufs* ufs_init(char *fname, ufs_opts_t *opts) {
 	assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
 
 	int fd = open(fname, O_RDWR); 
@@ -142,6 +496,8 @@ ufs* ufs_init(char *fname) {
 
 	ufs* nfs = malloc(sizeof(ufs));
 	nfs->fd = fd;
+	nfs->io = io_open(opts ? opts->io_engine : NULL, fd);
+	init_locks(nfs);
 
 	int rc = read(fd, &nfs->s, sizeof(super_t)); 
 	if (rc != sizeof(super_t)) {
@@ -153,436 +509,1059 @@ ufs* ufs_init(char *fname) {
 	print_superblock(nfs->s);
 #endif
 
-	nfs->inode_bp_sz = get_bitmap_sz(nfs->s.num_inodes);
-	nfs->data_bp_sz = get_bitmap_sz(nfs->s.num_data);
-	nfs->inode_bp = malloc(nfs->inode_bp_sz * sizeof(unsigned int));
-	nfs->data_bp = malloc(nfs->data_bp_sz * sizeof(unsigned int));
-	nfs->dirty_inode_bp = malloc(nfs->inode_bp_sz * sizeof(unsigned int));
-	nfs->dirty_data_bp = malloc(nfs->data_bp_sz * sizeof(unsigned int));
-
-	rc = lseek(nfs->fd, nfs->s.inode_bitmap_addr * UFS_BLOCK_SIZE, SEEK_SET);
-	if (rc == -1) {
-		perror("ufs_init inode bitmap lseek fail");
+	if (nfs->s.version > UFS_VERSION_INLINE) {
+		fprintf(stderr, "ufs_init unknown image version %d\n", nfs->s.version);
 		exit(1);
 	}
 
-	rc = read(nfs->fd, nfs->inode_bp, nfs->inode_bp_sz * sizeof(unsigned int));
-	if (rc != nfs->inode_bp_sz * sizeof(unsigned int)) {
-		fprintf(stderr, "ufs_init inode bitmap read fail\n");
-		exit(1);
+	nfs->inode_size = sizeof(inode_t);
+	nfs->inline_cap = 0;
+	if (nfs->s.version >= UFS_VERSION_INLINE) {
+		nfs->inode_size = nfs->s.inode_size;
+		if (nfs->inode_size < (int)sizeof(inode_t) || nfs->inode_size > UFS_BLOCK_SIZE || UFS_BLOCK_SIZE % nfs->inode_size) {
+			fprintf(stderr, "ufs_init bad inode size %d, probably corrupted\n", nfs->inode_size);
+			exit(1);
+		}
+		nfs->inline_cap = nfs->inode_size - offsetof(inode_t, direct);
 	}
+	nfs->inodes_per_block = UFS_BLOCK_SIZE / nfs->inode_size;
 
-	rc = lseek(nfs->fd, nfs->s.data_bitmap_addr * UFS_BLOCK_SIZE, SEEK_SET);
-	if (rc == -1) {
-		perror("ufs_init data bitmap lseek fail");
-		exit(1);
+	// replay has to happen before anything below reads the metadata
+	nfs->journal = NULL;
+	if (nfs->s.journal_len > 0) nfs->journal = journal_open(nfs->io, nfs->s.journal_addr, nfs->s.journal_len);
+
+	nfs->inode_bp_sz = get_bitmap_sz(nfs->s.num_inodes);
+	nfs->data_bp_sz = get_bitmap_sz(nfs->s.num_data);
+
+	// mkfs lays the bitmaps and the inode table out back to back
+	nfs->meta_addr = nfs->s.inode_bitmap_addr;
+	nfs->meta_len = nfs->s.inode_region_addr + nfs->s.inode_region_len - nfs->meta_addr;
+	nfs->meta_dirty = calloc(nfs->meta_len, sizeof(char));
+	nfs->dirty_list = malloc(sizeof(int) * nfs->meta_len);
+	nfs->ndirty = 0;
+
+	nfs->map = NULL;
+	nfs->meta_in_map = 0;
+	if (opts && opts->use_mmap) {
+		struct stat st;
+		if (fstat(nfs->fd, &st) == -1) {
+			perror("ufs_init disk stat fail");
+			exit(1);
+		}
+		nfs->map_size = st.st_size;
+		nfs->map = mmap(NULL, nfs->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, nfs->fd, 0);
+		if (nfs->map == MAP_FAILED) {
+			perror("ufs_init mmap fail");
+			exit(1);
+		}
+		nfs->map_dirty = calloc(nfs->map_size / UFS_BLOCK_SIZE, sizeof(char));
+		nfs->map_dirty_list = malloc(sizeof(int) * (nfs->map_size / UFS_BLOCK_SIZE));
+		nfs->map_ndirty = 0;
+
+		// with a journal the home copies may only change at checkpoint time, so keep private copies then
+		nfs->meta_in_map = nfs->journal == NULL;
 	}
 
-	rc = read(nfs->fd, nfs->data_bp, nfs->data_bp_sz * sizeof(unsigned int));
-	if (rc != nfs->data_bp_sz * sizeof(unsigned int)) {
-		fprintf(stderr, "ufs_init data bitmap read fail\n");
-		exit(1);
+	if (nfs->meta_in_map) {
+		nfs->inode_bp = (bitmap_t)(nfs->map + (off_t)nfs->s.inode_bitmap_addr * UFS_BLOCK_SIZE);
+		nfs->data_bp = (bitmap_t)(nfs->map + (off_t)nfs->s.data_bitmap_addr * UFS_BLOCK_SIZE);
+		nfs->inodes = (inode_t*)(nfs->map + (off_t)nfs->s.inode_region_addr * UFS_BLOCK_SIZE);
+		nfs->itable = NULL;
+	} else {
+		nfs->inode_bp = malloc(nfs->inode_bp_sz * sizeof(unsigned int));
+		nfs->data_bp = malloc(nfs->data_bp_sz * sizeof(unsigned int));
+
+		rc = lseek(nfs->fd, nfs->s.inode_bitmap_addr * UFS_BLOCK_SIZE, SEEK_SET);
+		if (rc == -1) {
+			perror("ufs_init inode bitmap lseek fail");
+			exit(1);
+		}
+
+		rc = read(nfs->fd, nfs->inode_bp, nfs->inode_bp_sz * sizeof(unsigned int));
+		if (rc != nfs->inode_bp_sz * (int)sizeof(unsigned int)) {
+			fprintf(stderr, "ufs_init inode bitmap read fail\n");
+			exit(1);
+		}
+
+		rc = lseek(nfs->fd, nfs->s.data_bitmap_addr * UFS_BLOCK_SIZE, SEEK_SET);
+		if (rc == -1) {
+			perror("ufs_init data bitmap lseek fail");
+			exit(1);
+		}
+
+		rc = read(nfs->fd, nfs->data_bp, nfs->data_bp_sz * sizeof(unsigned int));
+		if (rc != nfs->data_bp_sz * (int)sizeof(unsigned int)) {
+			fprintf(stderr, "ufs_init data bitmap read fail\n");
+			exit(1);
+		}
+
+		// the inode table is paged in as it gets used
+		nfs->inodes = NULL;
+		nfs->itable = itable_init(opts ? opts->inode_blocks : UFS_DEFAULT_INODE_BLOCKS, load_inode_block, nfs);
 	}
 
-#ifdef DEBUG
+	// these walk the whole image, startup stays independent of its size without them
+#ifdef DEBUG_IMAGE
 	print_bitmaps(nfs);
+	print_inodes(nfs);
 #endif
-	
-	rc = lseek(nfs->fd, nfs->s.inode_region_addr * UFS_BLOCK_SIZE, SEEK_SET);
-	if (rc == -1) {
-		perror("ufs_init itable lseek fail");
-		exit(1);
-	}
 
-	nfs->inodes = (inode_t*)malloc(sizeof(inode_t) * nfs->s.num_inodes);
-	rc = read(nfs->fd, nfs->inodes, sizeof(inode_t) * nfs->s.num_inodes); 
-	if (rc != sizeof(inode_t) * nfs->s.num_inodes) {
-		fprintf(stderr, "ufs_init inode table read fail\n");
+	nfs->ialloc = alloc_init(nfs->inode_bp, nfs->s.num_inodes);
+	nfs->dalloc = alloc_init(nfs->data_bp, nfs->s.num_data);
+	nfs->dindex = calloc(nfs->s.num_inodes, sizeof(dindex_t*));
+	nfs->group_commit = opts ? opts->group_commit : 0;
+	nfs->sync_pending = 0;
+	nfs->data_pending = 0;
+
+	nfs->cache = NULL;
+	int cache_blocks = opts ? opts->cache_blocks : UFS_DEFAULT_CACHE_BLOCKS;
+	// the page cache behind the mapping already is the block cache
+	if (cache_blocks > 0 && !nfs->map) nfs->cache = bcache_init(nfs->io, cache_blocks);
+
+	nfs->ra = calloc(nfs->s.num_inodes, sizeof(ra_state_t));
+	nfs->nra = 0;
+	nfs->ra_max = 0;
+	if (nfs->map) nfs->ra_max = UFS_RA_MAX;
+	else if (nfs->cache) nfs->ra_max = cache_blocks / 4 < UFS_RA_MAX ? cache_blocks / 4 : UFS_RA_MAX;
+
+	// a crash may have left the data bitmap out of step with the inodes.
+	// journal replay already took care of that, and a clean image is fine
+	if (!nfs->s.clean && !nfs->journal) rebuild_data_bitmap(nfs);
+
+	// until ufs_clean says otherwise, a crash leaves the image unclean
+	nfs->s.clean = 0;
+	if (write_super(nfs) == -1) {
+		fprintf(stderr, "ufs_init superblock write fail\n");
 		exit(1);
 	}
-
-#ifdef DEBUG
-	print_inodes(nfs);
-#endif
 	return nfs;
 }
 
-// I just realized this is inefficient af, can do better by reading in whole dir_block at once...
-int ufs_lookup(ufs *nfs, int pinum, char *name) {
-	if (pinum < 0 || pinum >= nfs->s.num_inodes) return -2;
-	if (!get_bitmap(nfs->inode_bp, pinum)) return -3;
-	if (nfs->inodes[pinum].type != UFS_DIRECTORY) return -4;
+// builds the name index of directory pinum the first time it is touched,
+// after that lookups, creats and unlinks just keep it up to date
+dindex_t* get_dindex(ufs *nfs, int pinum) {
+	pthread_mutex_lock(&nfs->dindex_lock);
+	dindex_t *built = nfs->dindex[pinum];
+	pthread_mutex_unlock(&nfs->dindex_lock);
+	if (built) return built;
 
-	inode_t inode = nfs->inodes[pinum];
+	inode_t inode = *get_inode(nfs, pinum);
 	
 	int dir_ent_cnt = inode.size / sizeof(dir_ent_t);
 
 	if (inode.size % sizeof(dir_ent_t)) {
-		fprintf(stderr, "ufs_lookup inode size not divisible by dir_ent_t size, probably corrupted\n");
+		fprintf(stderr, "get_dindex inode size not divisible by dir_ent_t size, probably corrupted\n");
 		exit(1);
 	}
 
-        for (int i = 0; i < DIRECT_PTRS && dir_ent_cnt; ++i) {
- 		int rc = lseek(nfs->fd, inode.direct[i] * UFS_BLOCK_SIZE, SEEK_SET);
- 		if (rc == -1) {
- 			perror("ufs_lookup lseek fail, probably corrupted inode table");
- 			exit(1);
- 		}
-
-		int dcnt_in_block = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
-		for (int j = 0; j < dcnt_in_block; ++j) {
- 			dir_ent_t dir_ent;
- 			rc = read(nfs->fd, &dir_ent, sizeof(dir_ent_t));
-			if (rc != sizeof(dir_ent_t)) {
-				perror("ufs_lookup dir_ent read fail");
-				exit(1);
-			}
+	dindex_t *d = dindex_create();
+	dir_block_t dir_block;
+	for (int i = 0; i < DIRECT_PTRS && dir_ent_cnt; ++i) {
+		if (inode.direct[i] == (unsigned int)(-1)) continue;
 
-			assert(dir_ent.inum != -1);
-			if (!strcmp(name, dir_ent.name)) return dir_ent.inum;
+		if (Read(nfs, (off_t)inode.direct[i] * UFS_BLOCK_SIZE, &dir_block, UFS_BLOCK_SIZE) == -1) {
+			perror("get_dindex dir block read fail, probably corrupted inode table");
+			exit(1);
+		}
 
+		for (int j = 0; j < 128 && dir_ent_cnt; ++j) {
+			if (dir_block.entries[j].inum == -1) continue;
+			dindex_insert(d, dir_block.entries[j].name, dir_block.entries[j].inum, i, j);
 			dir_ent_cnt--;
-			if (!dir_ent_cnt) break;
 		}
 	}
-	return -1;
+
+	// lookups share the directory's lock, two of them may have built it at once
+	pthread_mutex_lock(&nfs->dindex_lock);
+	if (nfs->dindex[pinum]) {
+		dindex_free(d);
+		d = nfs->dindex[pinum];
+	} else {
+		nfs->dindex[pinum] = d;
+	}
+	pthread_mutex_unlock(&nfs->dindex_lock);
+	return d;
 }
 
-// Don't forget to fsync afterwards!!
-int commit_dirty_to_disk(ufs *nfs) {
-	for (int i = 0; i < nfs->s.num_inodes; ++i) {
-		if (!get_bitmap(nfs->dirty_inode_bp, i)) continue;
-		reset_bitmap(nfs->dirty_inode_bp, i);
+// pinum is locked
+int lookup_locked(ufs *nfs, int pinum, char *name) {
+	if (!get_bitmap(nfs->inode_bp, pinum)) return -3;
+	if (get_inode(nfs, pinum)->type != UFS_DIRECTORY) return -4;
+
+	dindex_ent_t *e = dindex_find(get_dindex(nfs, pinum), name);
+	return e ? e->inum : -1;
+}
+
+int ufs_lookup(ufs *nfs, int pinum, char *name) {
+	if (pinum < 0 || pinum >= nfs->s.num_inodes) return -2;
+	lock_inode(nfs, pinum, 0);
+	int rc = lookup_locked(nfs, pinum, name);
+	unlock_inode(nfs, pinum);
+	return rc;
+}
+
+// type and size of inum, -1 if it isn't in use
+int ufs_stat(ufs *nfs, int inum, int *type, int *size) {
+	if (inum < 0 || inum >= nfs->s.num_inodes) return -1;
+	lock_inode(nfs, inum, 0);
+	int rc = -1;
+	if (get_bitmap(nfs->inode_bp, inum)) {
+		inode_t *inode = get_inode(nfs, inum);
+		*type = inode->type;
+		*size = inode->size;
+		rc = 0;
+	}
+	unlock_inode(nfs, inum);
+	return rc;
+}
+
+/*
+ * up to max entries of directory inum into ents, starting at cookie (0 is
+ * the first entry). next is the cookie to go on from, 0 when there are no
+ * more. returns how many, -1 if inum isn't a directory. the entries come
+ * from the dir index, so no dir block is read
+ */
+int ufs_readdir(ufs *nfs, int inum, int cookie, dir_ent_t *ents, int max, int *next) {
+	*next = 0;
+	if (inum < 0 || inum >= nfs->s.num_inodes || cookie < 0 || max <= 0) return -1;
+	lock_inode(nfs, inum, 0);
+	if (!get_bitmap(nfs->inode_bp, inum) || get_inode(nfs, inum)->type != UFS_DIRECTORY) {
+		unlock_inode(nfs, inum);
+		return -1;
+	}
+	dindex_t *d = get_dindex(nfs, inum);
+	int n = 0;
+	for (int pos = cookie; pos < DIRECT_PTRS * (int)DINDEX_SLOTS; ++pos) {
+		dindex_ent_t **slots = d->slots[pos / DINDEX_SLOTS];
+		if (slots == NULL) {
+			pos += DINDEX_SLOTS - 1 - pos % DINDEX_SLOTS; // nothing in this block
+			continue;
+		}
+		dindex_ent_t *e = slots[pos % DINDEX_SLOTS];
+		if (e == NULL) continue;
+		if (n == max) {
+			*next = pos;
+			break;
+		}
+		strcpy(ents[n].name, e->name);
+		ents[n].inum = e->inum;
+		n++;
+	}
+	unlock_inode(nfs, inum);
+	return n;
+}
 
-		// there can be a few repeated writes here which can be avoided..
-		int idx = i / 32;
-		int addr = nfs->s.inode_bitmap_addr * UFS_BLOCK_SIZE + idx * sizeof(unsigned int);
-		if (Write(nfs->fd, addr, &nfs->inode_bp[idx], sizeof(unsigned int)) == -1) return -1;   
+// current contents of a bitmap or inode table block, built from the in-memory copies
+void meta_block_image(ufs *nfs, int blk, char *img) {
+	if (blk >= nfs->s.inode_region_addr && blk < nfs->s.inode_region_addr + nfs->s.inode_region_len) {
+		// dirty, so it is pinned in the itable
+		memcpy(img, get_itable_block(nfs, blk - nfs->s.inode_region_addr, 0), UFS_BLOCK_SIZE);
+		itable_put(nfs->itable, blk - nfs->s.inode_region_addr);
+		return;
+	}
 
-		addr = nfs->s.inode_region_addr * UFS_BLOCK_SIZE + i * sizeof(inode_t);
-		if (Write(nfs->fd, addr, &nfs->inodes[i], sizeof(inode_t)) == -1) return -1;
+	memset(img, 0, UFS_BLOCK_SIZE);
+	char *src; size_t len; int first;
+	if (blk >= nfs->s.data_bitmap_addr && blk < nfs->s.data_bitmap_addr + nfs->s.data_bitmap_len) {
+		src = (char*)nfs->data_bp; len = nfs->data_bp_sz * sizeof(unsigned int); first = nfs->s.data_bitmap_addr;
+	} else {
+		src = (char*)nfs->inode_bp; len = nfs->inode_bp_sz * sizeof(unsigned int); first = nfs->s.inode_bitmap_addr;
 	}
 
-	for (int i = 0; i < nfs->s.num_data; ++i) {
-		if (!get_bitmap(nfs->dirty_data_bp, i)) continue;
-		reset_bitmap(nfs->dirty_data_bp, i);
+	size_t off = (size_t)(blk - first) * UFS_BLOCK_SIZE;
+	if (off >= len) return;
+	memcpy(img, src + off, len - off < UFS_BLOCK_SIZE ? len - off : UFS_BLOCK_SIZE);
+}
+
+int cmp_int(const void *a, const void *b) {
+	return *(const int*)a - *(const int*)b;
+}
 
-		int idx = i / 32;
-		int addr = nfs->s.data_bitmap_addr * UFS_BLOCK_SIZE + idx * sizeof(unsigned int);
-		if (Write(nfs->fd, addr, &nfs->data_bp[idx], sizeof(unsigned int)) == -1) return -1;
+// msyncs the dirty parts of the mapping, adjacent blocks as one range
+int map_sync(ufs *nfs) {
+	qsort(nfs->map_dirty_list, nfs->map_ndirty, sizeof(int), cmp_int);
+	for (int i = 0; i < nfs->map_ndirty; ) {
+		int first = nfs->map_dirty_list[i], n = 0;
+		while (i < nfs->map_ndirty && nfs->map_dirty_list[i] == first + n) {
+			nfs->map_dirty[first + n] = 0;
+			n++; i++;
+		}
+		if (msync(nfs->map + (off_t)first * UFS_BLOCK_SIZE, (size_t)n * UFS_BLOCK_SIZE, MS_SYNC) == -1) return -1;
 	}
+	nfs->map_ndirty = 0;
 	return 0;
 }
 
-//assumes that name is null-terminated, not sure how to verify it properly lmao...
-int ufs_creat(ufs *nfs, int pinum, int type, char *name) {
-	if (pinum < 0 || pinum >= nfs->s.num_inodes) return -1;
-	if (!get_bitmap(nfs->inode_bp, pinum)) return -1;
-	inode_t dir_inode = nfs->inodes[pinum];
-	if (dir_inode.type != UFS_DIRECTORY) return -1;
+/*
+ * one journal record for every bitmap, inode and directory block touched
+ * since the last commit. ordered mode: the file data the record points at
+ * (written back from the cache here, or written earlier) is made durable
+ * first, in a submission and fsync of its own, so a record that survives a
+ * crash never points at blocks that didn't
+ */
+int commit_to_journal(ufs *nfs, io_batch_t *b) {
+	int n = nfs->ndirty;
+	int *blks = nfs->dirty_list;
+
+	int rc = 0;
+	if (nfs->cache && bcache_flush(nfs->cache, b) == -1) rc = -1;
+	if (rc == 0 && (b->n || __atomic_load_n(&nfs->data_pending, __ATOMIC_RELAXED))) {
+		__atomic_store_n(&nfs->data_pending, 0, __ATOMIC_RELAXED);
+		rc = io_batch_submit(nfs->io, b, !nfs->map);
+		if (rc == 0 && nfs->map) rc = map_sync(nfs);
+	}
+	if (rc == -1) return -1;
 
-	int len = strlen(name);
-	if (len > 27) return -1;
+	char *buf = io_batch_scratch(b, (size_t)(n + 1) * UFS_BLOCK_SIZE);
+	char **images = malloc(sizeof(char*) * (n + 1));
+	for (int i = 0; i < n; ++i) {
+		images[i] = buf + (size_t)i * UFS_BLOCK_SIZE;
+		meta_block_image(nfs, blks[i], images[i]);
+	}
 
-	// already exists
-	if (ufs_lookup(nfs, pinum, name) != -1) return -1; 
+	rc = journal_commit(nfs->journal, blks, images, n, b);
+	if (rc == 0) clear_dirty(nfs);
 
-	// First find an empty inode and empty data block
-	int empty_pos_inode = -1;
-	for (int i = 0; i < nfs->s.num_inodes; ++i) {
-		if (!get_bitmap(nfs->inode_bp, i)) {
-			empty_pos_inode = i;
-			break;
-		}
+	free(images);
+	return rc;
+}
+
+// the block of the in-memory bitmap copy that backs blk, NULL if it only
+// partly covers it (the last block of each bitmap) or is an inode table
+// block, the itable may drop those as soon as the commit unpins them
+char* meta_block_src(ufs *nfs, int blk) {
+	char *src; size_t len; int first;
+	if (blk >= nfs->s.inode_region_addr) {
+		return NULL;
+	} else if (blk >= nfs->s.data_bitmap_addr) {
+		src = (char*)nfs->data_bp; len = nfs->data_bp_sz * sizeof(unsigned int); first = nfs->s.data_bitmap_addr;
+	} else {
+		src = (char*)nfs->inode_bp; len = nfs->inode_bp_sz * sizeof(unsigned int); first = nfs->s.inode_bitmap_addr;
+	}
+	size_t off = (size_t)(blk - first) * UFS_BLOCK_SIZE;
+	return off + UFS_BLOCK_SIZE <= len ? src + off : NULL;
+}
+
+// Don't forget to fsync afterwards!!
+// queues the dirty metadata blocks on b in disk order, the engine merges
+// adjacent ones into one request
+int commit_dirty_to_disk(ufs *nfs, io_batch_t *b) {
+	if (nfs->journal) return commit_to_journal(nfs, b);
+
+	// the mapping already holds the new metadata, it just has to be msynced with the rest
+	if (nfs->meta_in_map) {
+		for (int i = 0; i < nfs->ndirty; ++i) mark_map_dirty(nfs, nfs->dirty_list[i]);
+		clear_dirty(nfs);
+		return 0;
 	}
 
-	int empty_pos_data = -1, empty_pos_data2 = -1;
-	for (int i = 0; i < nfs->s.num_data; ++i) {
-		if (!get_bitmap(nfs->data_bp, i)) {
-			if(empty_pos_data == -1) empty_pos_data = i;
-			else if (empty_pos_data2 == -1) empty_pos_data2 = i;
+	qsort(nfs->dirty_list, nfs->ndirty, sizeof(int), cmp_int);
+	for (int i = 0; i < nfs->ndirty; ++i) {
+		int blk = nfs->dirty_list[i];
+		char *src = meta_block_src(nfs, blk);
+		if (src == NULL) { // partial tail block or inode block
+			src = io_batch_scratch(b, UFS_BLOCK_SIZE);
+			meta_block_image(nfs, blk, src);
 		}
+		io_batch_add(b, 1, src, UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE, -1);
 	}
+	clear_dirty(nfs);
 
-	if (empty_pos_inode == -1) return -1;
+	// write-back cache: nothing has hit the disk yet
+	if (nfs->cache && bcache_flush(nfs->cache, b) == -1) return -1;
+	return 0;
+}
 
-	/*
-	 * there are some bugs with error handling - for eg, 
-	 * Im setting the bitmap here, but there might be an error later on
-	 * and the function might return the code for failure.. but everything should work alright
-	 * provided there are no errors which should be the case provided we don't hit the max
-	 * filesystem capacity.
-	 */
-	set_bitmap(nfs->inode_bp, empty_pos_inode); 
-	set_bitmap(nfs->dirty_inode_bp, empty_pos_inode);
-	inode_t* inode = &nfs->inodes[empty_pos_inode]; 
-	inode->type = type;
-	for (int i = 0; i < DIRECT_PTRS; ++i) inode->direct[i] = -1;
+// makes everything done so far durable
+// the whole commit is one submission to the I/O engine, fsync included
+// (two with a journal and new file data, see commit_to_journal).
+// mutations wait for it to finish, reads carry on
+int ufs_sync(ufs *nfs) {
+	pthread_rwlock_wrlock(&nfs->commit_lock);
+	io_batch_t b;
+	io_batch_init(&b);
+	int rc = commit_dirty_to_disk(nfs, &b);
+	// journal records don't go through the mapping, msync of our ranges doesn't cover them
+	if (rc == 0) rc = io_batch_submit(nfs->io, &b, !nfs->map || nfs->journal); // Important
+	if (nfs->cache) bcache_flush_done(nfs->cache);
+	io_batch_free(&b);
+	if (rc == 0 && nfs->map) rc = map_sync(nfs);
+	if (rc == 0) __atomic_store_n(&nfs->sync_pending, 0, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&nfs->commit_lock);
+	return rc;
+}
+
+// set between ufs_hold_commits and ufs_release_commits on the thread that called them
+static __thread int commits_held;
 
-	if (nfs->inodes[pinum].size == DIRECT_PTRS * UFS_BLOCK_SIZE) return -1;
-	int is_pinode_full = 1; 
-	for (int i = 0; i < DIRECT_PTRS; ++i) {
-		if (nfs->inodes[pinum].direct[i] == (unsigned int)(-1)) continue;
+// called at the end of every mutation. with group commit the server batches
+// mutations and calls ufs_sync once for all of them before replying
+int ufs_commit(ufs *nfs) {
+	if (nfs->group_commit || commits_held) {
+		__atomic_store_n(&nfs->sync_pending, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return ufs_sync(nfs);
+}
+
+// the mutations this thread makes until ufs_release_commits are committed
+// together, by one ufs_sync there (or the group commit's)
+void ufs_hold_commits(ufs *nfs) {
+	(void)nfs; // the hold is per thread, nfs is for symmetry with the release
+	commits_held = 1;
+}
+
+int ufs_release_commits(ufs *nfs) {
+	commits_held = 0;
+	if (nfs->group_commit || !ufs_sync_pending(nfs)) return 0;
+	return ufs_sync(nfs);
+}
 
-		dir_block_t dir_block;
-		if (Read(nfs->fd, nfs->inodes[pinum].direct[i] * UFS_BLOCK_SIZE, 
-					&dir_block, UFS_BLOCK_SIZE) == -1) {
-			fprintf(stderr, "ufs_creat read fail\n");
+// 1 if a mutation has been committed that isn't on disk yet (group commit)
+int ufs_sync_pending(ufs *nfs) {
+	return __atomic_load_n(&nfs->sync_pending, __ATOMIC_RELAXED);
+}
+
+/* file block maps start */
+
+#define FMAP_MAX (INODE_EXTENTS + EXTENT_BLOCK_EXTENTS)
+
+// a file's blocks as runs of disk blocks in file order, both formats load
+// into this. a run of direct pointer holes has start -1
+typedef struct __fmap {
+	int n;
+	int nblocks;    // sum of the run lengths
+	int dirty_from; // first run changed since fmap_load
+	extent_t ext[FMAP_MAX];
+} fmap_t;
+
+void fmap_load(ufs *nfs, inode_t *inode, fmap_t *m) {
+	m->n = 0;
+	m->nblocks = 0;
+	if (is_inline(nfs, inode)) {
+		// no blocks yet
+	} else if (uses_extents(nfs, inode)) {
+		m->n = inode->nextents;
+		memcpy(m->ext, inode->extents, sizeof(extent_t) * (m->n < INODE_EXTENTS ? m->n : INODE_EXTENTS));
+		if (m->n > INODE_EXTENTS && Read(nfs, (off_t)inode->ext_blk * UFS_BLOCK_SIZE,
+					m->ext + INODE_EXTENTS, sizeof(extent_t) * (m->n - INODE_EXTENTS)) == -1) {
+			fprintf(stderr, "fmap_load extent block read fail\n");
 			exit(1);
 		}
-
-		for (int j = 0; j < 128; j++) {
-			if (dir_block.entries[j].inum == -1) {
-				is_pinode_full = 0;
-				break;
+		for (int i = 0; i < m->n; ++i) m->nblocks += m->ext[i].len;
+	} else {
+		int last = DIRECT_PTRS - 1;
+		while (last >= 0 && inode->direct[last] == (unsigned int)(-1)) last--;
+		for (int i = 0; i <= last; ++i) {
+			unsigned int blk = inode->direct[i];
+			extent_t *e = m->n ? &m->ext[m->n - 1] : NULL;
+			if (e && (blk == (unsigned int)(-1) ? e->start == blk
+						: e->start != (unsigned int)(-1) && e->start + e->len == blk)) {
+				e->len++;
+				continue;
 			}
+			m->ext[m->n].start = blk;
+			m->ext[m->n].len = 1;
+			m->n++;
 		}
-		if (!is_pinode_full) break;
+		m->nblocks = last + 1;
 	}
+	m->dirty_from = m->n;
+}
 
-	if (type == UFS_DIRECTORY) {
-		if (empty_pos_data == -1) return -1;
-		// we might require >= 2 data blocks
-		// gotta do this check here itself once as we r writing to disk
-		if (is_pinode_full && empty_pos_data2 == -1)
-			return -1; 
-		inode->size = 2 * sizeof(dir_ent_t); 
-		inode->direct[0] = empty_pos_data + nfs->s.data_region_addr;
+// puts the runs changed since fmap_load back into the inode (and extent block)
+int fmap_store(ufs *nfs, int inum, fmap_t *m) {
+	mark_inode_dirty(nfs, inum);
+	inode_t *inode = get_inode(nfs, inum);
+	if (!uses_extents(nfs, inode)) {
+		int k = 0;
+		for (int i = 0; i < m->n; ++i) {
+			for (unsigned int j = 0; j < m->ext[i].len; ++j) {
+				inode->direct[k++] = m->ext[i].start == (unsigned int)(-1) ? (unsigned int)(-1) : m->ext[i].start + j;
+			}
+		}
+		return 0;
+	}
 
-		// gotta allocate data block as well and put in . and ..
-		
-		set_bitmap(nfs->data_bp, empty_pos_data);
-		set_bitmap(nfs->dirty_data_bp, empty_pos_data);
+	inode->nextents = m->n;
+	memcpy(inode->extents, m->ext, sizeof(extent_t) * (m->n < INODE_EXTENTS ? m->n : INODE_EXTENTS));
+	int from = m->dirty_from > INODE_EXTENTS ? m->dirty_from : INODE_EXTENTS;
+	if (from < m->n && WriteMeta(nfs, (off_t)inode->ext_blk * UFS_BLOCK_SIZE + (from - INODE_EXTENTS) * sizeof(extent_t),
+				m->ext + from, sizeof(extent_t) * (m->n - from)) == -1)
+		return -1;
+	m->dirty_from = m->n;
+	return 0;
+}
 
-		dir_block_t data;
-		strcpy(data.entries[0].name, ".");
-		data.entries[0].inum = empty_pos_inode;
-		strcpy(data.entries[1].name, "..");
-		data.entries[1].inum = pinum; 
+/*
+ * appends disk blocks until the file has nblocks of them. they come from
+ * right after the last run when those are free, so a file written
+ * sequentially stays one extent, otherwise from the longest run the
+ * allocator finds. on failure nothing stays allocated
+ */
+int grow_locked(ufs *nfs, inode_t *inode, fmap_t *m, int nblocks) {
+	if (nblocks <= m->nblocks) return 0;
+	int ext = uses_extents(nfs, inode);
+	if (!ext && nblocks > DIRECT_PTRS) return -1;
+	if (nblocks - m->nblocks > nfs->dalloc->nfree) return -1;
+
+	int base = nfs->s.data_region_addr;
+	int n0 = m->n, nblocks0 = m->nblocks;
+	unsigned int len0 = n0 ? m->ext[n0 - 1].len : 0;
+	int ext_blk = -1; // extent block allocated here
+
+	while (m->nblocks < nblocks) {
+		int want = nblocks - m->nblocks;
+		extent_t *last = m->n ? &m->ext[m->n - 1] : NULL;
+		if (last && last->start != (unsigned int)(-1)) {
+			int got = alloc_get_at(nfs->dalloc, last->start + last->len - base, want);
+			if (got) {
+				last->len += got;
+				m->nblocks += got;
+				continue;
+			}
+		}
 
-		for (int i = 2; i < 128; ++i) data.entries[i].inum = -1;
+		if (m->n == FMAP_MAX) goto fail;
+		if (ext && m->n == INODE_EXTENTS && inode->ext_blk == (unsigned int)(-1)) {
+			if ((ext_blk = alloc_get(nfs->dalloc)) == -1) goto fail;
+			inode->ext_blk = ext_blk + base;
+		}
 
-		if (Write(nfs->fd, inode->direct[0] * UFS_BLOCK_SIZE, &data, sizeof(data)) == -1) {
-			fprintf(stderr, "ufs_creat write fail\n");
-			exit(1);
+		int got = want;
+		int start = alloc_get_run(nfs->dalloc, want);
+		if (start == -1) {
+			if ((start = alloc_get(nfs->dalloc)) == -1) goto fail;
+			got = 1 + alloc_get_at(nfs->dalloc, start + 1, want - 1);
 		}
-		empty_pos_data = empty_pos_data2;
-	} else {
-		inode->size = 0;
+		m->ext[m->n].start = start + base;
+		m->ext[m->n].len = got;
+		m->n++;
+		m->nblocks += got;
 	}
 
-	//time to update parent
-	set_bitmap(nfs->dirty_inode_bp, pinum);
-	if (is_pinode_full) {
-		if (empty_pos_data == -1) return -1;
-		if (nfs->inodes[pinum].size == DIRECT_PTRS * UFS_BLOCK_SIZE) return -1;
+	int from = n0 ? n0 - 1 : 0; // the last run may have grown in place
+	if (ext_blk != -1) mark_data_dirty(nfs, ext_blk);
+	for (int i = from; i < m->n; ++i) {
+		unsigned int j = i == n0 - 1 ? len0 : 0;
+		for (; j < m->ext[i].len; ++j) mark_data_dirty(nfs, m->ext[i].start + j - base);
+	}
+	if (m->dirty_from > from) m->dirty_from = from;
+	return 0;
 
-		dir_block_t data;
-		data.entries[0].inum = empty_pos_inode; 
-		strcpy(data.entries[0].name, name);
-		for (int i = 1; i < 128; ++i) {
-			data.entries[i].inum = -1;
-		}
+fail:
+	for (int i = n0 ? n0 - 1 : 0; i < m->n; ++i) {
+		unsigned int j = i == n0 - 1 ? len0 : 0;
+		for (; j < m->ext[i].len; ++j) alloc_put(nfs->dalloc, m->ext[i].start + j - base);
+	}
+	if (n0) m->ext[n0 - 1].len = len0;
+	m->n = n0;
+	m->nblocks = nblocks0;
+	if (ext_blk != -1) {
+		alloc_put(nfs->dalloc, ext_blk);
+		inode->ext_blk = -1;
+	}
+	return -1;
+}
 
-		int addr = empty_pos_data + nfs->s.data_region_addr; // in blocks
+int fmap_grow(ufs *nfs, inode_t *inode, fmap_t *m, int nblocks) {
+	pthread_mutex_lock(&nfs->dalloc_lock);
+	int rc = grow_locked(nfs, inode, m, nblocks);
+	pthread_mutex_unlock(&nfs->dalloc_lock);
+	return rc;
+}
 
-		if (Write(nfs->fd, addr * UFS_BLOCK_SIZE, &data, sizeof(data)) == -1) {
-			fprintf(stderr, "ufs_creat write fail\n");
-			exit(1);
+// frees every block the file maps, the extent block included
+void fmap_release(ufs *nfs, inode_t *inode, fmap_t *m) {
+	if (is_inline(nfs, inode)) return;
+	int base = nfs->s.data_region_addr;
+	pthread_mutex_lock(&nfs->dalloc_lock);
+	for (int i = 0; i < m->n; ++i) {
+		if (m->ext[i].start == (unsigned int)(-1)) continue;
+		for (unsigned int j = 0; j < m->ext[i].len; ++j) {
+			alloc_put(nfs->dalloc, m->ext[i].start + j - base);
+			mark_data_dirty(nfs, m->ext[i].start + j - base);
 		}
+	}
+	if (uses_extents(nfs, inode) && inode->ext_blk != (unsigned int)(-1)) {
+		alloc_put(nfs->dalloc, inode->ext_blk - base);
+		mark_data_dirty(nfs, inode->ext_blk - base);
+	}
+	pthread_mutex_unlock(&nfs->dalloc_lock);
+}
 
-		set_bitmap(nfs->data_bp, empty_pos_data);
-		set_bitmap(nfs->dirty_data_bp, empty_pos_data);
+// nbytes at offset, the whole range goes to the I/O engine as one batch.
+// holes read as zeros, the range must be within nblocks
+int fmap_io(ufs *nfs, fmap_t *m, int offset, char *buf, int nbytes, int write) {
+	io_batch_t b;
+	io_batch_init(&b);
+	int i = 0;
+	off_t first = 0; // file block run i starts at
+	while (i < m->n && first + m->ext[i].len <= offset / UFS_BLOCK_SIZE) first += m->ext[i++].len;
 
-		for (int i = 0; i < DIRECT_PTRS; ++i) {
-			if (nfs->inodes[pinum].direct[i] == (unsigned int)(-1)) {
-				nfs->inodes[pinum].direct[i] = addr;
-				break;
-			}
+	int cur = 0;
+	for (; i < m->n && cur < nbytes; first += m->ext[i++].len) {
+		off_t off = offset + cur - first * UFS_BLOCK_SIZE; // into the run
+		size_t sz = (size_t)m->ext[i].len * UFS_BLOCK_SIZE - off;
+		if (sz > (size_t)(nbytes - cur)) sz = nbytes - cur;
+
+		int rc = 0;
+		if (m->ext[i].start == (unsigned int)(-1)) {
+			if (write) rc = -1;
+			else memset(buf + cur, 0, sz);
+		} else {
+			rc = DataIO(nfs, &b, (off_t)m->ext[i].start * UFS_BLOCK_SIZE + off, buf + cur, sz, write);
 		}
-	} else {
-		dir_block_t *data = malloc(sizeof(dir_block_t));
-		for (int i = 0; i < DIRECT_PTRS; ++i) {
-			if (Read(nfs->fd, nfs->inodes[pinum].direct[i] * UFS_BLOCK_SIZE, data, UFS_BLOCK_SIZE) == -1) {
-				fprintf(stderr, "ufs_creat read fail\n");
-				exit(1);
-			}
+		if (rc == -1) break;
+		cur += sz;
+	}
 
-			int empty_idx = -1;
-			for (int j = 0; j < 128; ++j) {
-				if (data->entries[j].inum == -1) {
-					empty_idx = j;
-					break;
-				}
-			}
-			if (empty_idx == -1) continue;
+	int rc = cur == nbytes ? io_batch_submit(nfs->io, &b, 0) : -1;
+	io_batch_free(&b);
+	return rc;
+}
 
-			dir_ent_t dent;
-			strcpy(dent.name, name);
-			dent.inum = empty_pos_inode; 
+/*
+ * without a journal a commit isn't atomic, so a crash can leave the data
+ * bitmap out of step with the inodes. this rebuilds it from every inode's
+ * block map, which reads the whole inode table, so only images that weren't
+ * shut down cleanly pay for it
+ */
+void rebuild_data_bitmap(ufs *nfs) {
+	bitmap_t bp = calloc(nfs->data_bp_sz, sizeof(unsigned int));
+	unsigned int base = nfs->s.data_region_addr;
+	fmap_t m;
+	for (int i = 0; i < nfs->s.num_inodes; ++i) {
+		if (!get_bitmap(nfs->inode_bp, i)) continue;
+		inode_t *inode = get_inode(nfs, i);
+		if (is_inline(nfs, inode)) continue;
+		if (uses_extents(nfs, inode) && inode->nextents > FMAP_MAX) continue;
+
+		fmap_load(nfs, inode, &m);
+		for (int j = 0; j < m.n; ++j) {
+			if (m.ext[j].start == (unsigned int)(-1)) continue;
+			for (unsigned int k = 0; k < m.ext[j].len; ++k) {
+				if (m.ext[j].start + k - base < (unsigned int)nfs->s.num_data) set_bitmap(bp, m.ext[j].start + k - base);
+			}
+		}
+		if (uses_extents(nfs, inode) && inode->ext_blk - base < (unsigned int)nfs->s.num_data) set_bitmap(bp, inode->ext_blk - base);
+	}
 
-			if (Write(nfs->fd, (nfs->inodes[pinum].direct[i] * UFS_BLOCK_SIZE) + 
-						(empty_idx * sizeof(dir_ent_t)),
-						&dent, sizeof(dent)) == -1) {
-				fprintf(stderr, "ufs_creat write fail\n");
-				exit(1);
+	int leaked = 0, missing = 0;
+	for (int w = 0; w < nfs->data_bp_sz; ++w) {
+		if (bp[w] == nfs->data_bp[w]) continue;
+		for (int i = w * 32; i < w * 32 + 32 && i < nfs->s.num_data; ++i) {
+			int was = get_bitmap(nfs->data_bp, i);
+			if (was == get_bitmap(bp, i)) continue;
+			if (was) {
+				reset_bitmap(nfs->data_bp, i);
+				leaked++;
+			} else {
+				set_bitmap(nfs->data_bp, i);
+				missing++;
 			}
-			break;
+			mark_data_dirty(nfs, i);
 		}
-		free(data);
 	}
-	nfs->inodes[pinum].size += sizeof(dir_ent_t); 
+	free(bp);
+	if (!leaked && !missing) return;
+
+	fprintf(stderr, "ufs_init image wasn't shut down cleanly, data bitmap had %d leaked and %d missing blocks\n",
+			leaked, missing);
+	alloc_free(nfs->dalloc);
+	nfs->dalloc = alloc_init(nfs->data_bp, nfs->s.num_data);
+	if (ufs_sync(nfs) == -1) {
+		fprintf(stderr, "ufs_init data bitmap rebuild sync fail\n");
+		exit(1);
+	}
+}
 
-	if (commit_dirty_to_disk(nfs) == -1) {
-		fprintf(stderr, "ufs_creat couldn't commit dirty to disk\n");
+/* file block maps end */
+
+/* readahead start */
+
+// every read of a regular file comes through here. one that starts where the
+// last ended grows the window, a jump resets it. once less than half a window
+// is left in front of the reader the next stretch is queued for ufs_readahead
+void ra_note(ufs *nfs, int inum, int offset, int nbytes, int nblocks) {
+	if (!nfs->ra_max) return;
+	pthread_mutex_lock(&nfs->ra_lock);
+	ra_state_t *r = &nfs->ra[inum];
+	int sequential = offset == r->next;
+	if (!sequential) r->ra_end = 0;
+	r->next = offset + nbytes;
+	// a read at the front of the file starts a stream right away, anywhere
+	// else it takes two back to back
+	if (!sequential && offset != 0) {
+		r->window = 0;
+		pthread_mutex_unlock(&nfs->ra_lock);
+		return;
+	}
+	r->window = sequential && r->window ? r->window * 2 : UFS_RA_INIT;
+	if (r->window > nfs->ra_max) r->window = nfs->ra_max;
+
+	int end = (offset + nbytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE; // first block past this read
+	if (r->ra_end < end) r->ra_end = end;
+	if (r->ra_end - end < r->window / 2 && r->ra_end < nblocks && nfs->nra < UFS_RA_QUEUE) {
+		int to = end + r->window < nblocks ? end + r->window : nblocks;
+		ra_req_t *q = &nfs->ra_queue[nfs->nra++];
+		q->inum = inum;
+		q->first = r->ra_end;
+		q->n = to - r->ra_end;
+		r->ra_end = to;
+	}
+	pthread_mutex_unlock(&nfs->ra_lock);
+}
+
+// the cache buffers of a prefetch batch are loading until it is submitted
+void ra_submit(ufs *nfs, io_batch_t *b) {
+	int rc = io_batch_submit(nfs->io, b, 0);
+	if (nfs->cache) bcache_prefetch_done(nfs->cache, rc == 0);
+	if (rc == -1) {
+		fprintf(stderr, "ufs_readahead read fail\n");
 		exit(1);
 	}
-	
-	fsync(nfs->fd); // Important
 }
 
-int ufs_write(ufs *nfs, int inum, char *buf, int offset, int nbytes) { 
-	if (inum < 0 || inum >= nfs->s.num_inodes) return -1;
-	if (!get_bitmap(nfs->inode_bp, inum)) return -1;
-	if (nbytes > 4096 || offset > nfs->inodes[inum].size 
-			|| nfs->inodes[inum].type != UFS_REGULAR_FILE ||
-			offset < 0 || nbytes <= 0) return -1; 
+// reads the queued stretches into the block cache as one batch (or hints the
+// page cache when the image is mapped). the server calls this after the
+// replies are out, so it stays off the request path. every shard calls
+// it, one of them runs it at a time: the others leave the queue to it
+void ufs_readahead(ufs *nfs) {
+	if (pthread_mutex_trylock(&nfs->ra_run_lock)) return;
+	ra_req_t queue[UFS_RA_QUEUE];
+	pthread_mutex_lock(&nfs->ra_lock);
+	int n = nfs->nra;
+	memcpy(queue, nfs->ra_queue, sizeof(ra_req_t) * n);
+	nfs->nra = 0;
+	pthread_mutex_unlock(&nfs->ra_lock);
+	if (!n) {
+		pthread_mutex_unlock(&nfs->ra_run_lock);
+		return;
+	}
 
-	int strt = offset / UFS_BLOCK_SIZE;
-	offset %= UFS_BLOCK_SIZE;
-	int cur = 0;
-	set_bitmap(nfs->dirty_inode_bp, inum);
-	for (int i = strt; i < DIRECT_PTRS && cur < nbytes; ++i) {
-		if (nfs->inodes[inum].direct[i] == (unsigned int)(-1)) {
-			int empty_block = -1;
-			for (int j = 0; j < nfs->s.num_data; ++j) {
-				if (!get_bitmap(nfs->data_bp, j)) {
-					empty_block = j;
-					break;
-				}
-			}
-			if (empty_block == -1) return -1;
+	io_batch_t b;
+	io_batch_init(&b);
+	fmap_t m;
+	for (int k = 0; k < n; ++k) {
+		ra_req_t *q = &queue[k];
+		// a writer holding the inode may be waiting on the blocks queued so
+		// far, they go out before waiting for it
+		if (trylock_inode(nfs, q->inum) == -1) {
+			ra_submit(nfs, &b);
+			lock_inode(nfs, q->inum, 0);
+		}
+		inode_t *inode = get_inode(nfs, q->inum);
+		// may have been unlinked since
+		if (!get_bitmap(nfs->inode_bp, q->inum) || inode->type != UFS_REGULAR_FILE) {
+			unlock_inode(nfs, q->inum);
+			continue;
+		}
 
-			set_bitmap(nfs->data_bp, empty_block);
-			set_bitmap(nfs->dirty_data_bp, empty_block);
-			nfs->inodes[inum].direct[i] = empty_block + nfs->s.data_region_addr; 
+		fmap_load(nfs, inode, &m);
+		int first = 0;
+		for (int i = 0; i < m.n && first < q->first + q->n; first += m.ext[i++].len) {
+			int from = q->first > first ? q->first : first;
+			int to = q->first + q->n < first + (int)m.ext[i].len ? q->first + q->n : first + (int)m.ext[i].len;
+			if (from >= to || m.ext[i].start == (unsigned int)(-1)) continue;
+
+			int blk = m.ext[i].start + (from - first);
+			if (nfs->map) madvise(nfs->map + (off_t)blk * UFS_BLOCK_SIZE, (size_t)(to - from) * UFS_BLOCK_SIZE, MADV_WILLNEED);
+			else if (bcache_prefetch(nfs->cache, blk, to - from, &b) == -1) break;
 		}
+		unlock_inode(nfs, q->inum);
+	}
+
+	ra_submit(nfs, &b);
+	io_batch_free(&b);
+	pthread_mutex_unlock(&nfs->ra_run_lock);
+}
 
-		int sz = nbytes - cur;
-		if (sz > UFS_BLOCK_SIZE - offset) sz = UFS_BLOCK_SIZE - offset; 
+/* readahead end */
 
-		if (Write(nfs->fd, nfs->inodes[inum].direct[i] * UFS_BLOCK_SIZE + offset, 
-					buf + cur, sz) == -1) {
-			fprintf(stderr, "ufs_write fail\n");
-		       exit(1);	
+// pinum is write locked, the new inode gets locked here
+int creat_locked(ufs *nfs, int pinum, int type, char *name) {
+	if (!get_bitmap(nfs->inode_bp, pinum)) return -1;
+	inode_t *pinode = get_inode(nfs, pinum);
+	if (pinode->type != UFS_DIRECTORY) return -1;
+
+	int len = strlen(name);
+	if (len > 27) return -1;
+
+	// already exists
+	dindex_t *d = get_dindex(nfs, pinum);
+	if (dindex_find(d, name)) return -1; 
+
+	// the index knows which slots are taken, so finding one reads nothing.
+	// only when every block is full does the entry go in a new one
+	int dblk = -1, slot = -1, free_ptr = -1;
+	for (int i = 0; i < DIRECT_PTRS && slot == -1; ++i) {
+		if (pinode->direct[i] == (unsigned int)(-1)) {
+			if (free_ptr == -1) free_ptr = i;
+			continue;
 		}
+		if ((slot = dindex_free_slot(d, i)) != -1) dblk = i;
+	}
 
-		cur += sz;
-		nfs->inodes[inum].size += sz;
-		offset = 0;
+	int is_pinode_full = slot == -1; 
+	if (is_pinode_full) {
+		if (free_ptr == -1) return -1;
+		dblk = free_ptr;
+		slot = 0;
 	}
 
-	if (commit_dirty_to_disk(nfs) == -1) {
-		fprintf(stderr, "ufs_write commit dirty to disk fail\n");
+	// check for space before touching the bitmaps, so a failed creat leaks nothing.
+	// a new directory needs a block for . and .., a full parent needs one more
+	int data_needed = (type == UFS_DIRECTORY) + is_pinode_full;
+	pthread_mutex_lock(&nfs->ialloc_lock);
+	pthread_mutex_lock(&nfs->dalloc_lock);
+	int empty_pos_inode = -1, empty_pos_data = -1, empty_pos_data2 = -1;
+	if (nfs->ialloc->nfree && nfs->dalloc->nfree >= data_needed) {
+		empty_pos_inode = alloc_get(nfs->ialloc);
+		if (data_needed > 0) empty_pos_data = alloc_get(nfs->dalloc);
+		if (data_needed > 1) empty_pos_data2 = alloc_get(nfs->dalloc);
+	}
+	pthread_mutex_unlock(&nfs->dalloc_lock);
+	pthread_mutex_unlock(&nfs->ialloc_lock);
+	if (empty_pos_inode == -1) return -1;
+
+	lock_inode2(nfs, pinum, empty_pos_inode);
+	mark_inode_dirty(nfs, pinum);
+	mark_inode_dirty(nfs, empty_pos_inode);
+
+	inode_t* inode = get_inode(nfs, empty_pos_inode); 
+	inode->type = type;
+	for (int i = 0; i < DIRECT_PTRS; ++i) inode->direct[i] = -1;
+	if (uses_extents(nfs, inode)) inode->nextents = 0;
+
+	dir_block_t data;
+	if (type == UFS_DIRECTORY) {
+		inode->size = 2 * sizeof(dir_ent_t); 
+		inode->direct[0] = empty_pos_data + nfs->s.data_region_addr;
+
+		// gotta fill in the data block as well and put in . and ..
+		// the new directory's index starts out with them, no need to read it back later
+		mark_data_dirty(nfs, empty_pos_data);
+		dindex_free(nfs->dindex[empty_pos_inode]);
+		dindex_t *nd = dindex_create();
+		dindex_insert(nd, ".", empty_pos_inode, 0, 0);
+		dindex_insert(nd, "..", pinum, 0, 1);
+		nfs->dindex[empty_pos_inode] = nd;
+
+		dindex_block_image(nd, 0, &data);
+		if (WriteMeta(nfs, (off_t)inode->direct[0] * UFS_BLOCK_SIZE, &data, sizeof(data)) == -1) {
+			fprintf(stderr, "ufs_creat write fail\n");
+			exit(1);
+		}
+		empty_pos_data = empty_pos_data2;
+	} else {
+		inode->size = 0;
+	}
+
+	//time to update parent, the whole dir block is written from the index
+	if (is_pinode_full) {
+		pinode->direct[dblk] = empty_pos_data + nfs->s.data_region_addr;
+		mark_data_dirty(nfs, empty_pos_data);
+	}
+	dindex_insert(d, name, empty_pos_inode, dblk, slot);
+	dindex_block_image(d, dblk, &data);
+	if (WriteMeta(nfs, (off_t)pinode->direct[dblk] * UFS_BLOCK_SIZE, &data, sizeof(data)) == -1) {
+		fprintf(stderr, "ufs_creat write fail\n");
 		exit(1);
 	}
-	fsync(nfs->fd);
+	pinode->size += sizeof(dir_ent_t); 
+	unlock_inode2(nfs, pinum, empty_pos_inode);
 	return 0;
 }
 
-int ufs_read(ufs *nfs, int inum, char *buffer, int offset, int nbytes) {
-       if (inum < 0 || inum >= nfs->s.num_inodes) return -1;
-       if (!get_bitmap(nfs->inode_bp, inum)) return -1;
+//assumes that name is null-terminated, not sure how to verify it properly lmao...
+int ufs_creat(ufs *nfs, int pinum, int type, char *name) {
+	if (pinum < 0 || pinum >= nfs->s.num_inodes) return -1;
+	pthread_rwlock_rdlock(&nfs->commit_lock);
+	pthread_mutex_lock(&nfs->ns_lock);
+	lock_inode(nfs, pinum, 1);
+	int rc = creat_locked(nfs, pinum, type, name);
+	unlock_inode(nfs, pinum);
+	pthread_mutex_unlock(&nfs->ns_lock);
+	pthread_rwlock_unlock(&nfs->commit_lock);
+
+	if (rc == 0 && ufs_commit(nfs) == -1) {
+		fprintf(stderr, "ufs_creat couldn't commit dirty to disk\n");
+		exit(1);
+	}
+	return rc;
+}
 
-       if (offset < 0 || nbytes <= 0 || offset + nbytes > nfs->inodes[inum].size) return -1;
+// inum is write locked
+int write_locked(ufs *nfs, int inum, char *buf, int offset, int nbytes) { 
+	if (!get_bitmap(nfs->inode_bp, inum)) return -1;
+	inode_t *inode = get_inode(nfs, inum);
+	if (nbytes > UFS_MAX_IO || offset > inode->size 
+			|| inode->type != UFS_REGULAR_FILE ||
+			offset < 0 || nbytes <= 0) return -1; 
 
-       int strt = offset / UFS_BLOCK_SIZE;
-       int cur = 0;
-       offset %= UFS_BLOCK_SIZE;
+	if (is_inline(nfs, inode) && offset + nbytes <= nfs->inline_cap) {
+		// still fits in the inode, no data blocks involved
+		mark_inode_dirty(nfs, inum);
+		memcpy(inline_data(inode) + offset, buf, nbytes);
+	} else {
+		// outgrowing the inode: what it held goes to the new blocks in front
+		// of buf, as one write
+		char *merged = NULL;
+		inode_t saved;
+		if (is_inline(nfs, inode)) {
+			merged = malloc(offset + nbytes);
+			memcpy(merged, inline_data(inode), offset);
+			memcpy(merged + offset, buf, nbytes);
+			buf = merged;
+			nbytes += offset;
+			offset = 0;
+			saved = *inode;
+			inode->nextents = 0;
+			inode->ext_blk = -1;
+		}
 
-       if (nfs->inodes[inum].type == UFS_DIRECTORY && offset % sizeof(dir_ent_t)) return -1;
+		fmap_t m;
+		fmap_load(nfs, inode, &m);
+		if (fmap_grow(nfs, inode, &m, (offset + nbytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE) == -1) {
+			if (merged) *inode = saved;
+			free(merged);
+			return -1;
+		}
 
-       for (int i = strt; i < DIRECT_PTRS && cur < nbytes; ++i) {
-	     int sz = nbytes - cur;  
-	     if (sz > UFS_BLOCK_SIZE - offset) sz = UFS_BLOCK_SIZE - offset;
+		if (fmap_io(nfs, &m, offset, buf, nbytes, 1) == -1 || fmap_store(nfs, inum, &m) == -1) {
+			fprintf(stderr, "ufs_write fail\n");
+			exit(1);
+		}
+		free(merged);
+	}
+	// overwrites don't grow the file
+	if (offset + nbytes > inode->size) inode->size = offset + nbytes;
+	return 0;
+}
 
-	     if (Read(nfs->fd, nfs->inodes[inum].direct[i] * UFS_BLOCK_SIZE + offset, 
-				    buffer + cur, sz) == -1) {
-		    fprintf(stderr, "ufs_read fail\n");
-		    exit(1);
-	     }
+int ufs_write(ufs *nfs, int inum, char *buf, int offset, int nbytes) { 
+	if (inum < 0 || inum >= nfs->s.num_inodes) return -1;
+	pthread_rwlock_rdlock(&nfs->commit_lock);
+	lock_inode(nfs, inum, 1);
+	int rc = write_locked(nfs, inum, buf, offset, nbytes);
+	unlock_inode(nfs, inum);
+	pthread_rwlock_unlock(&nfs->commit_lock);
 
-	     cur += sz;
-	     offset = 0;
-       }
-       return 0;
+	if (rc == 0 && ufs_commit(nfs) == -1) {
+		fprintf(stderr, "ufs_write commit dirty to disk fail\n");
+		exit(1);
+	}
+	return rc;
 }
 
-int ufs_unlink(ufs *nfs, int pinum, char *name) {
-       if (pinum < 0 || pinum >= nfs->s.num_inodes) return -1;
-       if (!get_bitmap(nfs->inode_bp, pinum)) return -1;
-       if (!strcmp(name, ".") || !strcmp(name, "..")) return -1;
-
-       int inum = ufs_lookup(nfs, pinum, name);
-       if (inum == -1) return -1;
+// inum is locked
+int read_locked(ufs *nfs, int inum, char *buffer, int offset, int nbytes) {
+       if (!get_bitmap(nfs->inode_bp, inum)) return -1;
 
-       if (nfs->inodes[inum].type == UFS_DIRECTORY && nfs->inodes[inum].size != 2 * sizeof(dir_ent_t)) return -1;
+       inode_t *inode = get_inode(nfs, inum);
+       if (offset < 0 || nbytes <= 0 || offset + nbytes > inode->size) return -1;
 
-       reset_bitmap(nfs->inode_bp, inum);
-       set_bitmap(nfs->dirty_inode_bp, inum);
-       set_bitmap(nfs->dirty_inode_bp, pinum);
+       if (inode->type == UFS_DIRECTORY && offset % sizeof(dir_ent_t)) return -1;
 
-       for (int i = 0; i < DIRECT_PTRS; ++i) {
-	       if (nfs->inodes[inum].direct[i] == (unsigned int)(-1)) continue;
-	       reset_bitmap(nfs->data_bp, nfs->inodes[inum].direct[i]);
-	       set_bitmap(nfs->dirty_data_bp, nfs->inodes[inum].direct[i]);
+       // small files are all in the inode
+       if (is_inline(nfs, inode)) {
+	       memcpy(buffer, inline_data(inode) + offset, nbytes);
+	       return 0;
        }
 
-       //parent updation time
-       nfs->inodes[pinum].size -= sizeof(dir_ent_t);
-       for (int i = 0; i < DIRECT_PTRS; ++i) {
-	       if (nfs->inodes[pinum].direct[i] == (unsigned int)(-1)) continue;
-	       dir_block_t dir_block;
-	       if (Read(nfs->fd, nfs->inodes[pinum].direct[i] * UFS_BLOCK_SIZE, &dir_block, UFS_BLOCK_SIZE) == -1) {
-		       fprintf(stderr, "ufs_unlink pinode data block read fail\n");
-		       exit(1);
-	       }
+       fmap_t m;
+       fmap_load(nfs, inode, &m);
+       if ((offset + nbytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE > m.nblocks) return -1;
 
-	       int entry_idx = -1, cnt = 0;
-	       for (int j = 0; j < 128; ++j) {
-		       if (dir_block.entries[j].inum == -1) continue;
-		       ++cnt;
-		       if (!strcmp(dir_block.entries[j].name, name)) {
-			       entry_idx = j;
-		       }
-	       }
+       if (fmap_io(nfs, &m, offset, buffer, nbytes, 0) == -1) {
+	       fprintf(stderr, "ufs_read fail\n");
+	       exit(1);
+       }
+       if (inode->type == UFS_REGULAR_FILE) ra_note(nfs, inum, offset, nbytes, m.nblocks);
+       return 0;
+}
 
-	       if (entry_idx == -1) continue;
+int ufs_read(ufs *nfs, int inum, char *buffer, int offset, int nbytes) {
+       if (inum < 0 || inum >= nfs->s.num_inodes) return -1;
+       lock_inode(nfs, inum, 0);
+       int rc = read_locked(nfs, inum, buffer, offset, nbytes);
+       unlock_inode(nfs, inum);
+       return rc;
+}
 
-	       if (cnt == 1) {
-		       reset_bitmap(nfs->data_bp, nfs->inodes[pinum].direct[i]);
-		       set_bitmap(nfs->dirty_data_bp, nfs->inodes[pinum].direct[i]);
-		       nfs->inodes[pinum].direct[i] = -1;
-		       break;
-	       }
+// pinum and inum are write locked
+int unlink_locked(ufs *nfs, int pinum, int inum, char *name) {
+       inode_t *inode = get_inode(nfs, inum);
+       if (inode->type == UFS_DIRECTORY && inode->size != 2 * sizeof(dir_ent_t)) return -1;
+
+       pthread_mutex_lock(&nfs->ialloc_lock);
+       alloc_put(nfs->ialloc, inum);
+       pthread_mutex_unlock(&nfs->ialloc_lock);
+       mark_inode_dirty(nfs, inum);
+       pthread_mutex_lock(&nfs->ra_lock);
+       memset(&nfs->ra[inum], 0, sizeof(ra_state_t));
+       pthread_mutex_unlock(&nfs->ra_lock);
+       mark_inode_dirty(nfs, pinum);
+       inode_t *pinode = get_inode(nfs, pinum);
+
+       fmap_t m;
+       fmap_load(nfs, inode, &m);
+       fmap_release(nfs, inode, &m);
+       if (nfs->dindex[inum]) {
+	       dindex_free(nfs->dindex[inum]);
+	       nfs->dindex[inum] = NULL;
+       }
 
-	       dir_ent_t dentry;
-	       dentry.inum = -1;
-	       int addr = nfs->inodes[pinum].direct[i] * UFS_BLOCK_SIZE + entry_idx * sizeof(dir_ent_t);
-	       if (Write(nfs->fd, addr, &dentry, sizeof(dir_ent_t)) == -1) {
+       //parent updation time, the index tells us exactly which slot to clear
+       pinode->size -= sizeof(dir_ent_t);
+       dindex_t *d = nfs->dindex[pinum];
+       dindex_ent_t *e = dindex_find(d, name);
+       int i = e->blk;
+       dindex_remove(d, name);
+
+       if (d->blk_cnt[i] == 0) {
+	       int blk = pinode->direct[i] - nfs->s.data_region_addr;
+	       pthread_mutex_lock(&nfs->dalloc_lock);
+	       alloc_put(nfs->dalloc, blk);
+	       mark_data_dirty(nfs, blk);
+	       pthread_mutex_unlock(&nfs->dalloc_lock);
+	       pinode->direct[i] = -1;
+       } else {
+	       // rewritten whole from the index, no need to read it first
+	       dir_block_t data;
+	       dindex_block_image(d, i, &data);
+	       if (WriteMeta(nfs, (off_t)pinode->direct[i] * UFS_BLOCK_SIZE, &data, sizeof(data)) == -1) {
 		      fprintf(stderr, "ufs_unlink write fail\n");
 		      exit(1);
 	       }
-	       break;
        }
+       return 0;
+}
 
-       if (commit_dirty_to_disk(nfs) == -1) {
+int ufs_unlink(ufs *nfs, int pinum, char *name) {
+       if (pinum < 0 || pinum >= nfs->s.num_inodes) return -1;
+       if (!strcmp(name, ".") || !strcmp(name, "..")) return -1;
+
+       pthread_rwlock_rdlock(&nfs->commit_lock);
+       pthread_mutex_lock(&nfs->ns_lock);
+       lock_inode(nfs, pinum, 1);
+       int rc = -1;
+       int inum = lookup_locked(nfs, pinum, name);
+       if (inum >= 0) {
+	       lock_inode2(nfs, pinum, inum);
+	       rc = unlink_locked(nfs, pinum, inum, name);
+	       unlock_inode2(nfs, pinum, inum);
+       }
+       unlock_inode(nfs, pinum);
+       pthread_mutex_unlock(&nfs->ns_lock);
+       pthread_rwlock_unlock(&nfs->commit_lock);
+
+       if (rc == 0 && ufs_commit(nfs) == -1) {
 	       fprintf(stderr, "ufs_unlink commit dirty to disk fail\n");
 	       exit(1);
        }
-
-       fsync(nfs->fd);
-       return 0;
+       return rc;
 }
 
 /*
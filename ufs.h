@@ -1,6 +1,9 @@
 #ifndef __ufs_h__
 #define __ufs_h__
 
+#include <stddef.h>
+#include <pthread.h>
+
 #define UFS_DIRECTORY (0)
 #define UFS_REGULAR_FILE (1)
 
@@ -8,10 +11,31 @@
 
 #define DIRECT_PTRS (30)
 
+// on-disk format, super_t.version
+#define UFS_VERSION_DIRECT (0) // every inode has 30 direct block pointers
+#define UFS_VERSION_EXTENT (1) // regular files map their blocks with extents
+#define UFS_VERSION_INLINE (2) // extents, and inodes of super_t.inode_size bytes that hold small files' data
+
+// a run of len disk blocks starting at start
+typedef struct {
+    unsigned int start;
+    unsigned int len;
+} extent_t;
+
+#define INODE_EXTENTS (14)
+#define EXTENT_BLOCK_EXTENTS (UFS_BLOCK_SIZE / sizeof(extent_t)) // extents past INODE_EXTENTS
+
 typedef struct {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
     int size;   // bytes
-    unsigned int direct[DIRECT_PTRS];
+    union {
+        unsigned int direct[DIRECT_PTRS];
+        struct {
+            unsigned int nextents; // in file order, the first INODE_EXTENTS live here
+            unsigned int ext_blk;  // block holding the rest, -1 if none
+            extent_t extents[INODE_EXTENTS];
+        };
+    };
 } inode_t;
 
 typedef struct {
@@ -31,36 +55,144 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int journal_addr;      // block address (in blocks) of the metadata journal
+    int journal_len;       // in blocks, 0 means the image has no journal
+    int version;           // UFS_VERSION_*, images from before this field read as 0
+    int clean;             // 1 while the image is shut down cleanly, 0 while it is being served
+    int inode_size;        // bytes per inode, only read on UFS_VERSION_INLINE images (sizeof(inode_t) before)
 } super_t;
 
 typedef unsigned int* bitmap_t;
 
+// default size of the block cache (in blocks), 1MB
+#define UFS_DEFAULT_CACHE_BLOCKS (256)
+
+// default number of inode table blocks kept in memory, 2048 inodes
+#define UFS_DEFAULT_INODE_BLOCKS (64)
+
+// most bytes one ufs_read/ufs_write moves
+#define UFS_MAX_IO (1 << 20)
+
+// readahead window in blocks: where a sequential stream starts, and how far
+// it can grow (at most a quarter of the block cache)
+#define UFS_RA_INIT (4)
+#define UFS_RA_MAX (64)
+
+// most stretches queued for one ufs_readahead
+#define UFS_RA_QUEUE (16)
+
+// inode locks are striped, inum uses ilocks[inum % UFS_LOCK_STRIPES]
+#define UFS_LOCK_STRIPES (1024)
+
+// per-inode sequential read detection
+typedef struct __ra_state {
+	int next;   // offset the next read starts at if the stream keeps going
+	int window; // blocks to stay ahead of the reader, 0 while reads look random
+	int ra_end; // file block readahead has been queued up to
+} ra_state_t;
+
+// file blocks [first, first + n) of inum to be read ahead
+typedef struct __ra_req {
+	int inum, first, n;
+} ra_req_t;
+
+// knobs for ufs_init, passing NULL gets the defaults
+typedef struct __ufs_opts {
+	int cache_blocks; // block cache size in blocks, 0 disables the cache
+	int inode_blocks; // inode table blocks to keep in memory
+	int group_commit; // mutations leave the commit + fsync to ufs_sync
+	int use_mmap;     // serve the image out of a shared mapping instead of read/write
+	char *io_engine;  // "blocking" (default) or "uring"
+} ufs_opts_t;
+
+struct __alloc;
+struct __bcache;
+struct __dindex;
+struct __itable;
+struct __journal;
+struct __io_engine;
+
 typedef struct __ufs {
 	int fd;
+	struct __io_engine *io; // every block read/write/fsync goes through here
 	super_t s;
 	bitmap_t inode_bp; // inode bitmap
 	int inode_bp_sz; // inode bitmap size (size of inode_bp array)
 	bitmap_t data_bp; // data bitmap
         int data_bp_sz; // data bitmap size
-	inode_t *inodes;
+	inode_t *inodes; // the inode table in the mapping when meta_in_map, otherwise NULL
+	int inode_size;  // stride of the inode table
+	int inodes_per_block;
+	int inline_cap;  // most bytes a regular file keeps in its inode, 0 if the image can't
+	struct __itable *itable; // otherwise the part of it that is paged in, see get_inode
+
+	// dirty metadata (bitmap and inode table) blocks waiting for the next commit
+	int meta_addr;     // first metadata block
+	int meta_len;
+	char *meta_dirty;  // one flag per metadata block
+	int *dirty_list;   // the dirty ones, in the order they got dirtied
+	int ndirty;
+
+	struct __alloc *ialloc; // allocators over inode_bp and data_bp
+	struct __alloc *dalloc;
+	struct __bcache *cache; // block cache under Read/Write, NULL if disabled
+	struct __dindex **dindex; // per-directory name index, built lazily
+	struct __journal *journal; // metadata journal, NULL if the image has none
+
+	// mmap backend, map is NULL when it is off
+	char *map;
+	size_t map_size;
+	int meta_in_map;     // bitmaps and inode table point into the mapping
+	char *map_dirty;     // one flag per image block
+	int *map_dirty_list; // blocks to msync at the next ufs_sync
+	int map_ndirty;
+
+	int group_commit;  // see ufs_opts_t
+	int sync_pending;  // mutations since the last ufs_sync
+	int data_pending;  // file data written since the last journal commit, its record waits for it
+
+	ra_state_t *ra;    // one per inode
+	int ra_max;        // window limit, 0 when there is nothing to read ahead into
+	ra_req_t ra_queue[UFS_RA_QUEUE];
+	int nra;
 
-	//recording dirty parts to make writes convenient
-	//u would think its for caching writes or smth, but no, this
-	//system aint even close to efficient lol
-	bitmap_t dirty_inode_bp;
-	bitmap_t dirty_data_bp;
+	/*
+	 * the ufs_* calls can be made from several threads. an inode is guarded
+	 * by its stripe's rwlock, reads and lookups take it shared. creat and
+	 * unlink hold two and take ns_lock first so they can't deadlock on each
+	 * other. mutations share commit_lock and a commit takes it alone, reads
+	 * never touch it. the mutexes below it are only held for short stretches
+	 */
+	pthread_rwlock_t *ilocks;
+	pthread_rwlock_t commit_lock;
+	pthread_mutex_t ns_lock;
+	pthread_mutex_t ialloc_lock; // ialloc
+	pthread_mutex_t dalloc_lock; // dalloc
+	pthread_mutex_t dirty_lock;  // the dirty lists, metadata and mapping
+	pthread_mutex_t dindex_lock; // the dindex array
+	pthread_mutex_t ra_lock;     // ra and ra_queue
+	pthread_mutex_t ra_run_lock; // one ufs_readahead at a time, for bcache_prefetch
 } ufs;
 
 typedef struct __dir_block_t {
 	dir_ent_t entries[128];
 } dir_block_t;
 
-ufs* ufs_init(char *fname);
+ufs* ufs_init(char *fname, ufs_opts_t *opts);
 int ufs_lookup(ufs *nfs, int pinum, char *name);
+int ufs_stat(ufs *nfs, int inum, int *type, int *size);
+int ufs_readdir(ufs *nfs, int inum, int cookie, dir_ent_t *ents, int max, int *next);
 int ufs_creat(ufs *nfs, int pinum, int type, char *name);
 int ufs_write(ufs *nfs, int inum, char *buf, int offset, int nbytes);
 int ufs_read(ufs *nfs, int inum, char *buffer, int offset, int nbytes);
 int ufs_unlink(ufs *nfs, int pinum, char *name);
+int ufs_sync(ufs *nfs);
+int ufs_sync_pending(ufs *nfs);
+void ufs_hold_commits(ufs *nfs);
+int ufs_release_commits(ufs *nfs);
 void ufs_clean(ufs *nfs);
+void ufs_print_stats(ufs *nfs);
+void ufs_idle(ufs *nfs);
+void ufs_readahead(ufs *nfs);
 
 #endif // __ufs_h__